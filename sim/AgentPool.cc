@@ -0,0 +1,55 @@
+#include "AgentPool.hh"
+
+using namespace sim;
+
+Agent*
+AgentPool::storage()
+{
+  if (used_ == BLOCK_SIZE) {
+    if (blocks_in_use_ == blocks_.size())
+      blocks_.push_back(std::unique_ptr<Storage[]>(new Storage[BLOCK_SIZE]));
+    ++blocks_in_use_;
+    used_ = 0;
+  }
+  return reinterpret_cast<Agent *>(&blocks_[blocks_in_use_ - 1][used_++]);
+}
+
+Agent*
+AgentPool::allocate(const unsigned long id)
+{
+  if (free_.size()) {
+    Agent *agent = free_.back();
+    free_.pop_back();
+    size_t slot = agent->slot();
+    store_->zero_slot(slot);
+    return new (agent) Agent(id, store_, slot);
+  }
+  return new (storage()) Agent(id, store_, store_->append_slot());
+}
+
+Agent*
+AgentPool::construct(const unsigned long id, const size_t slot)
+{
+  return new (storage()) Agent(id, store_, slot);
+}
+
+void
+AgentPool::release(Agent *agent)
+{
+  free_.push_back(agent);
+}
+
+void
+AgentPool::copy_free_slots(const AgentPool &other)
+{
+  for (auto & agent : other.free_)
+    free_.push_back(construct(agent->id(), agent->slot()));
+}
+
+void
+AgentPool::clear()
+{
+  free_.clear();
+  blocks_in_use_ = 0;
+  used_ = BLOCK_SIZE;
+}
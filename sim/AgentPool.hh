@@ -0,0 +1,45 @@
+#ifndef SIM_AGENT_POOL_H
+#define SIM_AGENT_POOL_H
+
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "common.hh"
+
+namespace sim {
+
+  // Allocates the agents of a simulation in contiguous blocks. Agents that
+  // are released (dead agents the simulation does not keep) go on a free
+  // list with their agent store slot, and are reused, slot and all, by the
+  // next agents allocated. Agents are trivially destructible, so clear()
+  // releases all of them at once without visiting any.
+  class AgentPool {
+  private:
+    typedef std::aligned_storage<sizeof(Agent), alignof(Agent)>::type Storage;
+    static const size_t BLOCK_SIZE = 4096;
+    AgentStore *store_;
+    std::vector< std::unique_ptr<Storage[]> > blocks_;
+    size_t blocks_in_use_ = 0;
+    size_t used_ = BLOCK_SIZE;
+    std::vector<Agent *> free_;
+    Agent* storage();
+  public:
+    AgentPool(AgentStore *store) : store_(store) {}
+    AgentPool(const AgentPool &) = delete;
+    AgentPool& operator=(const AgentPool &) = delete;
+    // A new agent in a recycled slot, which is zeroed, or in a new slot.
+    Agent* allocate(const unsigned long id);
+    // A new agent for an existing slot of the store.
+    Agent* construct(const unsigned long id, const size_t slot);
+    void release(Agent *agent);
+    inline size_t num_free() const { return free_.size(); }
+    // Frees the slots another pool has free, in the same order, so that a
+    // copy of a simulation reuses them as the original would.
+    void copy_free_slots(const AgentPool &other);
+    // Releases every agent, keeping the blocks for reuse.
+    void clear();
+  };
+}
+
+#endif
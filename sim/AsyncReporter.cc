@@ -0,0 +1,86 @@
+#include "AsyncReporter.hh"
+
+using namespace sim;
+
+AsyncReporter::AsyncReporter(const size_t buffers) :
+  buffers_(buffers ? buffers : 1)
+{
+  thread_ = std::thread([this]() { work(); });
+}
+
+AsyncReporter::~AsyncReporter()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  changed_.notify_all();
+  thread_.join();
+}
+
+void
+AsyncReporter::work()
+{
+  for (;;) {
+    Task task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      changed_.wait(lock, [this]() { return stop_ || tasks_.size(); });
+      if (tasks_.empty())
+	return;
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+      running_ = true;
+    }
+    changed_.notify_all();
+    std::exception_ptr exception;
+    try {
+      task();
+    } catch (...) {
+      exception = std::current_exception();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      running_ = false;
+      if (exception && !exception_)
+	exception_ = exception;
+    }
+    changed_.notify_all();
+  }
+}
+
+/* Rethrows, once, the exception of a task. */
+
+void
+AsyncReporter::rethrow(std::unique_lock<std::mutex> &lock)
+{
+  if (exception_) {
+    std::exception_ptr exception = exception_;
+    exception_ = nullptr;
+    lock.unlock();
+    std::rethrow_exception(exception);
+  }
+}
+
+void
+AsyncReporter::post(Task task)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  changed_.wait(lock, [this]() {
+      return tasks_.size() + (running_ ? 1 : 0) < buffers_;
+    });
+  rethrow(lock);
+  tasks_.push_back(std::move(task));
+  lock.unlock();
+  changed_.notify_all();
+}
+
+void
+AsyncReporter::wait()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  changed_.wait(lock, [this]() {
+      return tasks_.empty() && running_ == false;
+    });
+  rethrow(lock);
+}
@@ -0,0 +1,47 @@
+#ifndef SIM_ASYNC_REPORTER_H
+#define SIM_ASYNC_REPORTER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace sim {
+
+  // Runs report tasks on a thread of its own, one at a time, in the order
+  // they are posted. At most buffers posted tasks wait or run at a time,
+  // and post() blocks until there is room: with the default of 2, one
+  // snapshot waits while the one before it is written (double buffering),
+  // and the memory held by snapshots stays bounded when the writing is
+  // slower than the simulation. The first exception thrown by a task is
+  // rethrown by the next post() or wait(); the tasks after it still run.
+  class AsyncReporter {
+  private:
+    typedef std::function<void()> Task;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<Task> tasks_;
+    size_t buffers_;
+    bool running_ = false;
+    bool stop_ = false;
+    std::exception_ptr exception_;
+    std::thread thread_;
+    void work();
+    void rethrow(std::unique_lock<std::mutex> &lock);
+  public:
+    AsyncReporter(const size_t buffers = 2);
+    AsyncReporter(const AsyncReporter &) = delete;
+    AsyncReporter& operator=(const AsyncReporter &) = delete;
+    // Runs the tasks still held, ignoring their exceptions, and joins the
+    // thread.
+    ~AsyncReporter();
+    void post(Task task);
+    // Waits until every task posted has run.
+    void wait();
+  };
+}
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef SIM_COUNTER_RNG_H
+#define SIM_COUNTER_RNG_H
+
+#include <cstdint>
+
+namespace sim {
+
+  // Philox4x32-10 counter-based random number generator (Salmon et al.,
+  // "Parallel random numbers: as easy as 1, 2, 3", SC 2011).
+  //
+  // Every number is a pure function of a key and a counter, so there is no
+  // state to carry from one draw to the next. The simulation keys it by
+  // (seed, replicate) and sets the counter to (iteration, agent id, event
+  // slot, draw), which gives every agent its own stream in every event of
+  // every iteration, whatever thread or order the agent is processed in.
+  //
+  // It satisfies UniformRandomBitGenerator, so it can be passed to the
+  // standard distributions just like sim::rng.
+  class CounterRng {
+  private:
+    uint32_t key_[2];
+    uint32_t counter_[4];
+    uint32_t block_[4];
+    unsigned used_ = 4;
+    static inline void mulhilo(const uint32_t a, const uint32_t b,
+			       uint32_t &hi, uint32_t &lo)
+    {
+      uint64_t product = (uint64_t) a * b;
+      hi = product >> 32;
+      lo = (uint32_t) product;
+    }
+  public:
+    typedef uint64_t result_type;
+    CounterRng(const uint32_t seed = 0, const uint32_t replicate = 0)
+    {
+      set_key(seed, replicate);
+      set_stream(0, 0, 0);
+    }
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT64_MAX; }
+    void set_key(const uint32_t seed, const uint32_t replicate)
+    {
+      key_[0] = seed;
+      key_[1] = replicate;
+      used_ = 4;
+    }
+    // Selects a stream and rewinds it to its first draw.
+    inline void set_stream(const uint32_t iteration,
+			   const uint32_t agent_id,
+			   const uint32_t slot)
+    {
+      counter_[0] = 0;
+      counter_[1] = slot;
+      counter_[2] = agent_id;
+      counter_[3] = iteration;
+      used_ = 4;
+    }
+    // The raw Philox4x32-10 bijection of one counter block under a key.
+    static void philox(const uint32_t key[2], const uint32_t counter[4],
+		       uint32_t out[4])
+    {
+      uint32_t k0 = key[0], k1 = key[1];
+      uint32_t c0 = counter[0], c1 = counter[1];
+      uint32_t c2 = counter[2], c3 = counter[3];
+      for (unsigned round = 0; round < 10; ++round) {
+	uint32_t hi0, lo0, hi1, lo1;
+	if (round) {
+	  k0 += 0x9E3779B9;
+	  k1 += 0xBB67AE85;
+	}
+	mulhilo(0xD2511F53, c0, hi0, lo0);
+	mulhilo(0xCD9E8D57, c2, hi1, lo1);
+	c0 = hi1 ^ c1 ^ k0;
+	c1 = lo1;
+	c2 = hi0 ^ c3 ^ k1;
+	c3 = lo0;
+      }
+      out[0] = c0;
+      out[1] = c1;
+      out[2] = c2;
+      out[3] = c3;
+    }
+    inline result_type operator()()
+    {
+      if (used_ >= 4) {
+	philox(key_, counter_, block_);
+	++counter_[0];
+	used_ = 0;
+      }
+      result_type r = ((result_type) block_[used_] << 32) | block_[used_ + 1];
+      used_ += 2;
+      return r;
+    }
+    void discard(unsigned long long n)
+    {
+      while (n--)
+	(*this)();
+    }
+  };
+
+  // Stream identifiers for draws that are not made in an agent event.
+  const uint32_t INITIALIZATION_ITERATION = UINT32_MAX;
+  const uint32_t GLOBAL_STREAM_ID = UINT32_MAX;
+  // Event slots of the streams used by the batch Bernoulli draws, to which
+  // the parameter number, or the state number, is added.
+  const uint32_t BATCH_STREAM_SLOT = 0x80000000;
+  const uint32_t BATCH_STATE_STREAM_SLOT = 0xC0000000;
+  // Event slot of the streams of scheduled events, to which the event
+  // number is added: for n events, the streams event times are sampled
+  // from, then at n those the events run with, then at 2n those event
+  // times are resampled from after an agent's event ran.
+  const uint32_t SCHEDULE_STREAM_SLOT = 0x40000000;
+  // Event slot of the streams the parallel shuffle draws from, keyed by
+  // chunk or bucket number in place of the agent id.
+  const uint32_t SHUFFLE_STREAM_SLOT = 0x20000000;
+
+  // Uniform real in [0, 1) with 53 random bits.
+  template <typename Generator>
+  inline double uniform_real(Generator &g)
+  {
+    return (g() >> 11) * (1.0 / 9007199254740992.0);
+  }
+}
+
+#endif
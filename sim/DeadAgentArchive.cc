@@ -0,0 +1,114 @@
+#include <cstring>
+#include <sstream>
+
+#include "sim.hh"
+
+using namespace sim;
+
+namespace {
+  const char MAGIC[8] = {'S', 'I', 'M', 'D', 'E', 'A', 'D', '\0'};
+
+  template <typename T>
+  void append(std::vector<char> &buffer, const T value)
+  {
+    const char *bytes = reinterpret_cast<const char *>(&value);
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+  }
+}
+
+DeadAgentArchive::DeadAgentArchive(const char *filename,
+				   const std::vector<unsigned> &states) :
+  file_(new File), states_(states)
+{
+  file_->out.open(filename, std::ios::binary | std::ios::trunc);
+  if (file_->out.fail()) {
+    std::stringstream ss;
+    ss << "Can't open dead agent archive " << filename;
+    throw SimulationException(ss.str().c_str());
+  }
+  std::vector<char> header(MAGIC, MAGIC + sizeof(MAGIC));
+  append<uint32_t>(header, VERSION);
+  append<uint32_t>(header, states_.size());
+  for (auto & state : states_)
+    append<uint32_t>(header, state);
+  file_->out.write(header.data(), header.size());
+}
+
+/* Write the buffered records. The caller holds the lock. */
+
+void
+DeadAgentArchive::File::write_buffer()
+{
+  out.write(buffer.data(), buffer.size());
+  out.flush();
+  buffer.clear();
+  if (out.fail())
+    throw SimulationException("Error writing dead agent archive.");
+}
+
+void
+DeadAgentArchive::operator()(const Simulation *s, const Agent *agent)
+{
+  std::lock_guard<std::mutex> lock(file_->mutex);
+  std::vector<char> &buffer = file_->buffer;
+  append<uint64_t>(buffer, agent->id());
+  append<uint32_t>(buffer, s->replicate());
+  append<uint64_t>(buffer, s->iteration());
+  for (auto & state : states_)
+    append<double>(buffer, s->agent_store.has_state(state) ?
+		   agent->states[state][0] : 0.0);
+  if (buffer.size() >= 65536)
+    file_->write_buffer();
+}
+
+void
+DeadAgentArchive::flush()
+{
+  std::lock_guard<std::mutex> lock(file_->mutex);
+  file_->write_buffer();
+}
+
+void
+DeadAgentArchive::read(const char *filename,
+		       std::function<void(unsigned long,
+					  unsigned,
+					  unsigned long,
+					  const std::vector<real> &)> record,
+		       std::vector<unsigned> *states)
+{
+  std::ifstream in(filename, std::ios::binary);
+  char magic[sizeof(MAGIC)];
+  uint32_t version, num_states;
+
+  if (in.fail()) {
+    std::stringstream ss;
+    ss << "Can't open dead agent archive " << filename;
+    throw SimulationException(ss.str().c_str());
+  }
+  in.read(magic, sizeof(magic));
+  in.read(reinterpret_cast<char *>(&version), sizeof(version));
+  in.read(reinterpret_cast<char *>(&num_states), sizeof(num_states));
+  if (in.fail() || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+    throw SimulationException("Not a dead agent archive.");
+  if (version != VERSION && version != 1)
+    throw SimulationException("Unsupported dead agent archive version.");
+  std::vector<uint32_t> state_ids(num_states);
+  in.read(reinterpret_cast<char *>(state_ids.data()),
+	  num_states * sizeof(uint32_t));
+  if (states)
+    states->assign(state_ids.begin(), state_ids.end());
+
+  uint64_t id, iteration;
+  uint32_t replicate = 0;
+  std::vector<real> values(num_states);
+  while (in.read(reinterpret_cast<char *>(&id), sizeof(id))) {
+    if (version > 1)
+      in.read(reinterpret_cast<char *>(&replicate), sizeof(replicate));
+    in.read(reinterpret_cast<char *>(&iteration), sizeof(iteration));
+    in.read(reinterpret_cast<char *>(values.data()),
+	    num_states * sizeof(double));
+    if (in.fail())
+      throw SimulationException("Truncated dead agent archive.");
+    record(id, replicate, iteration, values);
+  }
+}
@@ -0,0 +1,57 @@
+#ifndef SIM_DEAD_AGENT_ARCHIVE_H
+#define SIM_DEAD_AGENT_ARCHIVE_H
+
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "common.hh"
+
+namespace sim {
+
+  // A dead agent sink that appends each dead agent to a binary file: its
+  // id, the replicate and iteration it was removed in and the first element
+  // of each of a chosen set of states. The file starts with the header
+  //   "SIMDEAD" '\0', uint32 version, uint32 number of states,
+  //   uint32 state id for each state,
+  // followed by one record per agent of
+  //   uint64 id, uint32 replicate, uint64 iteration,
+  //   double value for each state,
+  // in the byte order of the machine that wrote it. Copies of an archive
+  // share the same file and buffer, under a lock, so it can be passed by
+  // value as a DeadAgentSink, and the replicates of montecarlo_parallel
+  // can write their deaths to the same one. Version 1 files, which have no
+  // replicate, are read as replicate 0.
+  class DeadAgentArchive {
+  private:
+    struct File {
+      std::mutex mutex;
+      std::ofstream out;
+      std::vector<char> buffer;
+      void write_buffer();
+      ~File() { out.write(buffer.data(), buffer.size()); }
+    };
+    std::shared_ptr<File> file_;
+    std::vector<unsigned> states_;
+  public:
+    static const uint32_t VERSION = 2;
+    DeadAgentArchive(const char *filename,
+		     const std::vector<unsigned> &states);
+    void operator()(const Simulation *s, const Agent *agent);
+    void flush();
+    // Calls record for every agent in an archive, in the order written.
+    static void read(const char *filename,
+		     std::function<void(unsigned long id,
+					unsigned replicate,
+					unsigned long iteration,
+					const std::vector<real> &values)>
+		     record,
+		     std::vector<unsigned> *states = nullptr);
+  };
+}
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef SIM_EVENT_PIPELINE_H
+#define SIM_EVENT_PIPELINE_H
+
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+
+#include "common.hh"
+
+namespace sim {
+
+  // A sequence of agent event functors run as a single agent event, e.g.
+  //   s.set_events({make_event_pipeline(UpdatePositionEvent(),
+  //                                     DeathEvent())});
+  // The events are called in order, stopping once one kills the agent, as
+  // when they are set separately. Their types are known at compile time,
+  // so the calls can be inlined into one function instead of being made
+  // one std::function at a time. With counter-based streams the events of
+  // a pipeline share the stream of the pipeline's event slot.
+  template <typename... Events>
+  class EventPipeline {
+  private:
+    std::tuple<Events...> events_;
+
+    template <size_t I>
+    inline typename std::enable_if<(I == sizeof...(Events))>::type
+    apply(Simulation *, Agent *) {}
+    template <size_t I>
+    inline typename std::enable_if<(I < sizeof...(Events))>::type
+    apply(Simulation *s, Agent *agent)
+    {
+      std::get<I>(events_)(s, agent);
+      if (I + 1 < sizeof...(Events) && s->is_killed())
+	return;
+      apply<I + 1>(s, agent);
+    }
+  public:
+    EventPipeline() {}
+    EventPipeline(const Events &... events) : events_(events...) {}
+    inline void operator()(Simulation *s, Agent *agent)
+    {
+      apply<0>(s, agent);
+    }
+  };
+
+  template <typename... Events>
+  EventPipeline<Events...> make_event_pipeline(const Events &... events)
+  {
+    return EventPipeline<Events...>(events...);
+  }
+}
+
+#endif
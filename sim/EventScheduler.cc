@@ -0,0 +1,46 @@
+#include "sim.hh"
+
+using namespace sim;
+
+void
+EventScheduler::reset(const size_t num_events)
+{
+  num_events_ = num_events;
+  queue_ = std::priority_queue<Entry, std::vector<Entry>,
+			       std::greater<Entry> >();
+  generations_.clear();
+}
+
+void
+EventScheduler::push(const unsigned long iteration, Agent *agent,
+		     const uint32_t event)
+{
+  queue_.push({iteration, agent->id(), agent, event,
+	generation(agent->slot(), event)});
+}
+
+void
+EventScheduler::cancel(const Agent *agent, const uint32_t event)
+{
+  ++generation(agent->slot(), event);
+}
+
+void
+EventScheduler::cancel(const Agent *agent)
+{
+  for (uint32_t event = 0; event <= num_events_; ++event)
+    ++generation(agent->slot(), event);
+}
+
+bool
+EventScheduler::pop_due(const unsigned long iteration, Entry &entry)
+{
+  while (queue_.size() && queue_.top().iteration <= iteration) {
+    entry = queue_.top();
+    queue_.pop();
+    if (entry.generation == generation(entry.agent->slot(), entry.event) &&
+	entry.agent->id() == entry.id)
+      return true;
+  }
+  return false;
+}
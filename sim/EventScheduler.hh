@@ -0,0 +1,78 @@
+#ifndef SIM_EVENT_SCHEDULER_H
+#define SIM_EVENT_SCHEDULER_H
+
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <vector>
+
+#include "common.hh"
+
+namespace sim {
+
+  // An agent event that happens at a random time. hazard returns the
+  // probability per unit of time (year) of the event for an agent, and
+  // action is run when it happens. The times are resampled when any of
+  // the rate parameters listed changes.
+  struct ScheduledEvent {
+    Hazard hazard;
+    AgentEvent action;
+    std::vector<unsigned> parameters;
+    std::vector<real> parameter_values;
+  };
+
+  // The queue of a simulation's scheduled agent events: for each agent and
+  // scheduled event, the iteration the event next happens in. Entries are
+  // not removed when an agent dies or an event is resampled; instead the
+  // generation of the agent's slot is bumped, and entries of an older
+  // generation are dropped when they reach the front of the queue. An
+  // entry for the event number sample_event() asks for all the agent's
+  // events to be sampled.
+  class EventScheduler {
+  public:
+    struct Entry {
+      unsigned long iteration;
+      unsigned long id;
+      Agent *agent;
+      uint32_t event;
+      uint32_t generation;
+      // Entries due in the same iteration are ordered by agent id and
+      // event, so that they fire in the same order on every run.
+      bool operator>(const Entry &other) const
+      {
+	if (iteration != other.iteration)
+	  return iteration > other.iteration;
+	if (id != other.id)
+	  return id > other.id;
+	return event > other.event;
+      }
+    };
+  private:
+    size_t num_events_ = 0;
+    std::priority_queue<Entry, std::vector<Entry>,
+			std::greater<Entry> > queue_;
+    std::vector<uint32_t> generations_;
+    inline uint32_t& generation(const size_t slot, const uint32_t event)
+    {
+      size_t i = slot * (num_events_ + 1) + event;
+      if (i >= generations_.size())
+	generations_.resize((slot + 1) * (num_events_ + 1), 0);
+      return generations_[i];
+    }
+  public:
+    inline size_t size() const { return queue_.size(); }
+    inline uint32_t sample_event() const { return num_events_; }
+    // Drops every entry and sets the number of scheduled events.
+    void reset(const size_t num_events);
+    void push(const unsigned long iteration, Agent *agent,
+	      const uint32_t event);
+    // Invalidates the entries of an agent for one event or all of them.
+    void cancel(const Agent *agent, const uint32_t event);
+    void cancel(const Agent *agent);
+    // Pops the next valid entry due at or before iteration into entry.
+    // Returns false when there is none.
+    bool pop_due(const unsigned long iteration, Entry &entry);
+  };
+}
+
+#endif
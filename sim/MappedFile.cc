@@ -0,0 +1,48 @@
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.hh"
+#include "MappedFile.hh"
+
+using namespace sim;
+
+MappedFile::MappedFile(const char *filename, const char *description)
+{
+  struct stat st;
+  int fd = open(filename, O_RDONLY);
+
+  if (fd == -1) {
+    std::stringstream ss;
+    ss << "Can't open " << description << " " << filename;
+    throw SimulationException(ss.str().c_str());
+  }
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    std::stringstream ss;
+    ss << "Error reading " << description << " " << filename;
+    throw SimulationException(ss.str().c_str());
+  }
+  size_ = st.st_size;
+  if (size_) {
+    void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      std::stringstream ss;
+      ss << "Error reading " << description << " " << filename;
+      throw SimulationException(ss.str().c_str());
+    }
+    madvise(data, size_, MADV_SEQUENTIAL);
+    data_ = (const char *) data;
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+  if (data_)
+    munmap((void *) data_, size_);
+}
@@ -0,0 +1,25 @@
+#ifndef SIM_MAPPED_FILE_H
+#define SIM_MAPPED_FILE_H
+
+#include <cstddef>
+
+namespace sim {
+
+  // A file mapped read-only into memory for the life of the object.
+  // description names the kind of file in error messages, as in
+  // "Can't open CSV file data.csv".
+  class MappedFile {
+  private:
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+  public:
+    MappedFile(const char *filename, const char *description = "file");
+    MappedFile(const MappedFile &) = delete;
+    MappedFile& operator=(const MappedFile &) = delete;
+    ~MappedFile();
+    inline const char *data() const { return data_; }
+    inline size_t size() const { return size_; }
+  };
+}
+
+#endif
@@ -0,0 +1,300 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "sim.hh"
+
+using namespace sim;
+
+namespace {
+  const char MAGIC[8] = {'S', 'I', 'M', 'S', 'N', 'A', 'P', '\0'};
+  const char CHECKPOINT_MAGIC[8] = {'S', 'I', 'M', 'C', 'K', 'P', 'T', '\0'};
+  const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+  template <typename T>
+  void append(std::vector<char> &buffer, const T value)
+  {
+    const char *bytes = reinterpret_cast<const char *>(&value);
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+  }
+
+  // Appends the vectors of a parameter or state map as
+  // uint32 number of vectors, then uint32 id, uint32 size, double values.
+  template <typename Map>
+  void append_map(std::vector<char> &buffer, const Map &map)
+  {
+    std::vector< std::pair<unsigned, const std::vector<real> *> > entries;
+#ifdef SIM_VECTORIZE
+    for (unsigned i = 0; i < map.size(); ++i)
+      if (map[i].size())
+	entries.push_back({i, &map[i]});
+#else
+    for (auto & entry : map)
+      entries.push_back({entry.first, &entry.second});
+#endif
+    append<uint32_t>(buffer, entries.size());
+    for (auto & entry : entries) {
+      append<uint32_t>(buffer, entry.first);
+      append<uint32_t>(buffer, entry.second->size());
+      for (auto & value : *entry.second)
+	append<double>(buffer, value);
+    }
+  }
+
+  void open_for_writing(std::ofstream &out, const char *filename,
+			const char *description)
+  {
+    out.open(filename, std::ios::binary | std::ios::trunc);
+    if (out.fail()) {
+      std::stringstream ss;
+      ss << "Can't open " << description << " " << filename;
+      throw SimulationException(ss.str().c_str());
+    }
+  }
+}
+
+// Reads consecutive values from a mapped file, checking it is long enough.
+class PopulationSnapshot::Reader {
+private:
+  const char *begin_;
+  const char *p_;
+  const char *end_;
+public:
+  Reader(const MappedFile &file) :
+    begin_(file.data()), p_(file.data()), end_(file.data() + file.size()) {}
+  const char* take(const size_t bytes)
+  {
+    if ((size_t) (end_ - p_) < bytes)
+      throw SimulationException("Truncated population snapshot.");
+    const char *data = p_;
+    p_ += bytes;
+    return data;
+  }
+  void align(const size_t alignment)
+  {
+    take((alignment - (p_ - begin_) % alignment) % alignment);
+  }
+  template <typename T>
+  T get()
+  {
+    T value;
+    memcpy(&value, take(sizeof(T)), sizeof(T));
+    return value;
+  }
+  template <typename Map>
+  void get_map(Map &map)
+  {
+    uint32_t num_entries = get<uint32_t>();
+    for (uint32_t i = 0; i < num_entries; ++i) {
+      uint32_t id = get<uint32_t>();
+      uint32_t size = get<uint32_t>();
+      std::vector<real> values(size);
+      if (size)
+	memcpy(values.data(), take(size * sizeof(double)),
+	       size * sizeof(double));
+#ifdef SIM_VECTORIZE
+      if (id >= map.size())
+	map.resize(id + 1);
+#endif
+      map[id] = std::move(values);
+    }
+  }
+};
+
+/* Write the population section, which starts at a multiple of 8 bytes
+   into the file. */
+void
+PopulationSnapshot::write_population(std::ostream &out, const Simulation &s,
+				     const bool with_dead)
+{
+  std::vector< std::pair<unsigned, unsigned> > columns;
+  std::vector<char> buffer(MAGIC, MAGIC + sizeof(MAGIC));
+  std::vector<const Agent *> population(s.agents.begin(), s.agents.end());
+
+  if (with_dead)
+    population.insert(population.end(), s.dead_agents.begin(),
+		      s.dead_agents.end());
+  for (unsigned state = 0; state < s.agent_store.num_states(); ++state)
+    for (unsigned element = 0; element < s.agent_store.arity(state);
+	 ++element)
+      columns.push_back({state, element});
+
+  append<uint32_t>(buffer, VERSION);
+  append<uint32_t>(buffer, BYTE_ORDER_MARK);
+  append<uint64_t>(buffer, s.agents.size());
+  append<uint64_t>(buffer, population.size() - s.agents.size());
+  append<uint64_t>(buffer, s.agent_count_);
+  append<uint32_t>(buffer, columns.size());
+  for (auto & column : columns) {
+    append<uint32_t>(buffer, column.first);
+    append<uint32_t>(buffer, column.second);
+  }
+  append_map(buffer, s.states);
+  buffer.resize((buffer.size() + 7) / 8 * 8, 0);
+  out.write(buffer.data(), buffer.size());
+
+  std::vector<uint64_t> ids;
+  ids.reserve(population.size());
+  for (auto & agent : population)
+    ids.push_back(agent->id());
+  out.write(reinterpret_cast<const char *>(ids.data()),
+	    ids.size() * sizeof(uint64_t));
+
+  // Agents are written in order, so their slots are gathered column by
+  // column.
+  std::vector<double> values(population.size());
+  for (auto & column : columns) {
+    const std::vector<real> &store_column =
+      s.agent_store.column(column.first, column.second);
+    for (size_t i = 0; i < population.size(); ++i)
+      values[i] = store_column[population[i]->slot()];
+    out.write(reinterpret_cast<const char *>(values.data()),
+	      values.size() * sizeof(double));
+  }
+}
+
+void
+PopulationSnapshot::read_population(Reader &in, Simulation &s)
+{
+  if (memcmp(in.take(sizeof(MAGIC)), MAGIC, sizeof(MAGIC)) != 0)
+    throw SimulationException("Not a population snapshot.");
+  if (in.get<uint32_t>() != VERSION)
+    throw SimulationException("Unsupported population snapshot version.");
+  if (in.get<uint32_t>() != BYTE_ORDER_MARK)
+    throw SimulationException("Population snapshot has another byte order.");
+  uint64_t num_agents = in.get<uint64_t>();
+  uint64_t num_dead = in.get<uint64_t>();
+  uint64_t next_id = in.get<uint64_t>();
+  uint32_t num_columns = in.get<uint32_t>();
+  std::vector< std::pair<uint32_t, uint32_t> > columns;
+  for (uint32_t i = 0; i < num_columns; ++i) {
+    uint32_t state = in.get<uint32_t>();
+    columns.push_back({state, in.get<uint32_t>()});
+  }
+  in.get_map(s.states);
+  in.align(8);
+
+  size_t population = num_agents + num_dead;
+  s.clear_agents();
+  for (auto & column : columns)
+    s.agent_store.set_arity(column.first, column.second + 1);
+  s.agent_store.resize(population);
+  const char *ids = in.take(population * sizeof(uint64_t));
+  for (auto & column : columns) {
+    const char *values = in.take(population * sizeof(double));
+    if (population)
+      memcpy(s.agent_store.column(column.first, column.second).data(),
+	     values, population * sizeof(double));
+  }
+
+  s.agents.reserve(num_agents);
+  s.dead_agents.reserve(num_dead);
+  for (size_t i = 0; i < population; ++i) {
+    uint64_t id;
+    memcpy(&id, ids + i * sizeof(uint64_t), sizeof(uint64_t));
+    Agent *agent = s.agent_pool_.construct(id, i);
+    if (i < num_agents)
+      s.agents.push_back(agent);
+    else
+      s.dead_agents.push_back(agent);
+  }
+  s.agent_count_ = next_id;
+}
+
+void
+PopulationSnapshot::write(const Simulation &s, const char *filename)
+{
+  std::ofstream out;
+
+  open_for_writing(out, filename, "population snapshot");
+  write_population(out, s, false);
+  if (out.fail())
+    throw SimulationException("Error writing population snapshot.");
+}
+
+void
+PopulationSnapshot::read(Simulation &s, const char *filename)
+{
+  MappedFile file(filename, "population snapshot");
+  Reader in(file);
+
+  if (file.size() < sizeof(MAGIC))
+    throw SimulationException("Not a population snapshot.");
+  read_population(in, s);
+}
+
+/* The checkpoint is written to a temporary file which is then renamed, so
+   a run killed while writing leaves the previous checkpoint intact. */
+void
+PopulationSnapshot::write_checkpoint(const Simulation &s,
+				     const char *filename,
+				     const unsigned long next_iteration)
+{
+  std::string tmp_filename = std::string(filename) + ".tmp";
+  std::vector<char> buffer(CHECKPOINT_MAGIC,
+			   CHECKPOINT_MAGIC + sizeof(CHECKPOINT_MAGIC));
+  std::stringstream rng_stream;
+  std::ofstream out;
+
+  rng_stream << rng;
+  std::string rng_state = rng_stream.str();
+  append<uint32_t>(buffer, CHECKPOINT_VERSION);
+  append<uint32_t>(buffer, BYTE_ORDER_MARK);
+  append<uint64_t>(buffer, next_iteration);
+  append<uint64_t>(buffer, s.num_released_agents_);
+  append<uint32_t>(buffer, s.replicate_);
+  append<uint32_t>(buffer, s.death_counts_.size());
+  for (auto & count : s.death_counts_)
+    append<uint64_t>(buffer, count);
+  append<uint32_t>(buffer, rng_state.size());
+  buffer.insert(buffer.end(), rng_state.begin(), rng_state.end());
+  append_map(buffer, s.parameters);
+  buffer.resize((buffer.size() + 7) / 8 * 8, 0);
+
+  open_for_writing(out, tmp_filename.c_str(), "checkpoint");
+  out.write(buffer.data(), buffer.size());
+  write_population(out, s, true);
+  out.close();
+  if (out.fail())
+    throw SimulationException("Error writing checkpoint.");
+  if (rename(tmp_filename.c_str(), filename) != 0)
+    throw SimulationException("Error writing checkpoint.");
+}
+
+void
+PopulationSnapshot::read_checkpoint(Simulation &s, const char *filename)
+{
+  MappedFile file(filename, "checkpoint");
+  Reader in(file);
+
+  if (file.size() < sizeof(CHECKPOINT_MAGIC) ||
+      memcmp(in.take(sizeof(CHECKPOINT_MAGIC)), CHECKPOINT_MAGIC,
+	     sizeof(CHECKPOINT_MAGIC)) != 0)
+    throw SimulationException("Not a checkpoint.");
+  if (in.get<uint32_t>() != CHECKPOINT_VERSION)
+    throw SimulationException("Unsupported checkpoint version.");
+  if (in.get<uint32_t>() != BYTE_ORDER_MARK)
+    throw SimulationException("Checkpoint has another byte order.");
+  uint64_t iteration = in.get<uint64_t>();
+  uint64_t num_released_agents = in.get<uint64_t>();
+  uint32_t replicate = in.get<uint32_t>();
+  uint32_t num_death_counts = in.get<uint32_t>();
+  if (num_death_counts != s.death_counts_.size())
+    throw SimulationException("Checkpoint death counters do not match.");
+  std::vector<unsigned long> death_counts;
+  for (uint32_t i = 0; i < num_death_counts; ++i)
+    death_counts.push_back(in.get<uint64_t>());
+  uint32_t rng_state_size = in.get<uint32_t>();
+  std::stringstream rng_state(std::string(in.take(rng_state_size),
+					  rng_state_size));
+  in.get_map(s.parameters);
+  in.align(8);
+  read_population(in, s);
+
+  rng_state >> rng;
+  s.iteration_ = iteration;
+  s.num_released_agents_ = num_released_agents;
+  s.replicate_ = replicate;
+  s.death_counts_ = death_counts;
+}
@@ -0,0 +1,60 @@
+#ifndef SIM_POPULATION_SNAPSHOT_H
+#define SIM_POPULATION_SNAPSHOT_H
+
+#include <cstdint>
+#include <ostream>
+
+#include "common.hh"
+
+namespace sim {
+
+  // Reads and writes the agents and global states of a simulation as a
+  // binary file that is mapped back in without parsing. The population
+  // section of a snapshot is
+  //   "SIMSNAP" '\0', uint32 version, uint32 byte order mark 0x01020304,
+  //   uint64 number of agents, uint64 number of dead agents,
+  //   uint64 next agent id, uint32 number of agent columns,
+  //   for each agent column: uint32 state id, uint32 element,
+  //   uint32 number of global states,
+  //   for each global state: uint32 state id, uint32 size, double values,
+  //   zero padding to a multiple of 8 bytes,
+  //   uint64 agent id for each agent, then each dead agent,
+  //   double value for each agent, then each dead agent, for each agent
+  //   column in turn,
+  // in the byte order of the machine that wrote it, which must be that of
+  // the machine that reads it. Snapshots hold no dead agents.
+  //
+  // A checkpoint is
+  //   "SIMCKPT" '\0', uint32 version, uint32 byte order mark,
+  //   uint64 next iteration, uint64 number of released dead agents,
+  //   uint32 replicate, uint32 number of death counters,
+  //   uint64 count for each death counter,
+  //   uint32 size, then the text of the sim::rng state,
+  //   the parameters in the same layout as the global states,
+  //   zero padding to a multiple of 8 bytes,
+  // followed by a population section with the kept dead agents.
+  class PopulationSnapshot {
+  private:
+    class Reader;
+    static void write_population(std::ostream &out, const Simulation &s,
+				 const bool with_dead);
+    static void read_population(Reader &in, Simulation &s);
+  public:
+    static const uint32_t VERSION = 2;
+    static const uint32_t CHECKPOINT_VERSION = 1;
+    static void write(const Simulation &simulation, const char *filename);
+    // Replaces the agents and global states of simulation with those in
+    // the file. No agent initializers are run.
+    static void read(Simulation &simulation, const char *filename);
+    // Writes a checkpoint to resume at next_iteration from.
+    static void write_checkpoint(const Simulation &simulation,
+				 const char *filename,
+				 const unsigned long next_iteration);
+    // Restores a simulation to the start of the iteration the checkpoint
+    // was written before.
+    static void read_checkpoint(Simulation &simulation,
+				const char *filename);
+  };
+}
+
+#endif
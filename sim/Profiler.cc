@@ -0,0 +1,260 @@
+#include <cstdio>
+#include <iomanip>
+
+#include "sim.hh"
+
+using namespace sim;
+
+namespace {
+  const char *KIND_NAMES[Profiler::NUM_KINDS] = {
+    "phase", "global event", "agent event", "guarded event",
+    "scheduled event", "report"
+  };
+  const char *PHASE_NAMES[Profiler::NUM_PHASES] = {
+    "iteration", "global events", "shuffle", "agent events",
+    "guarded events", "scheduled events", "reports", "checkpoint",
+    "bookkeeping"
+  };
+
+  size_t histogram_bucket(const Profiler::Clock::duration time)
+  {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>
+      (time).count();
+    size_t bucket = 0;
+    while (us > 0 && bucket < Profiler::HISTOGRAM_BUCKETS - 1) {
+      us >>= 1;
+      ++bucket;
+    }
+    return bucket;
+  }
+
+  // The upper bound, in microseconds, of the bucket of the iterations
+  // below which the fraction q of an entry's iterations lie.
+  double histogram_quantile(const std::vector<unsigned long> &histogram,
+			    const double q)
+  {
+    unsigned long total = 0;
+    for (auto & count : histogram)
+      total += count;
+    unsigned long seen = 0;
+    for (size_t b = 0; b < histogram.size(); ++b) {
+      seen += histogram[b];
+      if (seen > 0 && seen >= q * total)
+	return (double) (1ul << b);
+    }
+    return 0.0;
+  }
+
+  double seconds(const Profiler::Clock::duration time)
+  {
+    return std::chrono::duration<double>(time).count();
+  }
+
+  void write_json_string(std::ostream &out, const std::string &s)
+  {
+    out << '"';
+    for (auto & c : s)
+      if (c == '"' || c == '\\') {
+	out << '\\' << c;
+      } else if ((unsigned char) c < 0x20) {
+	char escape[8];
+	snprintf(escape, sizeof(escape), "\\u%04x", c);
+	out << escape;
+      } else {
+	out << c;
+      }
+    out << '"';
+  }
+}
+
+Profiler::Profiler()
+{
+  set_threads(1);
+}
+
+void
+Profiler::set_threads(const unsigned num_threads)
+{
+  if (counters_.size() < num_threads)
+    counters_.resize(num_threads,
+		     std::vector< std::vector<Counter> >(NUM_KINDS));
+}
+
+void
+Profiler::set_names(const Kind kind, const std::vector<std::string> &names)
+{
+  names_[kind] = names;
+}
+
+std::string
+Profiler::name(const Kind kind, const size_t index) const
+{
+  if (index < names_[kind].size() && names_[kind][index].size())
+    return names_[kind][index];
+  if (kind == PHASE && index < NUM_PHASES)
+    return PHASE_NAMES[index];
+  return std::string(KIND_NAMES[kind]) + " " + std::to_string(index);
+}
+
+/* Adds the counters of every thread to the entries and zeroes them. If
+   iteration is true, each entry called counts the iteration in its
+   histogram, by its time summed over the threads. */
+
+void
+Profiler::collect(const bool iteration)
+{
+  for (unsigned kind = 0; kind < NUM_KINDS; ++kind) {
+    std::vector<Entry> &entries = entries_[kind];
+    std::vector<Counter> totals;
+    for (auto & thread : counters_) {
+      std::vector<Counter> &counters = thread[kind];
+      if (totals.size() < counters.size())
+	totals.resize(counters.size());
+      for (size_t i = 0; i < counters.size(); ++i) {
+	totals[i].calls += counters[i].calls;
+	totals[i].time += counters[i].time;
+	counters[i] = Counter();
+      }
+    }
+    if (entries.size() < totals.size())
+      entries.resize(totals.size());
+    for (size_t i = 0; i < totals.size(); ++i) {
+      if (totals[i].calls == 0)
+	continue;
+      Entry &entry = entries[i];
+      entry.calls += totals[i].calls;
+      entry.time += totals[i].time;
+      if (iteration) {
+	entry.histogram.resize(HISTOGRAM_BUCKETS, 0);
+	++entry.histogram[histogram_bucket(totals[i].time)];
+      }
+    }
+  }
+  if (iteration)
+    ++iterations_;
+}
+
+void
+Profiler::end_iteration()
+{
+  collect(true);
+}
+
+void
+Profiler::flush()
+{
+  collect(false);
+}
+
+void
+Profiler::merge(const Profiler &other)
+{
+  for (unsigned kind = 0; kind < NUM_KINDS; ++kind) {
+    std::vector<Entry> &entries = entries_[kind];
+    const std::vector<Entry> &others = other.entries_[kind];
+    if (entries.size() < others.size())
+      entries.resize(others.size());
+    for (size_t i = 0; i < others.size(); ++i) {
+      entries[i].calls += others[i].calls;
+      entries[i].time += others[i].time;
+      if (others[i].histogram.size()) {
+	entries[i].histogram.resize(HISTOGRAM_BUCKETS, 0);
+	for (size_t b = 0; b < HISTOGRAM_BUCKETS; ++b)
+	  entries[i].histogram[b] += others[i].histogram[b];
+      }
+    }
+  }
+  iterations_ += other.iterations_;
+}
+
+void
+Profiler::clear()
+{
+  for (auto & thread : counters_)
+    for (auto & counters : thread)
+      counters.clear();
+  for (auto & entries : entries_)
+    entries.clear();
+  iterations_ = 0;
+}
+
+unsigned long
+Profiler::iterations() const
+{
+  return iterations_;
+}
+
+const std::vector<Profiler::Entry>&
+Profiler::entries(const Kind kind) const
+{
+  return entries_[kind];
+}
+
+void
+Profiler::print(std::ostream &out) const
+{
+  double iteration_time = 0.0;
+  if (entries_[PHASE].size() > ITERATION)
+    iteration_time = seconds(entries_[PHASE][ITERATION].time);
+  std::ios::fmtflags flags = out.flags();
+  std::streamsize precision = out.precision();
+  out << "Profile of " << iterations_ << " iterations" << std::endl;
+  out << std::left << std::setw(16) << "kind" << std::setw(28) << "name"
+      << std::right << std::setw(12) << "calls"
+      << std::setw(12) << "total (s)" << std::setw(9) << "% iter"
+      << std::setw(12) << "mean (us)" << std::setw(11) << "p50 (us)"
+      << std::setw(11) << "p90 (us)" << std::endl;
+  out << std::fixed;
+  for (unsigned kind = 0; kind < NUM_KINDS; ++kind)
+    for (size_t i = 0; i < entries_[kind].size(); ++i) {
+      const Entry &entry = entries_[kind][i];
+      if (entry.calls == 0)
+	continue;
+      double total = seconds(entry.time);
+      out << std::left << std::setw(16) << KIND_NAMES[kind]
+	  << std::setw(28) << name((Kind) kind, i)
+	  << std::right << std::setw(12) << entry.calls
+	  << std::setprecision(4) << std::setw(12) << total
+	  << std::setprecision(1) << std::setw(9)
+	  << (iteration_time > 0.0 ? 100.0 * total / iteration_time : 0.0)
+	  << std::setprecision(3) << std::setw(12)
+	  << 1e6 * total / entry.calls << std::setprecision(0);
+      // Entries only called outside iterations have no histogram
+      if (entry.histogram.size())
+	out << std::setw(11) << histogram_quantile(entry.histogram, 0.5)
+	    << std::setw(11) << histogram_quantile(entry.histogram, 0.9);
+      else
+	out << std::setw(11) << "-" << std::setw(11) << "-";
+      out << std::endl;
+    }
+  out.flags(flags);
+  out.precision(precision);
+}
+
+void
+Profiler::print_json(std::ostream &out) const
+{
+  std::streamsize precision = out.precision(9);
+  out << "{\"iterations\": " << iterations_ << ", \"histogram_buckets_us\": "
+      << "\"bucket 0 < 1, bucket b < 2^b\", \"entries\": [";
+  bool first = true;
+  for (unsigned kind = 0; kind < NUM_KINDS; ++kind)
+    for (size_t i = 0; i < entries_[kind].size(); ++i) {
+      const Entry &entry = entries_[kind][i];
+      if (entry.calls == 0)
+	continue;
+      out << (first ? "" : ",") << "\n  {\"kind\": ";
+      first = false;
+      write_json_string(out, KIND_NAMES[kind]);
+      out << ", \"index\": " << i << ", \"name\": ";
+      write_json_string(out, name((Kind) kind, i));
+      out << ", \"calls\": " << entry.calls
+	  << ", \"seconds\": " << seconds(entry.time)
+	  << ", \"histogram\": [";
+      for (size_t b = 0; b < entry.histogram.size(); ++b)
+	out << (b ? ", " : "") << entry.histogram[b];
+      out << "]}";
+    }
+  out << "\n]}" << std::endl;
+  out.precision(precision);
+}
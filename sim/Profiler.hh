@@ -0,0 +1,163 @@
+#ifndef SIM_PROFILER_H
+#define SIM_PROFILER_H
+
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace sim {
+
+  // Wall time spent in the parts of a simulation: the phases of an
+  // iteration and each global, agent, guarded and scheduled event and
+  // report. The times of an iteration are recorded per thread and added up
+  // by end_iteration(), which also counts the iteration in a histogram of
+  // each entry's time per iteration. Simulation only records times when
+  // compiled with SIM_PROFILE; otherwise its profiler stays empty.
+  class Profiler {
+  public:
+    typedef std::chrono::steady_clock Clock;
+    enum Kind {
+      PHASE = 0,
+      GLOBAL_EVENT,
+      AGENT_EVENT,
+      GUARDED_EVENT,
+      SCHEDULED_EVENT,
+      REPORT,
+      NUM_KINDS
+    };
+    enum Phase {
+      ITERATION = 0,
+      GLOBAL_EVENTS,
+      SHUFFLE,
+      AGENT_EVENTS,
+      GUARDED_EVENTS,
+      SCHEDULED_EVENTS,
+      REPORTS,
+      CHECKPOINT,
+      BOOKKEEPING,
+      NUM_PHASES
+    };
+    // Bucket 0 of a histogram counts the iterations an entry took less
+    // than a microsecond in, bucket b > 0 those it took [2^(b-1), 2^b)
+    // microseconds in, and the last bucket the longer ones.
+    static const size_t HISTOGRAM_BUCKETS = 28;
+    struct Entry {
+      unsigned long calls = 0;
+      Clock::duration time = Clock::duration::zero();
+      std::vector<unsigned long> histogram;
+    };
+  private:
+    struct Counter {
+      unsigned long calls = 0;
+      Clock::duration time = Clock::duration::zero();
+    };
+    // counters_[thread][kind][index]
+    std::vector< std::vector< std::vector<Counter> > > counters_;
+    std::vector<Entry> entries_[NUM_KINDS];
+    std::vector<std::string> names_[NUM_KINDS];
+    unsigned long iterations_ = 0;
+    void collect(const bool iteration);
+  public:
+    Profiler();
+    // Makes room for the times of threads 0 to num_threads - 1. Must be
+    // called before they record any.
+    void set_threads(const unsigned num_threads);
+    void set_names(const Kind kind, const std::vector<std::string> &names);
+    std::string name(const Kind kind, const size_t index) const;
+    // Adds a call that took time. Each thread only touches its own
+    // counters, so threads may record at the same time.
+    inline void record(const Kind kind, const size_t index,
+		       const Clock::duration time, const unsigned thread = 0)
+    {
+      std::vector<Counter> &counters = counters_[thread][kind];
+      if (index >= counters.size())
+	counters.resize(index + 1);
+      ++counters[index].calls;
+      counters[index].time += time;
+    }
+    void end_iteration();
+    // Adds up the times recorded outside iterations, e.g. by the reports
+    // before and after a simulation, without counting an iteration.
+    void flush();
+    // Adds the entries and iterations of other, e.g. a replicate's.
+    void merge(const Profiler &other);
+    // Forgets the times, keeping the names.
+    void clear();
+    unsigned long iterations() const;
+    const std::vector<Entry>& entries(const Kind kind) const;
+    // Writes one row per entry called: its calls, total and mean time, share
+    // of the iterations' time, and median and 90th percentile time per
+    // iteration from its histogram (upper bounds of the buckets).
+    void print(std::ostream &out) const;
+    void print_json(std::ostream &out) const;
+  };
+
+  // Records the time from its construction to its destruction.
+  class ProfileTimer {
+  private:
+    Profiler &profiler_;
+    Profiler::Kind kind_;
+    size_t index_;
+    unsigned thread_;
+    Profiler::Clock::time_point start_;
+  public:
+    ProfileTimer(Profiler &profiler, const Profiler::Kind kind,
+		 const size_t index, const unsigned thread = 0) :
+      profiler_(profiler), kind_(kind), index_(index), thread_(thread),
+      start_(Profiler::Clock::now()) {}
+    ~ProfileTimer()
+    {
+      profiler_.record(kind_, index_, Profiler::Clock::now() - start_,
+		       thread_);
+    }
+  };
+
+  // Times consecutive phases of an iteration: lap() records the time since
+  // the last lap, and end_iteration() the time since the construction as
+  // the whole iteration before ending it.
+  class ProfileLaps {
+  private:
+    Profiler &profiler_;
+    Profiler::Clock::time_point start_;
+    Profiler::Clock::time_point last_;
+  public:
+    ProfileLaps(Profiler &profiler) :
+      profiler_(profiler), start_(Profiler::Clock::now()), last_(start_) {}
+    inline void lap(const Profiler::Kind kind, const size_t index)
+    {
+      Profiler::Clock::time_point now = Profiler::Clock::now();
+      profiler_.record(kind, index, now - last_);
+      last_ = now;
+    }
+    inline void end_iteration()
+    {
+      profiler_.record(Profiler::PHASE, Profiler::ITERATION,
+		       Profiler::Clock::now() - start_);
+      profiler_.end_iteration();
+    }
+  };
+}
+
+// SIM_PROFILE_SCOPE(profiler, kind, index[, thread]) times the rest of the
+// enclosing scope, and SIM_PROFILE_LAPS(laps, profiler),
+// SIM_PROFILE_LAP(laps, kind, index) and SIM_PROFILE_END_ITERATION(laps)
+// the phases of an iteration. Without SIM_PROFILE they expand to nothing,
+// so neither the clock nor the profiler is touched.
+#ifdef SIM_PROFILE
+#define SIM_PROFILE_CONCAT_(a, b) a##b
+#define SIM_PROFILE_CONCAT(a, b) SIM_PROFILE_CONCAT_(a, b)
+#define SIM_PROFILE_SCOPE(...)						\
+  sim::ProfileTimer SIM_PROFILE_CONCAT(profile_timer_, __LINE__)(__VA_ARGS__)
+#define SIM_PROFILE_LAPS(laps, profiler) sim::ProfileLaps laps(profiler)
+#define SIM_PROFILE_LAP(laps, kind, index) laps.lap(kind, index)
+#define SIM_PROFILE_END_ITERATION(laps) laps.end_iteration()
+#else
+#define SIM_PROFILE_SCOPE(...)
+#define SIM_PROFILE_LAPS(laps, profiler)
+#define SIM_PROFILE_LAP(laps, kind, index)
+#define SIM_PROFILE_END_ITERATION(laps)
+#endif
+
+#endif
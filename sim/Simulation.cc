@@ -1,6 +1,12 @@
 #include <algorithm>
+#include <cmath>
+#include <atomic>
 #include <iostream>
+#include <map>
 #include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #include "sim.hh"
 #include "Simulation.hh"
@@ -9,8 +15,33 @@
 using namespace sim;
 
 namespace sim {
-  unsigned thread_num  = 0;
+  thread_local unsigned thread_num  = 0;
   thread_local std::mt19937_64 rng;
+  thread_local CounterRng agent_rng;
+}
+
+namespace {
+  // Number of random numbers drawn and compared at a time by fire_events.
+  const size_t BATCH_BLOCK_SIZE = 256;
+
+  // While agent events run in parallel, each thread records the index of the
+  // agent it is processing, and counts the agents its chunk kills, here.
+  thread_local size_t parallel_agent_index = 0;
+  thread_local size_t *parallel_kill_count = nullptr;
+#ifdef SIM_PROFILE
+  // The number, in the thread pool, of the thread running agent events.
+  thread_local unsigned profile_thread = 0;
+#endif
+
+  size_t greatest_common_divisor(size_t a, size_t b)
+  {
+    while (b) {
+      size_t r = a % b;
+      a = b;
+      b = r;
+    }
+    return a;
+  }
 }
 
 Simulation::
@@ -21,7 +52,8 @@ Simulation(unsigned seed,
 #else
 Simulation(unsigned seed)
 #endif
-: seed_(seed + sim::thread_num)
+: seed_(seed + sim::thread_num),
+  agent_pool_(&agent_store)
 {
 #ifdef SIM_VECTORIZE
   num_parms_ = num_parms;
@@ -32,29 +64,122 @@ Simulation(unsigned seed)
 #endif
 }
 
+Simulation::Simulation(const Simulation &simulation) :
+  seed_(simulation.seed_),
+  agent_count_(simulation.agent_count_),
+  iteration_(simulation.iteration_),
+  replicate_(simulation.replicate_),
+  counter_rng_(simulation.counter_rng_),
+  prob_cache_(simulation.prob_cache_),
+  prob_cache_rates_(simulation.prob_cache_rates_),
+  prob_cached_(simulation.prob_cached_),
+  prob_cache_time_step_(simulation.prob_cache_time_step_),
+  current_agent_index_(simulation.current_agent_index_),
+  init_global_state_funcs_(simulation.init_global_state_funcs_),
+  init_agent_funcs_(simulation.init_agent_funcs_),
+  csv_agent_filename_(simulation.csv_agent_filename_),
+  csv_agent_delim_(simulation.csv_agent_delim_),
+  snapshot_filename_(simulation.snapshot_filename_),
+  checkpoint_filename_(simulation.checkpoint_filename_),
+  checkpoint_frequency_(simulation.checkpoint_frequency_),
+  num_agent_threads_(simulation.num_agent_threads_),
+  agent_chunk_size_(simulation.agent_chunk_size_),
+  agent_order_(simulation.agent_order_),
+  order_block_size_(simulation.order_block_size_),
+  agent_pool_(&agent_store),
+  keep_dead_agents_(simulation.keep_dead_agents_),
+  killed_(simulation.killed_),
+  num_killed_(simulation.num_killed_),
+  num_released_agents_(simulation.num_released_agents_),
+  dead_agent_sink_(simulation.dead_agent_sink_),
+  death_counters_(simulation.death_counters_),
+  death_counts_(simulation.death_counts_),
+  death_counter_names_(simulation.death_counter_names_),
+  scheduled_events_(simulation.scheduled_events_),
+  cohort_mode_(simulation.cohort_mode_),
+  cohort_state_(simulation.cohort_state_),
+  cohort_merge_frequency_(simulation.cohort_merge_frequency_),
+  aggregates_(simulation.aggregates_),
+  aggregate_totals_(simulation.aggregate_totals_),
+  aggregate_names_(simulation.aggregate_names_),
+  tracked_aggregates_(simulation.tracked_aggregates_),
+  state_aggregates_(simulation.state_aggregates_),
+  diffed_aggregates_(simulation.diffed_aggregates_),
+  aggregated_(simulation.aggregated_),
+  state_indexes_(simulation.state_indexes_),
+  state_index_of_(simulation.state_index_of_),
+  guarded_events_(simulation.guarded_events_),
+  profiler_(simulation.profiler_),
+  profile_output_(simulation.profile_output_),
+  profile_json_(simulation.profile_json_),
+  report_buffers_(simulation.report_buffers_),
+#ifdef SIM_VECTORIZE
+  num_parms_(simulation.num_parms_),
+  num_states_(simulation.num_states_),
+#endif
+  savedParameters_(simulation.savedParameters_),
+  parameters(simulation.parameters),
+  states(simulation.states),
+  agent_store(simulation.agent_store),
+  global_events(simulation.global_events),
+  agent_events(simulation.agent_events),
+  reports(simulation.reports),
+  parms_names(simulation.parms_names),
+  names_parms(simulation.names_parms),
+  states_names(simulation.states_names),
+  names_states(simulation.names_states)
+{
+  // The agents are handles onto the store, so they have to be rebound to
+  // this simulation's copy of it.
+  agents.reserve(simulation.agents.size());
+  for (auto & agent : simulation.agents)
+    agents.push_back(agent_pool_.construct(agent->id(), agent->slot()));
+  dead_agents.reserve(simulation.dead_agents.size());
+  for (auto & agent : simulation.dead_agents)
+    dead_agents.push_back(agent_pool_.construct(agent->id(), agent->slot()));
+  // Without the free slots of the other simulation's pool, and the agents
+  // it has yet to release, their store slots would never be reused.
+  agent_pool_.copy_free_slots(simulation.agent_pool_);
+  released_agents_.reserve(simulation.released_agents_.size());
+  for (auto & agent : simulation.released_agents_)
+    released_agents_.push_back(agent_pool_.construct(agent->id(),
+						     agent->slot()));
+  // The buckets of the indexes hold the other simulation's agents, so the
+  // agents are indexed again.
+  for (auto & index : state_indexes_) {
+    index.buckets.clear();
+    index.bucket_of.clear();
+    index.position.clear();
+  }
+  profiler_.clear();
+}
+
+Simulation*
+Simulation::clone() const
+{
+  return new Simulation(*this);
+}
+
 Simulation::~Simulation()
 {
-  for (auto & agent : agents)
-    delete agent;
-  for (auto & agent : dead_agents)
-    delete agent;
 }
 
 
 Agent*
 Simulation::append_agent()
 {
-  Agent *a = new Agent(agent_count_++);
-#ifdef SIM_VECTORIZE
-  a->states.resize(num_states_);
-#endif
+  Agent *a = agent_pool_.allocate(agent_count_++);
   agents.push_back(a);
+  if (scheduled_events_.size() && schedule_all_ == false)
+    scheduler_.push(iteration_, a, scheduler_.sample_event());
   return a;
 }
 
 void
 Simulation::set_number_agents(const unsigned num_agents)
 {
+  agents.reserve(agents.size() + num_agents);
+  agent_store.reserve(agent_store.size() + num_agents);
   for (unsigned i = 0; i < num_agents; ++i)
     append_agent();
 }
@@ -65,6 +190,55 @@ Simulation::iteration() const
   return iteration_;
 }
 
+unsigned long
+Simulation::completed_iterations() const
+{
+  return interim_reporting_ ? iteration_ + 1 : iteration_;
+}
+
+void
+Simulation::set_counter_rng(const bool counter_rng)
+{
+  counter_rng_ = counter_rng;
+}
+
+bool
+Simulation::counter_rng() const
+{
+  return counter_rng_;
+}
+
+void
+Simulation::set_replicate(const unsigned replicate)
+{
+  replicate_ = replicate;
+}
+
+unsigned
+Simulation::replicate() const
+{
+  return replicate_;
+}
+
+CounterRng
+Simulation::agent_stream(const unsigned long agent_id,
+			 const unsigned iteration,
+			 const unsigned event_slot) const
+{
+  CounterRng stream(seed_, replicate_);
+  stream.set_stream(iteration, agent_id, event_slot);
+  return stream;
+}
+
+void
+Simulation::select_stream(const uint32_t iteration,
+			  const uint32_t id,
+			  const uint32_t slot) const
+{
+  agent_rng.set_key(seed_, replicate_);
+  agent_rng.set_stream(iteration, id, slot);
+}
+
 
 void
 Simulation::set_parameter(const unsigned parameter,
@@ -72,6 +246,7 @@ Simulation::set_parameter(const unsigned parameter,
 			  const char *name)
 {
   parameters[parameter] = values;
+  prob_cache_valid_ = false;
 
   if (name) {
     parms_names[parameter] = std::string(name);
@@ -157,319 +332,1796 @@ Simulation::set_global_events(const std::initializer_list<GlobalEvent> evnts) {
 }
 
 
+/* Killing an agent only marks it in a tombstone map. Agents stay where they
+   are in agents until remove_killed_agents() removes all the agents killed
+   in a phase of an iteration in a single pass, so that no agent is moved,
+   skipped or visited twice while the agents are being iterated over. */
+
 void
 Simulation::kill_agent(size_t agent_index)
 {
-  dead_agents.push_back(agents[agent_index]);
-  agents[agent_index] = agents.back();
-  agents.pop_back();
+  if (agent_index >= agents.size())
+    throw SimulationException("Killed agent index out of range.");
+  // Agents appended since the last phase have no tombstone yet
+  if (agent_index >= killed_.size())
+    killed_.resize(agents.size(), 0);
+  if (killed_[agent_index])
+    return;
+  killed_[agent_index] = 1;
+  if (parallel_kill_count)
+    ++*parallel_kill_count;
+  else
+    ++num_killed_;
 }
 
 void
 Simulation::kill_agent()
 {
-  kill_agent(current_agent_index_);
+  if (event_agent_)
+    event_agent_killed_ = true;
+  else if (parallel_kill_count)
+    kill_agent(parallel_agent_index);
+  else
+    kill_agent(current_agent_index_);
+}
+
+bool
+Simulation::is_killed(size_t agent_index) const
+{
+  return agent_index < killed_.size() && killed_[agent_index];
 }
 
+bool
+Simulation::is_killed() const
+{
+  if (event_agent_)
+    return event_agent_killed_;
+  if (parallel_kill_count)
+    return is_killed(parallel_agent_index);
+  return is_killed(current_agent_index_);
+}
 
 void
-Simulation::set_agent_states()
+Simulation::remove_killed_agents()
 {
-  iteration_ = 0;
-  for (auto & agent : agents)
-    for (auto & init_func : init_agent_funcs_)
-      init_func(agent, this);
+  track_new_agents();
+  if (num_killed_ == 0)
+    return;
+  if (keep_dead_agents_)
+    dead_agents.reserve(dead_agents.size() + num_killed_);
+  size_t alive = 0;
+  for (size_t i = 0; i < agents.size(); ++i) {
+    if (i < killed_.size() && killed_[i]) {
+      record_death(agents[i]);
+      if (scheduled_events_.size())
+	scheduler_.cancel(agents[i]);
+      if (aggregates_.size() && aggregated_[agents[i]->slot()]) {
+	for (size_t a = 0; a < aggregates_.size(); ++a)
+	  aggregate_totals_[a] -= contribution(a, agents[i]);
+	aggregated_[agents[i]->slot()] = 0;
+      }
+      for (auto & index : state_indexes_)
+	index_remove(index, agents[i]);
+      if (keep_dead_agents_) {
+	dead_agents.push_back(agents[i]);
+      } else {
+	released_agents_.push_back(agents[i]);
+	num_released_agents_ += (unsigned long) weight(agents[i]);
+      }
+    } else {
+      agents[alive++] = agents[i];
+    }
+  }
+  agents.resize(alive);
+  killed_.assign(alive, 0);
+  num_killed_ = 0;
+  num_tracked_agents_ = alive;
 }
 
 void
-Simulation::set_agent_states(const std::initializer_list <
-			     std::function<void(Agent *,
-						Simulation *)>> init_funcs)
+Simulation::set_keep_dead_agents(const bool keep)
 {
-  set_agent_initializers(init_funcs);
-  set_agent_states();
+  keep_dead_agents_ = keep;
+}
+
+bool
+Simulation::keep_dead_agents() const
+{
+  return keep_dead_agents_;
+}
+
+unsigned long
+Simulation::num_dead() const
+{
+  if (cohort_mode_) {
+    unsigned long num_dead = num_released_agents_;
+    for (auto & agent : dead_agents)
+      num_dead += (unsigned long) weight(agent);
+    return num_dead;
+  }
+  return dead_agents.size() + num_released_agents_;
 }
 
 void
-Simulation::set_events(const std::initializer_list<AgentEvent> events)
+Simulation::set_dead_agent_sink(const DeadAgentSink &sink, const bool keep)
 {
-  agent_events = events;
+  dead_agent_sink_ = sink;
+  keep_dead_agents_ = keep;
 }
 
 void
-Simulation::set_reports(const std::initializer_list <report_parms_> reprts)
+Simulation::add_death_counter(const char *name,
+			      const std::function<bool(const Agent *)> &count)
 {
-  for (auto & r : reprts)
-    reports.push_back(Report(r.report_func, r.iteration, r.before, r.after));
+  death_counter_names_[std::string(name)] = death_counters_.size();
+  death_counters_.push_back(count);
+  death_counts_.push_back(0);
+}
+
+unsigned long
+Simulation::num_dead(const std::string &name) const
+{
+  auto counter = death_counter_names_.find(name);
+  if (counter == death_counter_names_.end())
+    throw SimulationException("Unknown death counter.");
+  return death_counts_[counter->second];
 }
 
 void
-Simulation::perturb_parameters(const Perturbers& perturbers)
+Simulation::record_death(const Agent *agent)
 {
-  for (auto & perturber : perturbers) {
-    auto & vals = parameters[perturber.first];
-    for (size_t i = 0; i < vals.size(); ++i)
-      vals[i] = savedParameters_[perturber.first][i] + perturber.second(rng);
-  }
+  unsigned long individuals = (unsigned long) weight(agent);
+  for (size_t i = 0; i < death_counters_.size(); ++i)
+    if (death_counters_[i](agent))
+      death_counts_[i] += individuals;
+  if (dead_agent_sink_)
+    dead_agent_sink_(this, agent);
 }
 
+/* Agents killed without being kept are handed back to the pool only at the
+   end of an iteration, because events may still refer to them until then. */
 
 void
-Simulation::montecarlo(const unsigned num_steps,
-		       const bool interim_reports,
-		       const Perturbers& perturbers,
-		       std::function<bool(const Simulation *,
-					  unsigned)> carryon)
+Simulation::release_dead_agents()
 {
-  try {
-#ifdef SIM_VECTORIZE
-    savedParameters_.resize(num_parms_);
-#endif
-    // Save parameters
-    for (auto & perturber : perturbers)
-      std::copy(parameters[perturber.first].begin(),
-		parameters[perturber.first].end(),
-		std::back_inserter(savedParameters_[perturber.first]));
-    // Run the simulations
-    for (int i = 0; carryon(this, i); ++i) {
-      perturb_parameters(perturbers);
-      simulate(num_steps, interim_reports);
+  for (auto & agent : released_agents_)
+    agent_pool_.release(agent);
+  released_agents_.clear();
+}
+
+void
+Simulation::clear_agents()
+{
+  agents.clear();
+  dead_agents.clear();
+  released_agents_.clear();
+  num_released_agents_ = 0;
+  agent_pool_.clear();
+  agent_store.clear();
+  schedule_all_ = true;
+  reset_tracking();
+}
+
+unsigned
+Simulation::add_scheduled_event(const Hazard &hazard,
+				const AgentEvent &action,
+				const std::vector<unsigned> &parameters)
+{
+  scheduled_events_.push_back({hazard, action, parameters, {}});
+  schedule_all_ = true;
+  return scheduled_events_.size() - 1;
+}
+
+unsigned
+Simulation::add_scheduled_event(const unsigned parameter,
+				const AgentEvent &action)
+{
+  return add_scheduled_event([parameter](const Simulation *s, const Agent *) {
+      return s->parameters.at(parameter)[0];
+    }, action, {parameter});
+}
+
+void
+Simulation::reschedule()
+{
+  schedule_all_ = true;
+}
+
+void
+Simulation::reschedule(Agent *agent)
+{
+  if (scheduled_events_.size() && schedule_all_ == false)
+    sample_scheduled_events(agent, iteration_);
+}
+
+/* Sample the iteration, from iteration from on, that an agent's scheduled
+   event happens in. With a per step probability p the number of steps to
+   wait is geometric: floor(log(V) / log(1 - p)) for V uniform in (0, 1]. */
+void
+Simulation::sample_scheduled_event(Agent *agent, const uint32_t event,
+				   const unsigned long from,
+				   const bool after_event)
+{
+  real p = prob_event(scheduled_events_[event].hazard(this, agent), 1.0,
+		      schedule_time_step_);
+  if (p <= 0.0)
+    return;
+  unsigned long steps = 0;
+  if (p < 1.0) {
+    real u;
+    if (counter_rng_) {
+      // Resampling after an event ran must not reuse the stream of the
+      // draw that set the event for this iteration, or a wait of 0 would
+      // be drawn again.
+      uint32_t slot = SCHEDULE_STREAM_SLOT + event;
+      if (after_event)
+	slot += 2 * scheduled_events_.size();
+      select_stream(iteration_, agent->id(), slot);
+      u = uniform_real(agent_rng);
+    } else {
+      u = uniform_real(rng);
     }
-    // Restore the parameters
-    for (auto & perturber : perturbers)
-      std::copy(savedParameters_[perturber.first].begin(),
-		savedParameters_[perturber.first].end(),
-		parameters[perturber.first].begin());
-  } catch(std::exception &e) {
-    throw SimulationException(e.what());
+    real wait = std::floor(std::log1p(-u) / std::log1p(-p));
+    if (wait > 1e15)
+      return;
+    steps = (unsigned long) wait;
   }
+  scheduler_.push(from + steps, agent, event);
 }
 
 void
-Simulation::initialize_states()
+Simulation::sample_scheduled_events(Agent *agent, const unsigned long from,
+				    const bool after_event)
 {
-  set_global_states();
-  if (csv_agent_matrix_.size())
-    set_agents_from_csv();
-  set_agent_states();
+  scheduler_.cancel(agent);
+  for (uint32_t event = 0; event < scheduled_events_.size(); ++event)
+    sample_scheduled_event(agent, event, from, after_event);
 }
 
+/* Run the scheduled events due in this iteration. */
 void
-Simulation::simulate(unsigned num_steps,
-		     bool interim_reports)
+Simulation::run_scheduled_events()
 {
-  try {
-    initialize_states();
-    // Reports at beginning
-    for (auto & report : reports)
-      if (report.before())
-	try {
-	  report(this);
-	} catch (std::exception &e) {
-	  std::cerr << "Exception processing pre-simulation report "
-		    << __FILE__ << " " << __LINE__ << std::endl;
-	  std::cerr << "Report address: " << &report << std::endl;
-	  throw SimulationException(e.what());
-	}
-    // Simulate
-    unsigned iterations = num_steps;
-    for (; iteration_ < iterations; ++iteration_) {
-      // Global events
-      for (const auto & event : global_events)
-	try {
-	  event(this);
-	} catch (std::exception &e) {
-	  std::cerr << "Exception processing global event "
-		    << __FILE__ << " " << __LINE__ << std::endl;
-	  std::cerr << "Iteration: " << iteration_ << std::endl;
-	  std::cerr << "Event address: " << &event << std::endl;
-	  throw SimulationException(e.what());
-	}
-      std::shuffle(agents.begin(), agents.end(), rng);
-      current_agent_index_ = 0;
+  if (scheduled_events_.size() == 0)
+    return;
+  real time_step = parameters.at(TIME_STEP_SIZE_PARM)[0];
+  if (time_step != schedule_time_step_) {
+    schedule_time_step_ = time_step;
+    schedule_all_ = true;
+  }
+
+  // Resample the events whose parameters have changed
+  std::vector<uint32_t> changed;
+  for (uint32_t event = 0; event < scheduled_events_.size(); ++event) {
+    ScheduledEvent &scheduled = scheduled_events_[event];
+    std::vector<real> values;
+    for (auto & parameter : scheduled.parameters)
+      values.push_back(parameters.at(parameter)[0]);
+    if (values != scheduled.parameter_values) {
+      scheduled.parameter_values = values;
+      changed.push_back(event);
+    }
+  }
+  if (schedule_all_) {
+    scheduler_.reset(scheduled_events_.size());
+    schedule_all_ = false;
+    for (auto & agent : agents)
+      sample_scheduled_events(agent, iteration_);
+  } else {
+    for (auto & event : changed)
       for (auto & agent : agents) {
-	for (auto & event : agent_events)
-	  try {
-	    event(this, agent);
-	  } catch  (std::exception &e) {
-	    std::cerr << "Exception processing agent event "
-		      << __FILE__ << " " << __LINE__ << std::endl;
-	    std::cerr << "Iteration: " << iteration_ << std::endl;
-	    std::cerr << "Agent id: " << agent->id() << std::endl;
-	    std::cerr << "Agent index: " << current_agent_index_ << std::endl;
-	    std::cerr << "Event address: " << &event << std::endl;
-	    throw SimulationException(e.what());
-	  }
-	++current_agent_index_;
-      }
-      if (interim_reports) {
-	for (auto & report : reports) {
-	  try {
-	    unsigned freq = report.frequency();
-	    if ( freq && ( (iteration_ + 1) % freq == 0 ))
-	      report(this);
-	  } catch (std::exception &e) {
-	    std::cerr << "Exception processing end of simulation report "
-		      << __FILE__ << " " << __LINE__ << std::endl;
-	    std::cerr << "Iteration: " << iteration_ << std::endl;
-	    std::cerr << "Report address: " << &report << std::endl;
-	    throw SimulationException(e.what());
-	  }
-	}
+	scheduler_.cancel(agent, event);
+	sample_scheduled_event(agent, event, iteration_);
       }
+  }
+
+  EventScheduler::Entry entry;
+  while (scheduler_.pop_due(iteration_, entry)) {
+    if (entry.event == scheduler_.sample_event()) {
+      sample_scheduled_events(entry.agent, iteration_);
+      continue;
+    }
+    event_agent_ = entry.agent;
+    event_agent_killed_ = false;
+    try {
+      if (counter_rng_)
+	select_stream(iteration_, entry.id, SCHEDULE_STREAM_SLOT +
+		      scheduled_events_.size() + entry.event);
+      bool diff = diffed_aggregates_.size() &&
+	aggregated_[entry.agent->slot()];
+      if (diff)
+	add_contributions(entry.agent, diffed_aggregates_, -1.0,
+			  aggregate_totals_.data());
+      SIM_PROFILE_SCOPE(profiler_, Profiler::SCHEDULED_EVENT, entry.event);
+      scheduled_events_[entry.event].action(this, entry.agent);
+      if (diff)
+	add_contributions(entry.agent, diffed_aggregates_, 1.0,
+			  aggregate_totals_.data());
+    } catch (std::exception &e) {
+      event_agent_ = nullptr;
+      std::cerr << "Exception processing scheduled event "
+		<< __FILE__ << " " << __LINE__ << std::endl;
+      std::cerr << "Iteration: " << iteration_ << std::endl;
+      std::cerr << "Agent id: " << entry.id << std::endl;
+      std::cerr << "Scheduled event: " << entry.event << std::endl;
+      throw SimulationException(e.what());
+    }
+    event_agent_ = nullptr;
+    if (event_agent_killed_) {
+      scheduler_.cancel(entry.agent);
+      event_kills_.push_back(entry.agent);
+    } else {
+      sample_scheduled_events(entry.agent, iteration_ + 1, true);
     }
-    // Reports at end
-    for (auto & report : reports)
-      if (report.after())
-	try {
-	  report(this);
-	} catch (std::exception &e) {
-	  std::cerr << "Exception processing final report "
-		    << __FILE__ << " " << __LINE__ << std::endl;
-	  std::cerr << "Report address: " << &report << std::endl;
-	  throw SimulationException(e.what());
-	}
-  } catch (std::exception &e) {
-    std::cerr << "Exception at " << __FILE__ << " " << __LINE__ << std::endl;
-    throw SimulationException(e.what());
   }
+
+  kill_event_agents();
 }
 
-/* If an event occurs with probability P1 in time T1,
-   then the probability, P2, of it occuring in time T2 is:
-   P2 = 1 - (1 - P1)^(T1/T2).
-   This function returns P2
-*/
+/* The agents killed by scheduled or guarded events are marked in agents by
+   slot and removed in one pass. */
 
-real
-Simulation::prob_event(real prob,
-		       real prob_time_period,
-		       real actual_time_period) const
+void
+Simulation::kill_event_agents()
 {
-  return 1 - pow((1 - prob), (actual_time_period / prob_time_period));
+  if (event_kills_.size() == 0)
+    return;
+  std::vector<char> dying(agent_store.size(), 0);
+  for (auto & agent : event_kills_)
+    dying[agent->slot()] = 1;
+  event_kills_.clear();
+  for (size_t i = 0; i < agents.size(); ++i)
+    if (dying[agents[i]->slot()])
+      kill_agent(i);
+  remove_killed_agents();
 }
 
-real
-Simulation::prob_event(unsigned parameter) const
+size_t
+Simulation::add_aggregate(const char *name,
+			  const std::function<bool(const Agent *)> &predicate,
+			  const std::vector<unsigned> &states,
+			  const std::function<real(const Agent *)> &value)
 {
-  return prob_event(parameters.at(parameter)[0],
-		    1.0, parameters.at(TIME_STEP_SIZE_PARM)[0]);
+  size_t aggregate = aggregates_.size();
+  aggregate_names_[std::string(name)] = aggregate;
+  aggregates_.push_back({predicate, value});
+  aggregate_totals_.push_back(0.0);
+  if (states.size() == 0)
+    diffed_aggregates_.push_back(aggregate);
+  else
+    tracked_aggregates_.push_back(aggregate);
+  for (auto & state : states) {
+    if (state >= state_aggregates_.size())
+      state_aggregates_.resize(state + 1);
+    state_aggregates_[state].push_back(aggregate);
+  }
+  // The agents there already are may not have their states yet, so they
+  // are counted again at the end of the phase.
+  reset_tracking();
+  return aggregate;
 }
 
-bool
-Simulation::is_event(real rand,
-		     real prob,
-		     real prob_time_period,
-		     real actual_time_period) const
+real
+Simulation::aggregate(const std::string &name) const
 {
-  if (rand < prob_event(prob, prob_time_period, actual_time_period))
-    return true;
-  else
-    return false;
+  auto aggregate = aggregate_names_.find(name);
+  if (aggregate == aggregate_names_.end())
+    throw SimulationException("Unknown aggregate.");
+  return aggregate_totals_[aggregate->second];
 }
 
-bool
-Simulation::is_event(real prob,
-		     real prob_time_period,
-		     real actual_time_period) const
+void
+Simulation::recompute_aggregates()
 {
-  std::uniform_real_distribution<> uni_dis;
-  return is_event(uni_dis(rng), prob, prob_time_period, actual_time_period);
+  reset_tracking();
+  track_new_agents();
 }
 
+/* Forgets every agent's part in the aggregates and indexes, so that
+   track_new_agents() counts and indexes them all again. */
 
-bool
-Simulation::is_event(unsigned parameter) const
+void
+Simulation::reset_tracking()
 {
-  return is_event(parameters.at(parameter)[0], 1.0,
-		  parameters.at(TIME_STEP_SIZE_PARM)[0]);
+  std::fill(aggregate_totals_.begin(), aggregate_totals_.end(), 0.0);
+  std::fill(aggregated_.begin(), aggregated_.end(), 0);
+  for (auto & index : state_indexes_) {
+    index.buckets.clear();
+    std::fill(index.bucket_of.begin(), index.bucket_of.end(), -1);
+  }
+  num_tracked_agents_ = 0;
 }
 
+/* Adds sign times the part of an agent in each of the aggregates to
+   totals. */
+
 void
-Simulation::set_parameters_from_csv()
+Simulation::add_contributions(const Agent *agent,
+			      const std::vector<size_t> &aggregates,
+			      const real sign, real *totals) const
 {
+  for (auto & aggregate : aggregates)
+    totals[aggregate] += sign * contribution(aggregate, agent);
+}
+
+/* Counts and indexes the agents appended since the aggregates and indexes
+   were last brought up to date, which are at the end of agents. */
 
+void
+Simulation::track_new_agents()
+{
+  if (aggregates_.size() == 0 && state_indexes_.size() == 0) {
+    num_tracked_agents_ = agents.size();
+    return;
+  }
+  if (aggregated_.size() < agent_store.size())
+    aggregated_.resize(agent_store.size(), 0);
+  for (size_t i = num_tracked_agents_; i < agents.size(); ++i) {
+    Agent *agent = agents[i];
+    for (auto & index : state_indexes_)
+      index_insert(index, agent);
+    if (aggregates_.size() == 0 || aggregated_[agent->slot()])
+      continue;
+    for (size_t aggregate = 0; aggregate < aggregates_.size(); ++aggregate)
+      aggregate_totals_[aggregate] += contribution(aggregate, agent);
+    aggregated_[agent->slot()] = 1;
+  }
+  num_tracked_agents_ = agents.size();
 }
 
+/* The aggregates that depend on the state take the agent's part out
+   before the state changes and put it back after. In cohort mode every
+   aggregate depends on the weight, but the others are brought up to date
+   by the difference taken around the agent's events. */
+
 void
-Simulation::set_agents_from_csv()
+Simulation::set_state(Agent *agent, const unsigned state,
+		      const size_t element, const real value)
 {
-  for (size_t i = 0; i < csv_agent_matrix_.size(); ++i) {
-    unsigned num_agents = (unsigned)
-      csv_agent_matrix_[i][csv_num_agents_col_];
-    for (size_t j = 0; j < num_agents; ++j) {
-      Agent *a = append_agent();
-      for (size_t k = 0; k < csv_agent_matrix_[i].size(); ++k) {
-	if (k == csv_num_agents_col_)
-	  continue;
-	a->states[names_states[csv_agent_col_headings_[k]]] =
-	  {csv_agent_matrix_[i][k]};
-      }
+  const std::vector<size_t> *aggregates = nullptr;
+  if (agent->slot() < aggregated_.size() && aggregated_[agent->slot()]) {
+    if (cohort_mode_ && state == cohort_state_) {
+      aggregates = &tracked_aggregates_;
+    } else if (state < state_aggregates_.size() &&
+	       state_aggregates_[state].size()) {
+      aggregates = &state_aggregates_[state];
     }
   }
+  StateIndex *index = nullptr;
+  if (element == 0 && state < state_index_of_.size() &&
+      state_index_of_[state] >= 0) {
+    index = &state_indexes_[state_index_of_[state]];
+    if (agent->slot() >= index->bucket_of.size() ||
+	index->bucket_of[agent->slot()] < 0)
+      index = nullptr;
+  }
+  if (aggregates == nullptr && index == nullptr) {
+    agent->states[state][element] = value;
+    return;
+  }
+  std::unique_lock<std::mutex> lock(globals_mutex_, std::defer_lock);
+  if (parallel_kill_count)
+    lock.lock();
+  if (aggregates)
+    add_contributions(agent, *aggregates, -1.0, aggregate_totals_.data());
+  if (index)
+    index_remove(*index, agent);
+  agent->states[state][element] = value;
+  if (index)
+    index_insert(*index, agent);
+  if (aggregates)
+    add_contributions(agent, *aggregates, 1.0, aggregate_totals_.data());
+}
+
+void
+Simulation::add_state_index(const unsigned state)
+{
+  if (state < state_index_of_.size() && state_index_of_[state] >= 0)
+    return;
+  if (state >= state_index_of_.size())
+    state_index_of_.resize(state + 1, -1);
+  state_index_of_[state] = state_indexes_.size();
+  state_indexes_.push_back({state, {}, {}, {}});
+  // As with aggregates, the agents are indexed again at the end of the
+  // phase.
+  reset_tracking();
 }
 
+const std::vector<Agent *>&
+Simulation::indexed_agents(const unsigned state, const real value) const
+{
+  static const std::vector<Agent *> none;
+  if (state >= state_index_of_.size() || state_index_of_[state] < 0)
+    throw SimulationException("State is not indexed.");
+  const StateIndex &index = state_indexes_[state_index_of_[state]];
+  long bucket = index_bucket(value);
+  if (bucket >= (long) index.buckets.size())
+    return none;
+  return index.buckets[bucket];
+}
 
 void
-Simulation::set_parameters_csv_initializer(const char *filename, char delim)
+Simulation::add_guarded_event(const unsigned state,
+			      const std::vector<real> &values,
+			      const AgentEvent &event)
 {
-  std::vector <std::vector <std::string> > csv_matrix_strings;
-  std::vector <std::string> csv_parameter_col_headings;
-  try {
-    csv_matrix_strings = process_csv_file(filename, delim);
-    if (csv_matrix_strings.size() == 0)
-      throw SimulationException("No headings in CSV file.");
+  add_state_index(state);
+  std::vector<long> buckets;
+  for (auto & value : values)
+    buckets.push_back(index_bucket(value));
+  guarded_events_.push_back({(size_t) state_index_of_[state], buckets, event});
+}
 
-    // Process header
-    csv_parameter_col_headings = csv_matrix_strings[0];
-    for (size_t i = 0; i < csv_parameter_col_headings.size(); ++i) {
-      if (names_parms.find(csv_parameter_col_headings[i]) == names_parms.end())
-	throw SimulationException("CSV key not found in parameters table");
-    }
+long
+Simulation::index_bucket(const real value)
+{
+  long bucket = (long) value;
+  if (bucket < 0 || bucket != value)
+    throw SimulationException("Indexed state values must be whole numbers "
+			      ">= 0.");
+  return bucket;
+}
 
-    // Fill each of the parameter vectors
-    for (size_t i = 1; i < csv_matrix_strings.size(); ++i) {
-      for (size_t j = 0; j < csv_matrix_strings[i].size(); ++j) {
-	if (csv_matrix_strings[i][j] != "") {
-	  double d = strtor(csv_matrix_strings[i][j].c_str());
-	  parameters[names_parms.at(csv_parameter_col_headings[j])].
-	    push_back(d);
-	}
-      }
-    }
-  } catch (std::exception &e) {
-    throw SimulationException(e.what());
+void
+Simulation::index_insert(StateIndex &index, Agent *agent)
+{
+  size_t slot = agent->slot();
+  if (slot >= index.bucket_of.size()) {
+    index.bucket_of.resize(agent_store.size(), -1);
+    index.position.resize(agent_store.size(), 0);
   }
+  if (index.bucket_of[slot] >= 0)
+    return;
+  long bucket = index_bucket(agent->states[index.state][0]);
+  if (bucket >= (long) index.buckets.size())
+    index.buckets.resize(bucket + 1);
+  index.bucket_of[slot] = bucket;
+  index.position[slot] = index.buckets[bucket].size();
+  index.buckets[bucket].push_back(agent);
 }
 
+/* The last agent of the bucket takes the place of the one removed. */
 
 void
-Simulation::set_agent_csv_initializer(const char *filename, char delim)
+Simulation::index_remove(StateIndex &index, Agent *agent)
 {
-  std::vector <std::vector <std::string> > csv_matrix_strings;
-  try {
-    csv_matrix_strings = process_csv_file(filename, delim);
-    if (csv_matrix_strings.size() == 0)
-      throw SimulationException("No headings in CSV file.");
+  size_t slot = agent->slot();
+  if (slot >= index.bucket_of.size() || index.bucket_of[slot] < 0)
+    return;
+  std::vector<Agent *> &bucket = index.buckets[index.bucket_of[slot]];
+  Agent *last = bucket.back();
+  bucket[index.position[slot]] = last;
+  index.position[last->slot()] = index.position[slot];
+  bucket.pop_back();
+  index.bucket_of[slot] = -1;
+}
 
-    csv_agent_matrix_ = convert_csv_strings_to_reals(csv_matrix_strings);
-    // Process header
-    bool num_found = false;
-    csv_agent_col_headings_ = csv_matrix_strings[0];
-    for (size_t i = 0; i < csv_agent_col_headings_.size(); ++i) {
-      if (csv_agent_col_headings_[i] == "#") {
-	if (num_found == true)
-	  throw SimulationException("Two rows with number of agents in csv.");
-	csv_num_agents_col_ = i;
-	num_found = true;
-      } else {
-	if (names_states.find(csv_agent_col_headings_[i]) ==
-	    names_states.end())
-	  throw SimulationException("CSV key not found in state table");
+/* Each guarded event runs over a copy of its buckets, since its calls may
+   move agents between buckets. The copy is not shuffled: that would cost
+   as much as the events themselves. */
+
+void
+Simulation::run_guarded_events()
+{
+  if (guarded_events_.size() == 0)
+    return;
+  track_new_agents();
+  guarded_killed_.assign(agent_store.size(), 0);
+  uint32_t slot = agent_events.size();
+  for (auto & guarded : guarded_events_) {
+    StateIndex &index = state_indexes_[guarded.index];
+    guarded_agents_.clear();
+    for (auto & bucket : guarded.buckets)
+      if (bucket < (long) index.buckets.size())
+	guarded_agents_.insert(guarded_agents_.end(),
+			       index.buckets[bucket].begin(),
+			       index.buckets[bucket].end());
+    for (auto & agent : guarded_agents_) {
+      long bucket = index.bucket_of[agent->slot()];
+      if (guarded_killed_[agent->slot()] ||
+	  std::find(guarded.buckets.begin(), guarded.buckets.end(), bucket)
+	  == guarded.buckets.end())
+	continue;
+      event_agent_ = agent;
+      event_agent_killed_ = false;
+      bool diff = diffed_aggregates_.size() > 0;
+      try {
+	if (counter_rng_)
+	  select_stream(iteration_, agent->id(), slot);
+	if (diff)
+	  add_contributions(agent, diffed_aggregates_, -1.0,
+			    aggregate_totals_.data());
+	SIM_PROFILE_SCOPE(profiler_, Profiler::GUARDED_EVENT,
+			  slot - agent_events.size());
+	guarded.event(this, agent);
+	if (diff)
+	  add_contributions(agent, diffed_aggregates_, 1.0,
+			    aggregate_totals_.data());
+      } catch (std::exception &e) {
+	event_agent_ = nullptr;
+	std::cerr << "Exception processing guarded event "
+		  << __FILE__ << " " << __LINE__ << std::endl;
+	std::cerr << "Iteration: " << iteration_ << std::endl;
+	std::cerr << "Agent id: " << agent->id() << std::endl;
+	std::cerr << "Event slot: " << slot << std::endl;
+	throw SimulationException(e.what());
+      }
+      event_agent_ = nullptr;
+      if (event_agent_killed_) {
+	guarded_killed_[agent->slot()] = 1;
+	event_kills_.push_back(agent);
       }
     }
-    if (num_found == false)
-      throw SimulationException("No row with number of agents in csv.");
+    ++slot;
+  }
+  kill_event_agents();
+}
+
+void
+Simulation::set_cohort_state(const unsigned weight_state,
+			     const unsigned merge_frequency)
+{
+  cohort_mode_ = true;
+  cohort_state_ = weight_state;
+  cohort_merge_frequency_ = merge_frequency;
+}
+
+bool
+Simulation::cohort_mode() const
+{
+  return cohort_mode_;
+}
+
+real
+Simulation::weight(const Agent *agent) const
+{
+  return cohort_mode_ ? agent->states.at(cohort_state_)[0] : 1.0;
+}
+
+real
+Simulation::population() const
+{
+  if (cohort_mode_ == false)
+    return agents.size();
+  real population = 0.0;
+  for (auto & agent : agents)
+    population += weight(agent);
+  return population;
+}
+
+/* Cohorts are keyed by the values of all their states but the weight.
+   The first cohort with a key keeps its place in agents. */
+
+void
+Simulation::merge_cohorts()
+{
+  remove_killed_agents();
+  std::map<std::vector<real>, Agent *> cohorts;
+  std::vector<real> key;
+  size_t kept = 0;
+  for (auto & agent : agents) {
+    key.clear();
+    for (unsigned state = 0; state < agent_store.num_states(); ++state)
+      if (state != cohort_state_)
+	for (size_t element = 0; element < agent_store.arity(state);
+	     ++element)
+	  key.push_back(agent_store.column(state, element)[agent->slot()]);
+    auto cohort = cohorts.find(key);
+    if (cohort == cohorts.end()) {
+      cohorts.insert({key, agent});
+      agents[kept++] = agent;
+    } else {
+      cohort->second->states[cohort_state_][0] +=
+	agent->states[cohort_state_][0];
+      if (scheduled_events_.size())
+	scheduler_.cancel(agent);
+      released_agents_.push_back(agent);
+    }
+  }
+  agents.resize(kept);
+  killed_.assign(kept, 0);
+  recompute_aggregates();
+}
+
+void
+Simulation::set_agent_threads(const unsigned num_threads,
+			      const size_t chunk_size)
+{
+  num_agent_threads_ = std::max(num_threads, 1u);
+  agent_chunk_size_ = chunk_size;
+  thread_pool_.reset();
+}
+
+unsigned
+Simulation::agent_threads() const
+{
+  return num_agent_threads_;
+}
+
+std::unique_lock<std::mutex>
+Simulation::lock_globals()
+{
+  return std::unique_lock<std::mutex>(globals_mutex_);
+}
+
+
+void
+Simulation::set_agent_states()
+{
+  iteration_ = 0;
+  for (auto & agent : agents) {
+    unsigned slot = 0;
+    for (auto & init_func : init_agent_funcs_) {
+      if (counter_rng_)
+	select_stream(INITIALIZATION_ITERATION, agent->id(), slot++);
+      init_func(agent, this);
+    }
+  }
+}
+
+void
+Simulation::set_agent_states(const std::initializer_list <
+			     std::function<void(Agent *,
+						Simulation *)>> init_funcs)
+{
+  set_agent_initializers(init_funcs);
+  set_agent_states();
+}
+
+void
+Simulation::set_events(const std::initializer_list<AgentEvent> events)
+{
+  agent_events = events;
+}
+
+void
+Simulation::set_reports(const std::initializer_list <report_parms_> reprts)
+{
+  for (auto & r : reprts)
+    reports.push_back(Report(r.report_func, r.iteration, r.before, r.after));
+}
+
+void
+Simulation::perturb_parameters(const Perturbers& perturbers)
+{
+  prob_cache_valid_ = false;
+  for (auto & perturber : perturbers) {
+    auto & vals = parameters[perturber.first];
+    for (size_t i = 0; i < vals.size(); ++i)
+      vals[i] = savedParameters_[perturber.first][i] + perturber.second(rng);
+  }
+}
+
+
+void
+Simulation::montecarlo(const unsigned num_steps,
+		       const bool interim_reports,
+		       const Perturbers& perturbers,
+		       std::function<bool(const Simulation *,
+					  unsigned)> carryon)
+{
+  try {
+#ifdef SIM_VECTORIZE
+    savedParameters_.resize(num_parms_);
+#endif
+    // Save parameters
+    for (auto & perturber : perturbers)
+      std::copy(parameters[perturber.first].begin(),
+		parameters[perturber.first].end(),
+		std::back_inserter(savedParameters_[perturber.first]));
+    // Run the simulations, profiling them all as one
+    profiler_.clear();
+    profile_replicate_ = true;
+    for (int i = 0; carryon(this, i); ++i) {
+      replicate_ = i;
+      perturb_parameters(perturbers);
+      simulate(num_steps, interim_reports);
+    }
+    profile_replicate_ = false;
+    print_profile();
+    // Restore the parameters
+    for (auto & perturber : perturbers)
+      std::copy(savedParameters_[perturber.first].begin(),
+		savedParameters_[perturber.first].end(),
+		parameters[perturber.first].begin());
+  } catch(std::exception &e) {
+    profile_replicate_ = false;
+    throw SimulationException(e.what());
+  }
+}
+
+/* Runs the Monte Carlo replicates concurrently. Every replicate is a fresh
+   clone of this (configured but not yet simulated) simulation, run on one
+   of num_threads workers. The caller's carryon function is called, one call
+   at a time, with the simulation of each finished replicate (or with this
+   simulation for the first dispatch of each worker) and the number of the
+   next replicate. It returns whether to run that replicate.
+
+   Each replicate's thread local rng is seeded from seed_ and the replicate
+   number, so results do not depend on which worker ran a replicate. Events,
+   initializers and reports must not share mutable state between clones
+   (e.g. function static variables), because clones run at the same time.
+*/
+
+void
+Simulation::montecarlo_parallel(const unsigned num_steps,
+				const bool interim_reports,
+				const Perturbers& perturbers,
+				std::function<bool(const Simulation *,
+						   unsigned)> carryon,
+				unsigned num_threads)
+{
+  std::mutex mutex;
+  std::exception_ptr exception;
+  unsigned next_replicate = 0;
+  bool done = false;
+
+  if (num_threads == 0)
+    num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+  try {
+#ifdef SIM_VECTORIZE
+    savedParameters_.resize(num_parms_);
+#endif
+    for (auto & perturber : perturbers) {
+      savedParameters_[perturber.first].clear();
+      std::copy(parameters[perturber.first].begin(),
+		parameters[perturber.first].end(),
+		std::back_inserter(savedParameters_[perturber.first]));
+    }
+  } catch(std::exception &e) {
+    throw SimulationException(e.what());
+  }
+  profiler_.clear();
+
+  auto worker = [&](const unsigned worker_num) {
+    std::unique_ptr<Simulation> finished;
+    sim::thread_num = worker_num;
+    for (;;) {
+      std::unique_ptr<Simulation> replicate;
+      {
+	std::lock_guard<std::mutex> lock(mutex);
+	const Simulation *previous = finished ? finished.get() : this;
+	bool run = false;
+	try {
+	  if (finished)
+	    profiler_.merge(finished->profiler_);
+	  run = carryon(previous, next_replicate) && !done;
+	  finished.reset();
+	  if (run) {
+	    std::seed_seq seq({seed_, next_replicate});
+	    rng.seed(seq);
+	    ++next_replicate;
+	    replicate.reset(clone());
+	    replicate->replicate_ = next_replicate - 1;
+	    replicate->profile_replicate_ = true;
+	    replicate->perturb_parameters(perturbers);
+	  }
+	} catch (...) {
+	  if (!exception)
+	    exception = std::current_exception();
+	  run = false;
+	}
+	if (run == false) {
+	  done = true;
+	  return;
+	}
+      }
+      try {
+	replicate->simulate(num_steps, interim_reports);
+	finished = std::move(replicate);
+      } catch (...) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!exception)
+	  exception = std::current_exception();
+	done = true;
+	return;
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < num_threads; ++i)
+    threads.push_back(std::thread(worker, i + 1));
+  for (auto & thread : threads)
+    thread.join();
+
+  if (exception) {
+    try {
+      std::rethrow_exception(exception);
+    } catch (std::exception &e) {
+      throw SimulationException(e.what());
+    }
+  }
+  print_profile();
+}
+
+void
+Simulation::initialize_states()
+{
+  if (snapshot_filename_.size()) {
+    read_snapshot(snapshot_filename_.c_str());
+    return;
+  }
+  set_global_states();
+  if (csv_agent_filename_.size())
+    set_agents_from_csv();
+  set_agent_states();
+}
+
+/* Run the reports that run before the simulation (before is true) or
+   after it. */
+void
+Simulation::run_reports(const bool before)
+{
+  SIM_PROFILE_SCOPE(profiler_, Profiler::PHASE, Profiler::REPORTS);
+  size_t index = 0;
+  for (auto & report : reports) {
+    if (before ? report.before() : report.after())
+      try {
+	SIM_PROFILE_SCOPE(profiler_, Profiler::REPORT, index);
+	report(this);
+      } catch (std::exception &e) {
+	std::cerr << "Exception processing "
+		  << (before ? "pre-simulation" : "final") << " report "
+		  << __FILE__ << " " << __LINE__ << std::endl;
+	std::cerr << "Report: " << index << std::endl;
+	std::cerr << "Report address: " << &report << std::endl;
+	throw SimulationException(e.what());
+      }
+    ++index;
+  }
+}
+
+/* Run the iterations from iteration_ up to num_steps. */
+void
+Simulation::iterate(unsigned num_steps, bool interim_reports)
+{
+  unsigned iterations = num_steps;
+#ifdef SIM_PROFILE
+  // The times of the reports before the simulation are not part of an
+  // iteration.
+  profiler_.flush();
+#endif
+  for (; iteration_ < iterations; ++iteration_) {
+    SIM_PROFILE_LAPS(laps, profiler_);
+    // Global events
+    unsigned slot = 0;
+    for (const auto & event : global_events)
+      try {
+	if (counter_rng_)
+	  select_stream(iteration_, GLOBAL_STREAM_ID, slot);
+	SIM_PROFILE_SCOPE(profiler_, Profiler::GLOBAL_EVENT, slot);
+	event(this);
+	++slot;
+      } catch (std::exception &e) {
+	std::cerr << "Exception processing global event "
+		  << __FILE__ << " " << __LINE__ << std::endl;
+	std::cerr << "Iteration: " << iteration_ << std::endl;
+	std::cerr << "Event address: " << &event << std::endl;
+	throw SimulationException(e.what());
+      }
+    SIM_PROFILE_LAP(laps, Profiler::PHASE, Profiler::GLOBAL_EVENTS);
+    remove_killed_agents();
+    refresh_probabilities();
+    SIM_PROFILE_LAP(laps, Profiler::PHASE, Profiler::BOOKKEEPING);
+    order_agents();
+    SIM_PROFILE_LAP(laps, Profiler::PHASE, Profiler::SHUFFLE);
+    killed_.assign(agents.size(), 0);
+    if (cohort_mode_) {
+      // Cohorts split off by events are visited by apply_cohort_events.
+      size_t num_agents = agents.size();
+      bool diff = diffed_aggregates_.size() > 0;
+      for (size_t i = 0; i < num_agents; ++i)
+	if (killed_[i] == 0) {
+	  Agent *agent = agents[i];
+	  if (diff)
+	    add_contributions(agent, diffed_aggregates_, -1.0,
+			      aggregate_totals_.data());
+	  apply_cohort_events(agent, i);
+	  if (diff)
+	    add_contributions(agent, diffed_aggregates_, 1.0,
+			      aggregate_totals_.data());
+	}
+    } else if (num_agent_threads_ > 1) {
+      apply_agent_events_parallel();
+    } else {
+      // Agents appended by events are not visited in this iteration.
+      size_t num_agents = agents.size();
+      bool diff = diffed_aggregates_.size() > 0;
+      for (current_agent_index_ = 0; current_agent_index_ < num_agents;
+	   ++current_agent_index_)
+	if (killed_[current_agent_index_] == 0) {
+	  Agent *agent = agents[current_agent_index_];
+	  if (diff)
+	    add_contributions(agent, diffed_aggregates_, -1.0,
+			      aggregate_totals_.data());
+	  apply_agent_events(agent, current_agent_index_);
+	  if (diff)
+	    add_contributions(agent, diffed_aggregates_, 1.0,
+			      aggregate_totals_.data());
+	}
+    }
+    SIM_PROFILE_LAP(laps, Profiler::PHASE, Profiler::AGENT_EVENTS);
+    remove_killed_agents();
+    SIM_PROFILE_LAP(laps, Profiler::PHASE, Profiler::BOOKKEEPING);
+    run_guarded_events();
+    SIM_PROFILE_LAP(laps, Profiler::PHASE, Profiler::GUARDED_EVENTS);
+    run_scheduled_events();
+    SIM_PROFILE_LAP(laps, Profiler::PHASE, Profiler::SCHEDULED_EVENTS);
+    prob_cache_valid_ = false;
+    if (cohort_merge_frequency_ &&
+	(iteration_ + 1) % cohort_merge_frequency_ == 0)
+      merge_cohorts();
+    release_dead_agents();
+    track_new_agents();
+    SIM_PROFILE_LAP(laps, Profiler::PHASE, Profiler::BOOKKEEPING);
+    if (interim_reports) {
+      size_t index = 0;
+      interim_reporting_ = true;
+      for (auto & report : reports) {
+	try {
+	  unsigned freq = report.frequency();
+	  if ( freq && ( (iteration_ + 1) % freq == 0 )) {
+	    SIM_PROFILE_SCOPE(profiler_, Profiler::REPORT, index);
+	    report(this);
+	  }
+	} catch (std::exception &e) {
+	  std::cerr << "Exception processing end of simulation report "
+		    << __FILE__ << " " << __LINE__ << std::endl;
+	  std::cerr << "Iteration: " << iteration_ << std::endl;
+	  std::cerr << "Report: " << index << std::endl;
+	  std::cerr << "Report address: " << &report << std::endl;
+	  interim_reporting_ = false;
+	  throw SimulationException(e.what());
+	}
+	++index;
+      }
+      interim_reporting_ = false;
+    }
+    SIM_PROFILE_LAP(laps, Profiler::PHASE, Profiler::REPORTS);
+    if (checkpoint_frequency_ &&
+	(iteration_ + 1) % checkpoint_frequency_ == 0)
+      PopulationSnapshot::write_checkpoint(*this,
+					   checkpoint_filename_.c_str(),
+					   iteration_ + 1);
+    SIM_PROFILE_LAP(laps, Profiler::PHASE, Profiler::CHECKPOINT);
+    SIM_PROFILE_END_ITERATION(laps);
+  }
+}
+
+/* Prints the profile, unless this is a replicate of montecarlo or there is
+   no output, after adding up the times recorded since the last iteration
+   (the final reports). */
+
+void
+Simulation::print_profile()
+{
+#ifdef SIM_PROFILE
+  profiler_.flush();
+  if (profile_replicate_ || profile_output_ == nullptr)
+    return;
+  if (profile_json_)
+    profiler_.print_json(*profile_output_);
+  else
+    profiler_.print(*profile_output_);
+#endif
+}
+
+/* Hands the rest of an asynchronous report to the reporter thread. */
+
+void
+Simulation::post_report(std::function<void()> task) const
+{
+  if (!reporter_)
+    reporter_.reset(new AsyncReporter(report_buffers_));
+  reporter_->post(std::move(task));
+}
+
+void
+Simulation::wait_reports()
+{
+  if (reporter_)
+    reporter_->wait();
+}
+
+void
+Simulation::set_report_buffers(const unsigned buffers)
+{
+  wait_reports();
+  reporter_.reset();
+  report_buffers_ = buffers;
+}
+
+void
+Simulation::set_profile_output(std::ostream *out, const bool json)
+{
+  profile_output_ = out;
+  profile_json_ = json;
+}
+
+void
+Simulation::set_profile_names(const Profiler::Kind kind,
+			      const std::vector<std::string> &names)
+{
+  profiler_.set_names(kind, names);
+}
+
+const Profiler&
+Simulation::profile() const
+{
+  return profiler_;
+}
+
+void
+Simulation::simulate(unsigned num_steps,
+		     bool interim_reports)
+{
+  try {
+    if (profile_replicate_ == false)
+      profiler_.clear();
+    initialize_states();
+    schedule_all_ = true;
+    recompute_aggregates();
+    run_reports(true);
+    iterate(num_steps, interim_reports);
+    run_reports(false);
+    wait_reports();
+    print_profile();
+  } catch (std::exception &e) {
+    prob_cache_valid_ = false;
+    reporter_.reset();
+    std::cerr << "Exception at " << __FILE__ << " " << __LINE__ << std::endl;
+    throw SimulationException(e.what());
+  }
+}
+
+void
+Simulation::resume(const char *filename, unsigned num_steps,
+		   bool interim_reports)
+{
+  try {
+    profiler_.clear();
+    read_checkpoint(filename);
+    schedule_all_ = true;
+    recompute_aggregates();
+    iterate(num_steps, interim_reports);
+    run_reports(false);
+    wait_reports();
+    print_profile();
+  } catch (std::exception &e) {
+    prob_cache_valid_ = false;
+    reporter_.reset();
+    std::cerr << "Exception at " << __FILE__ << " " << __LINE__ << std::endl;
+    throw SimulationException(e.what());
+  }
+}
+
+/* Converts each rate parameter into the probability of its event occurring
+   in one time step, so that prob_event(parameter) is a table lookup while
+   the agent events run. Only the parameters whose rate, or the time step,
+   changed since the last refresh are recomputed. */
+
+void
+Simulation::refresh_probabilities()
+{
+  prob_cache_valid_ = false;
+#ifdef SIM_VECTORIZE
+  if (TIME_STEP_SIZE_PARM >= parameters.size() ||
+      parameters[TIME_STEP_SIZE_PARM].size() == 0)
+    return;
+#else
+  auto time_step_it = parameters.find(TIME_STEP_SIZE_PARM);
+  if (time_step_it == parameters.end() || time_step_it->second.size() == 0)
+    return;
+#endif
+  real time_step = parameters[TIME_STEP_SIZE_PARM][0];
+  bool all = time_step != prob_cache_time_step_;
+  prob_cache_time_step_ = time_step;
+
+  auto refresh = [&](const unsigned parameter,
+		     const std::vector<real> &values) {
+    if (parameter >= prob_cache_.size()) {
+      prob_cache_.resize(parameter + 1, 0.0);
+      prob_cache_rates_.resize(parameter + 1, 0.0);
+      prob_cached_.resize(parameter + 1, 0);
+    }
+    if (values.size() == 0) {
+      prob_cached_[parameter] = 0;
+    } else if (all || prob_cached_[parameter] == 0 ||
+	       prob_cache_rates_[parameter] != values[0]) {
+      prob_cache_rates_[parameter] = values[0];
+      prob_cache_[parameter] = prob_event(values[0], 1.0, time_step);
+      prob_cached_[parameter] = 1;
+    }
+  };
+#ifdef SIM_VECTORIZE
+  for (size_t i = 0; i < parameters.size(); ++i)
+    refresh(i, parameters[i]);
+#else
+  for (auto & parameter : parameters)
+    refresh(parameter.first, parameter.second);
+#endif
+  prob_cache_valid_ = true;
+}
+
+void
+Simulation::apply_agent_events(Agent *agent, size_t agent_index)
+{
+  unsigned slot = 0;
+  for (auto & event : agent_events)
+    try {
+      if (counter_rng_)
+	select_stream(iteration_, agent->id(), slot);
+      SIM_PROFILE_SCOPE(profiler_, Profiler::AGENT_EVENT, slot,
+			profile_thread);
+      event(this, agent);
+      ++slot;
+      if (killed_[agent_index])
+	break;
+    } catch  (std::exception &e) {
+      std::cerr << "Exception processing agent event "
+		<< __FILE__ << " " << __LINE__ << std::endl;
+      std::cerr << "Iteration: " << iteration_ << std::endl;
+      std::cerr << "Agent id: " << agent->id() << std::endl;
+      std::cerr << "Agent index: " << agent_index << std::endl;
+      std::cerr << "Event address: " << &event << std::endl;
+      throw SimulationException(e.what());
+    }
+}
+
+ThreadPool&
+Simulation::thread_pool()
+{
+  if (!thread_pool_) {
+    unsigned seed = seed_;
+    thread_pool_.reset(new ThreadPool(num_agent_threads_,
+				      [seed](unsigned thread) {
+					std::seed_seq seq({seed, thread});
+					sim::thread_num = thread;
+					rng.seed(seq);
+				      }));
+  }
+  return *thread_pool_;
+}
+
+void
+Simulation::set_agent_order(const AgentOrder order, const size_t block_size)
+{
+  agent_order_ = order;
+  order_block_size_ = block_size;
+}
+
+AgentOrder
+Simulation::agent_order() const
+{
+  return agent_order_;
+}
+
+/* Orders the agents for the agent events by the agent order policy. */
+
+void
+Simulation::order_agents()
+{
+  size_t n = agents.size();
+  if (n < 2)
+    return;
+  switch (agent_order_) {
+  case FULL_SHUFFLE:
+    std::shuffle(agents.begin(), agents.end(), rng);
+    break;
+  case BLOCK_SHUFFLE: {
+    size_t block_size = order_block_size_ ? order_block_size_ : 1024;
+    order_blocks_.resize((n + block_size - 1) / block_size);
+    for (size_t b = 0; b < order_blocks_.size(); ++b)
+      order_blocks_[b] = b * block_size;
+    std::shuffle(order_blocks_.begin(), order_blocks_.end(), rng);
+    order_scratch_.clear();
+    order_scratch_.reserve(n);
+    for (auto & start : order_blocks_) {
+      auto begin = agents.begin() + start;
+      auto end = agents.begin() + std::min(n, start + block_size);
+      size_t first = order_scratch_.size();
+      order_scratch_.insert(order_scratch_.end(), begin, end);
+      std::shuffle(order_scratch_.begin() + first, order_scratch_.end(), rng);
+    }
+    agents.swap(order_scratch_);
+    break;
+  }
+  case ROTATE_SHUFFLE: {
+    std::uniform_int_distribution<size_t> position(0, n - 1);
+    size_t start = position(rng);
+    std::uniform_int_distribution<size_t> strides(1, n - 1);
+    size_t stride;
+    do {
+      stride = strides(rng);
+    } while (greatest_common_divisor(stride, n) != 1);
+    order_scratch_.resize(n);
+    for (size_t i = 0, j = start; i < n; ++i) {
+      order_scratch_[i] = agents[j];
+      j += stride;
+      if (j >= n)
+	j -= n;
+    }
+    agents.swap(order_scratch_);
+    break;
+  }
+  case NO_SHUFFLE:
+    break;
+  case PARALLEL_SHUFFLE:
+    if (num_agent_threads_ > 1)
+      parallel_shuffle();
+    else
+      std::shuffle(agents.begin(), agents.end(), rng);
+    break;
+  }
+}
+
+/* A uniformly random permutation in three parallel passes: every chunk
+   draws a random bucket for each of its agents and counts them, every
+   chunk copies its agents to their buckets, which are laid out one after
+   the other, and every bucket is shuffled. Each chunk and bucket has its
+   own counter-based stream. */
+
+void
+Simulation::parallel_shuffle()
+{
+  ThreadPool &pool = thread_pool();
+  size_t n = agents.size();
+  size_t chunk_size = std::max((size_t) 4096, n / (4 * pool.size()) + 1);
+  size_t num_chunks = (n + chunk_size - 1) / chunk_size;
+  size_t num_buckets = num_chunks;
+  std::vector<size_t> counts(num_chunks * num_buckets, 0);
+  order_buckets_.resize(n);
+  order_scratch_.resize(n);
+  uint32_t seed = seed_, replicate = replicate_, iteration = iteration_;
+
+  pool.run(num_chunks, [&](size_t chunk, unsigned) {
+      CounterRng stream(seed, replicate);
+      stream.set_stream(iteration, chunk, SHUFFLE_STREAM_SLOT);
+      size_t end = std::min(n, (chunk + 1) * chunk_size);
+      size_t *count = &counts[chunk * num_buckets];
+      for (size_t i = chunk * chunk_size; i < end; ++i) {
+	// The bias of a multiply shift is negligible for so few buckets
+	uint32_t bucket = ((stream() >> 32) * num_buckets) >> 32;
+	order_buckets_[i] = bucket;
+	++count[bucket];
+      }
+    });
+  // Offsets of every chunk's part of every bucket, bucket by bucket
+  std::vector<size_t> bucket_starts(num_buckets + 1, 0);
+  size_t offset = 0;
+  for (size_t bucket = 0; bucket < num_buckets; ++bucket) {
+    bucket_starts[bucket] = offset;
+    for (size_t chunk = 0; chunk < num_chunks; ++chunk) {
+      size_t count = counts[chunk * num_buckets + bucket];
+      counts[chunk * num_buckets + bucket] = offset;
+      offset += count;
+    }
+  }
+  bucket_starts[num_buckets] = offset;
+  pool.run(num_chunks, [&](size_t chunk, unsigned) {
+      size_t end = std::min(n, (chunk + 1) * chunk_size);
+      size_t *next = &counts[chunk * num_buckets];
+      for (size_t i = chunk * chunk_size; i < end; ++i)
+	order_scratch_[next[order_buckets_[i]]++] = agents[i];
+    });
+  pool.run(num_buckets, [&](size_t bucket, unsigned) {
+      CounterRng stream(seed, replicate);
+      stream.set_stream(iteration, bucket, SHUFFLE_STREAM_SLOT + 1);
+      std::shuffle(order_scratch_.begin() + bucket_starts[bucket],
+		   order_scratch_.begin() + bucket_starts[bucket + 1],
+		   stream);
+    });
+  agents.swap(order_scratch_);
+}
+
+/* Splits the agents into chunks and applies the agent events to the chunks
+   on the thread pool. Each chunk only writes the tombstones of its own
+   agents, and counts its kills separately, so the killed agents are removed
+   by the same single pass as in the serial loop. */
+
+void
+Simulation::apply_agent_events_parallel()
+{
+  thread_pool();
+#ifdef SIM_PROFILE
+  profiler_.set_threads(thread_pool_->size());
+#endif
+  size_t chunk_size = agent_chunk_size_;
+  if (chunk_size == 0)
+    chunk_size = std::max((size_t) 1024,
+			  agents.size() / (4 * thread_pool_->size()) + 1);
+  size_t num_chunks = (agents.size() + chunk_size - 1) / chunk_size;
+  std::vector<size_t> kills(num_chunks, 0);
+  bool diff = diffed_aggregates_.size() > 0;
+  std::vector< std::vector<real> > diffs(diff ? num_chunks : 0,
+					 std::vector<real>(aggregates_.size(),
+							   0.0));
+
+  thread_pool_->run(num_chunks, [&](size_t chunk, unsigned thread) {
+      size_t end = std::min(agents.size(), (chunk + 1) * chunk_size);
+      parallel_kill_count = &kills[chunk];
+#ifdef SIM_PROFILE
+      profile_thread = thread;
+#else
+      (void) thread;
+#endif
+      try {
+	for (size_t i = chunk * chunk_size; i < end; ++i) {
+	  if (killed_[i])
+	    continue;
+	  parallel_agent_index = i;
+	  if (diff)
+	    add_contributions(agents[i], diffed_aggregates_, -1.0,
+			      diffs[chunk].data());
+	  apply_agent_events(agents[i], i);
+	  if (diff)
+	    add_contributions(agents[i], diffed_aggregates_, 1.0,
+			      diffs[chunk].data());
+	}
+      } catch (...) {
+	parallel_kill_count = nullptr;
+	throw;
+      }
+      parallel_kill_count = nullptr;
+    });
+
+  for (auto & count : kills)
+    num_killed_ += count;
+  for (auto & chunk : diffs)
+    for (size_t i = 0; i < chunk.size(); ++i)
+      aggregate_totals_[i] += chunk[i];
+}
+
+/* Runs the agent events of a cohort, and then those of the cohorts split
+   off from it, from the event that split them off. */
+
+void
+Simulation::apply_cohort_events(Agent *agent, size_t agent_index)
+{
+  cohort_splits_.push_back({agent, agent_index, 0, {}});
+  while (cohort_splits_.size()) {
+    CohortSplit split = std::move(cohort_splits_.back());
+    cohort_splits_.pop_back();
+    current_agent_index_ = split.agent_index;
+    cohort_agent_ = split.agent;
+    auto event = std::next(agent_events.begin(), split.event);
+    for (cohort_event_ = split.event; event != agent_events.end();
+	 ++event, ++cohort_event_) {
+      if (cohort_event_ == split.event)
+	cohort_outcomes_.swap(split.outcomes);
+      else
+	cohort_outcomes_.clear();
+      cohort_next_outcome_ = 0;
+      try {
+	if (counter_rng_)
+	  select_stream(iteration_, split.agent->id(), cohort_event_);
+	SIM_PROFILE_SCOPE(profiler_, Profiler::AGENT_EVENT, cohort_event_);
+	(*event)(this, split.agent);
+      } catch  (std::exception &e) {
+	cohort_agent_ = nullptr;
+	cohort_splits_.clear();
+	std::cerr << "Exception processing agent event "
+		  << __FILE__ << " " << __LINE__ << std::endl;
+	std::cerr << "Iteration: " << iteration_ << std::endl;
+	std::cerr << "Agent id: " << split.agent->id() << std::endl;
+	std::cerr << "Agent index: " << split.agent_index << std::endl;
+	std::cerr << "Event: " << cohort_event_ << std::endl;
+	throw SimulationException(e.what());
+      }
+      if (is_killed(split.agent_index))
+	break;
+    }
+  }
+  cohort_agent_ = nullptr;
+}
+
+/* The outcome of an event with probability prob for the cohort whose
+   agent events are running. */
+
+bool
+Simulation::split_cohort(const real prob)
+{
+  if (cohort_next_outcome_ < cohort_outcomes_.size())
+    return cohort_outcomes_[cohort_next_outcome_++];
+  unsigned long individuals =
+    (unsigned long) cohort_agent_->states[cohort_state_][0];
+  unsigned long happened;
+  if (individuals <= 1) {
+    happened = uniform() < prob ? individuals : 0;
+  } else {
+    std::binomial_distribution<unsigned long> binomial(individuals,
+						       std::min(prob, 1.0));
+    happened = counter_rng_ ? binomial(agent_rng) : binomial(rng);
+  }
+  bool outcome = happened > 0;
+  if (happened > 0 && happened < individuals) {
+    set_state(cohort_agent_, cohort_state_, 0, individuals - happened);
+    Agent *split = append_agent();
+    agent_store.copy_slot(cohort_agent_->slot(), split->slot());
+    split->states[cohort_state_][0] = happened;
+    std::vector<char> outcomes(cohort_outcomes_);
+    outcomes.push_back(1);
+    cohort_splits_.push_back({split, agents.size() - 1, cohort_event_,
+	  outcomes});
+    outcome = false;
+  }
+  cohort_outcomes_.push_back(outcome);
+  ++cohort_next_outcome_;
+  return outcome;
+}
+
+/* If an event occurs with probability P1 in time T1,
+   then the probability, P2, of it occuring in time T2 is:
+   P2 = 1 - (1 - P1)^(T1/T2).
+   This function returns P2
+*/
+
+real
+Simulation::prob_event(real prob,
+		       real prob_time_period,
+		       real actual_time_period) const
+{
+  return 1 - pow((1 - prob), (actual_time_period / prob_time_period));
+}
+
+bool
+Simulation::is_event(real rand,
+		     real prob,
+		     real prob_time_period,
+		     real actual_time_period) const
+{
+  if (rand < prob_event(prob, prob_time_period, actual_time_period))
+    return true;
+  else
+    return false;
+}
+
+bool
+Simulation::is_event(real prob,
+		     real prob_time_period,
+		     real actual_time_period) const
+{
+  return is_event(uniform(), prob, prob_time_period, actual_time_period);
+}
+
+bool
+Simulation::is_event(real prob,
+		     real prob_time_period,
+		     real actual_time_period)
+{
+  if (cohort_agent_)
+    return split_cohort(prob_event(prob, prob_time_period,
+				   actual_time_period));
+  return is_event(uniform(), prob, prob_time_period, actual_time_period);
+}
+
+void
+Simulation::draw_uniforms(real *rand,
+			  const size_t *indices,
+			  const size_t n,
+			  const uint32_t stream_slot,
+			  const unsigned trial) const
+{
+  if (counter_rng_) {
+    CounterRng stream(seed_, replicate_);
+    for (size_t i = 0; i < n; ++i) {
+      stream.set_stream(iteration_, agents[indices[i]]->id(), stream_slot);
+      for (unsigned t = 0; t < trial; ++t)
+	uniform_real(stream);
+      rand[i] = uniform_real(stream);
+    }
+  } else {
+    for (size_t i = 0; i < n; ++i)
+      rand[i] = uniform_real(rng);
+  }
+}
+
+void
+Simulation::fire_events(const unsigned parameter,
+			const std::vector<size_t> &eligible,
+			std::vector<size_t> &fired,
+			const unsigned trial) const
+{
+  real rand[BATCH_BLOCK_SIZE];
+  char hit[BATCH_BLOCK_SIZE];
+  const real prob = prob_event(parameter);
+
+  for (size_t start = 0; start < eligible.size();
+       start += BATCH_BLOCK_SIZE) {
+    size_t n = std::min(BATCH_BLOCK_SIZE, eligible.size() - start);
+    draw_uniforms(rand, &eligible[start], n, BATCH_STREAM_SLOT + parameter,
+		  trial);
+    for (size_t i = 0; i < n; ++i)
+      hit[i] = rand[i] < prob;
+    for (size_t i = 0; i < n; ++i)
+      if (hit[i])
+	fired.push_back(eligible[start + i]);
+  }
+}
+
+void
+Simulation::fire_events_by_state(const unsigned prob_state,
+				 const std::vector<size_t> &eligible,
+				 std::vector<size_t> &fired,
+				 const unsigned trial) const
+{
+  real rand[BATCH_BLOCK_SIZE];
+  real prob[BATCH_BLOCK_SIZE];
+  char hit[BATCH_BLOCK_SIZE];
+  const std::vector<real> &column = agent_store.column(prob_state);
+
+  for (size_t start = 0; start < eligible.size();
+       start += BATCH_BLOCK_SIZE) {
+    size_t n = std::min(BATCH_BLOCK_SIZE, eligible.size() - start);
+    draw_uniforms(rand, &eligible[start], n,
+		  BATCH_STATE_STREAM_SLOT + prob_state, trial);
+    for (size_t i = 0; i < n; ++i)
+      prob[i] = column[agents[eligible[start + i]]->slot()];
+    for (size_t i = 0; i < n; ++i)
+      hit[i] = rand[i] < prob[i];
+    for (size_t i = 0; i < n; ++i)
+      if (hit[i])
+	fired.push_back(eligible[start + i]);
+  }
+}
+
+void
+Simulation::set_parameters_from_csv()
+{
+
+}
+
+/* Find the "#" column of an agent CSV file and check the other headings
+   are state names. */
+static size_t
+agent_csv_count_column(const std::vector<std::string> &headings,
+		       const std::unordered_map<std::string, unsigned>
+		       &names_states)
+{
+  bool num_found = false;
+  size_t num_agents_col = 0;
+
+  for (size_t i = 0; i < headings.size(); ++i) {
+    if (headings[i] == "#") {
+      if (num_found == true)
+	throw SimulationException("Two rows with number of agents in csv.");
+      num_agents_col = i;
+      num_found = true;
+    } else {
+      if (names_states.find(headings[i]) == names_states.end())
+	throw SimulationException("CSV key not found in state table");
+    }
+  }
+  if (num_found == false)
+    throw SimulationException("No row with number of agents in csv.");
+  return num_agents_col;
+}
+
+/* The states are looked up once from the headings. The first agent of a
+   row is set from the row and the others are copied from it slot by
+   slot. In cohort mode the first agent is the row's cohort. */
+void
+Simulation::set_agents_from_csv()
+{
+  std::vector< std::pair<size_t, unsigned> > column_states;
+  size_t num_agents_col = 0;
+
+  try {
+    read_csv_rows(csv_agent_filename_.c_str(), csv_agent_delim_,
+		  [&](const std::vector<std::string> &headings) {
+		    num_agents_col = agent_csv_count_column(headings,
+							    names_states);
+		    for (size_t k = 0; k < headings.size(); ++k)
+		      if (k != num_agents_col)
+			column_states.push_back({k,
+			      names_states.at(headings[k])});
+		  },
+		  [&](const std::vector<real> &row) {
+		    unsigned num_agents = (unsigned) row[num_agents_col];
+		    if (num_agents == 0)
+		      return;
+		    Agent *prototype = append_agent();
+		    for (auto & column_state : column_states)
+		      prototype->states[column_state.second] =
+			{row[column_state.first]};
+		    if (cohort_mode_) {
+		      prototype->states[cohort_state_] = {(real) num_agents};
+		      return;
+		    }
+		    for (size_t j = 1; j < num_agents; ++j)
+		      agent_store.copy_slot(prototype->slot(),
+					    append_agent()->slot());
+		  });
+  } catch (std::exception &e) {
+    throw SimulationException(e.what());
+  }
+}
+
+
+void
+Simulation::set_parameters_csv_initializer(const char *filename, char delim)
+{
+  std::vector <unsigned> csv_parameter_cols;
+  try {
+    CsvFile csv(filename);
+    csv.for_each_row(delim, [&](size_t row,
+				const std::vector<CsvField> &fields) {
+		       // Process header
+		       if (row == 0) {
+			 for (auto & field : fields) {
+			   auto it = names_parms.find(field.str());
+			   if (it == names_parms.end())
+			     throw SimulationException("CSV key not found in "
+						       "parameters table");
+			   csv_parameter_cols.push_back(it->second);
+			 }
+			 return;
+		       }
+		       // Fill each of the parameter vectors
+		       if (fields.size() > csv_parameter_cols.size())
+			 throw SimulationException("CSV row has more entries "
+						   "than headings.");
+		       for (size_t j = 0; j < fields.size(); ++j)
+			 if (!fields[j].empty())
+			   parameters[csv_parameter_cols[j]].
+			     push_back(strtor(fields[j].begin, fields[j].end));
+		     });
+    if (csv.size() == 0)
+      throw SimulationException("No headings in CSV file.");
+  } catch (std::exception &e) {
+    throw SimulationException(e.what());
+  }
+}
+
+
+void
+Simulation::write_snapshot(const char *filename) const
+{
+  PopulationSnapshot::write(*this, filename);
+}
+
+void
+Simulation::read_snapshot(const char *filename)
+{
+  PopulationSnapshot::read(*this, filename);
+}
+
+void
+Simulation::set_checkpoint(const char *filename, const unsigned frequency)
+{
+  checkpoint_filename_ = filename;
+  checkpoint_frequency_ = frequency;
+}
+
+void
+Simulation::write_checkpoint(const char *filename) const
+{
+  PopulationSnapshot::write_checkpoint(*this, filename, iteration_);
+}
+
+void
+Simulation::read_checkpoint(const char *filename)
+{
+  PopulationSnapshot::read_checkpoint(*this, filename);
+}
+
+void
+Simulation::set_snapshot_initializer(const char *filename)
+{
+  MappedFile file(filename, "population snapshot");
+  snapshot_filename_ = filename;
+}
+
+void
+Simulation::set_agent_csv_initializer(const char *filename, char delim)
+{
+  try {
+    CsvFile csv(filename);
+    agent_csv_count_column(csv.headings(delim), names_states);
+    csv_agent_filename_ = filename;
+    csv_agent_delim_ = delim;
   } catch (std::exception &e) {
     throw SimulationException(e.what());
   }
@@ -5,16 +5,153 @@
 
 namespace sim {
   class Simulation {
+    friend class PopulationSnapshot;
   private:
     unsigned seed_;
     unsigned long agent_count_ = 0;
     unsigned long iteration_ = 0;
-    size_t current_agent_index_;
+    bool interim_reporting_ = false;
+    unsigned replicate_ = 0;
+    bool counter_rng_ = false;
+    std::vector<real> prob_cache_;
+    std::vector<real> prob_cache_rates_;
+    std::vector<char> prob_cached_;
+    real prob_cache_time_step_ = 0.0;
+    bool prob_cache_valid_ = false;
+    void refresh_probabilities();
+    size_t current_agent_index_ = 0;
     std::list <GlobalStateInit> init_global_state_funcs_;
     std::list <AgentInit> init_agent_funcs_;
-    std::vector <std::string> csv_agent_col_headings_;
-    std::vector <std::vector <real> > csv_agent_matrix_;
-    size_t csv_num_agents_col_;
+    std::string csv_agent_filename_;
+    char csv_agent_delim_ = ',';
+    std::string snapshot_filename_;
+    std::string checkpoint_filename_;
+    unsigned checkpoint_frequency_ = 0;
+    unsigned num_agent_threads_ = 1;
+    size_t agent_chunk_size_ = 0;
+    std::unique_ptr<ThreadPool> thread_pool_;
+    ThreadPool& thread_pool();
+    AgentOrder agent_order_ = FULL_SHUFFLE;
+    size_t order_block_size_ = 0;
+    std::vector<Agent *> order_scratch_;
+    std::vector<size_t> order_blocks_;
+    std::vector<uint32_t> order_buckets_;
+    void order_agents();
+    void parallel_shuffle();
+    std::mutex globals_mutex_;
+    AgentPool agent_pool_;
+    bool keep_dead_agents_ = true;
+    std::vector<Agent *> released_agents_;
+    std::vector<char> killed_;
+    size_t num_killed_ = 0;
+    unsigned long num_released_agents_ = 0;
+    DeadAgentSink dead_agent_sink_;
+    std::vector< std::function<bool(const Agent *)> > death_counters_;
+    std::vector<unsigned long> death_counts_;
+    std::unordered_map<std::string, size_t> death_counter_names_;
+    std::vector<ScheduledEvent> scheduled_events_;
+    EventScheduler scheduler_;
+    bool schedule_all_ = true;
+    real schedule_time_step_ = 0.0;
+    // The agent a scheduled or guarded event is running for. Its kills are
+    // collected and applied by slot by kill_event_agents.
+    Agent *event_agent_ = nullptr;
+    bool event_agent_killed_ = false;
+    std::vector<Agent *> event_kills_;
+    void kill_event_agents();
+    // after_event is true when an agent's events are resampled after one
+    // of them ran, which then draws from streams of its own.
+    void sample_scheduled_event(Agent *agent, const uint32_t event,
+				const unsigned long from,
+				const bool after_event = false);
+    void sample_scheduled_events(Agent *agent, const unsigned long from,
+				 const bool after_event = false);
+    void run_scheduled_events();
+    bool cohort_mode_ = false;
+    unsigned cohort_state_ = 0;
+    unsigned cohort_merge_frequency_ = 0;
+    // While the agent events of a cohort run: the cohort, the event, and
+    // the outcomes of the event's calls to is_event so far, some of which
+    // may be replayed for a cohort split off by one of them.
+    struct CohortSplit {
+      Agent *agent;
+      size_t agent_index;
+      unsigned event;
+      std::vector<char> outcomes;
+    };
+    Agent *cohort_agent_ = nullptr;
+    unsigned cohort_event_ = 0;
+    std::vector<char> cohort_outcomes_;
+    size_t cohort_next_outcome_ = 0;
+    std::vector<CohortSplit> cohort_splits_;
+    bool split_cohort(const real prob);
+    void apply_cohort_events(Agent *agent, size_t agent_index);
+    struct Aggregate {
+      std::function<bool(const Agent *)> predicate;
+      std::function<real(const Agent *)> value;
+    };
+    std::vector<Aggregate> aggregates_;
+    std::vector<real> aggregate_totals_;
+    std::unordered_map<std::string, size_t> aggregate_names_;
+    // The aggregates updated by set_state, all and by state, and the
+    // others.
+    std::vector<size_t> tracked_aggregates_;
+    std::vector< std::vector<size_t> > state_aggregates_;
+    std::vector<size_t> diffed_aggregates_;
+    // Whether an agent's slot is counted in the aggregates, and the number
+    // of agents at the start of agents that are.
+    std::vector<char> aggregated_;
+    size_t num_tracked_agents_ = 0;
+    inline real contribution(const size_t aggregate, const Agent *agent) const;
+    void add_contributions(const Agent *agent,
+			   const std::vector<size_t> &aggregates,
+			   const real sign, real *totals) const;
+    // The agents by the value of element 0 of a state: the bucket of each
+    // slot, or -1, and its position in the bucket.
+    struct StateIndex {
+      unsigned state;
+      std::vector< std::vector<Agent *> > buckets;
+      std::vector<long> bucket_of;
+      std::vector<size_t> position;
+    };
+    std::vector<StateIndex> state_indexes_;
+    std::vector<int> state_index_of_;
+    struct GuardedEvent {
+      size_t index;
+      std::vector<long> buckets;
+      AgentEvent event;
+    };
+    std::vector<GuardedEvent> guarded_events_;
+    std::vector<Agent *> guarded_agents_;
+    std::vector<char> guarded_killed_;
+    static long index_bucket(const real value);
+    void index_insert(StateIndex &index, Agent *agent);
+    void index_remove(StateIndex &index, Agent *agent);
+    void run_guarded_events();
+    void track_new_agents();
+    void reset_tracking();
+    void record_death(const Agent *agent);
+    void release_dead_agents();
+    void select_stream(const uint32_t iteration, const uint32_t id,
+		       const uint32_t slot) const;
+    void draw_uniforms(real *rand, const size_t *indices, const size_t n,
+		       const uint32_t stream_slot, const unsigned trial) const;
+    void apply_agent_events(Agent *agent, size_t agent_index);
+    void apply_agent_events_parallel();
+    void run_reports(const bool before);
+    void iterate(unsigned num_steps, bool interim_reports);
+    // Times are only recorded when compiled with SIM_PROFILE. A replicate
+    // of montecarlo leaves printing its profile to montecarlo.
+    Profiler profiler_;
+    std::ostream *profile_output_ = &std::clog;
+    bool profile_json_ = false;
+    bool profile_replicate_ = false;
+    void print_profile();
+    // The thread of the asynchronous reports, started by the first one.
+    mutable std::unique_ptr<AsyncReporter> reporter_;
+    unsigned report_buffers_ = 2;
+    void post_report(std::function<void()> task) const;
+    void wait_reports();
 #ifdef SIM_VECTORIZE
     size_t num_parms_;
     size_t num_states_;
@@ -25,6 +162,7 @@ namespace sim {
   public:
     ParameterMap parameters;
     StateMap states;
+    AgentStore agent_store;
     GlobalEvents global_events;
     AgentEvents agent_events;
     Reports reports;
@@ -41,13 +179,240 @@ namespace sim {
     #else
     Simulation(unsigned seed = 13);
     #endif
+    Simulation(const Simulation &simulation);
+    Simulation& operator=(const Simulation &) = delete;
     ~Simulation();
+    virtual Simulation* clone() const;
     virtual Agent* append_agent();
     void set_number_agents(const unsigned num_agents);
+    // If false, agents are not moved to dead_agents when they are killed.
+    // Instead they are returned, at the end of the iteration, to the pool,
+    // and their slot in agent_store is reused by the next agent appended.
+    void set_keep_dead_agents(const bool keep);
+    bool keep_dead_agents() const;
+    // The number of agents killed, whether kept or not.
+    unsigned long num_dead() const;
+    // Hands every agent to sink as it is removed from agents, e.g. to
+    // stream it to a DeadAgentArchive, and keeps it in dead_agents only if
+    // keep is true.
+    void set_dead_agent_sink(const DeadAgentSink &sink,
+			     const bool keep = false);
+    // Counts the removed agents for which count returns true, whether they
+    // are kept or not. Only agents removed after the counter is added are
+    // counted. num_dead(name) returns the count.
+    void add_death_counter(const char *name,
+			   const std::function<bool(const Agent *)> &count);
+    unsigned long num_dead(const std::string &name) const;
+    // Releases every agent, alive or dead, and empties agent_store.
+    void clear_agents();
+    // Streams the agent CSV file set by set_agent_csv_initializer, creating
+    // the agents of each row as it is read.
     void set_agents_from_csv();
     unsigned iteration() const;
+    // The number of iterations run: iteration() except in interim reports,
+    // which run at the end of their iteration, before it is counted.
+    unsigned long completed_iterations() const;
+    // Counter-based random streams. When on, the engine points
+    // sim::agent_rng at the stream keyed by (seed, replicate, iteration,
+    // agent id, event slot) before every agent event, at the stream
+    // (seed, replicate, INITIALIZATION_ITERATION, agent id, initializer
+    // slot) before every agent initializer and at (seed, replicate,
+    // iteration, GLOBAL_STREAM_ID, event slot) before every global event.
+    // is_event() then draws from sim::agent_rng, and any agent's draws are
+    // the same whatever the number of threads or the order agents are
+    // visited in. Events that draw numbers themselves should use
+    // sim::agent_rng for this to hold.
+    void set_counter_rng(const bool counter_rng = true);
+    bool counter_rng() const;
+    void set_replicate(const unsigned replicate);
+    unsigned replicate() const;
+    // Replays the stream an agent event drew from.
+    CounterRng agent_stream(const unsigned long agent_id,
+			    const unsigned iteration,
+			    const unsigned event_slot) const;
+    // Killing an agent is deferred: the agent is marked dead, its
+    // remaining agent events in the iteration are skipped, and it is moved
+    // from agents to dead_agents, with all the other agents killed in the
+    // same phase, by a single pass after the global events and after the
+    // agent events of every iteration.
     void kill_agent(size_t agent_index_);
     void kill_agent();
+    bool is_killed(size_t agent_index) const;
+    // Whether the agent the running agent event was called for is killed.
+    bool is_killed() const;
+    // Removes the agents killed so far. simulate() calls this itself.
+    void remove_killed_agents();
+    // Scheduled events. Instead of a Bernoulli trial for every agent at
+    // every step, the iteration each agent's event happens in is sampled
+    // from the geometric distribution of the per step probability, and the
+    // agent waits in a priority queue until then. The engine samples every
+    // agent when a simulation starts, new agents when they are appended,
+    // all agents when one of the event's parameters or the time step
+    // changes, and an agent's events after one of them has happened (from
+    // the next iteration). Events that change a state a hazard depends on
+    // should call reschedule(agent); reschedule() resamples every agent.
+    // Scheduled events run after the agent events of each iteration, in
+    // order of agent id, and may kill the agent they are run for.
+    // Checkpoints don't hold the queue: a resumed simulation samples every
+    // agent again, so it is not the same run as the uninterrupted one.
+    unsigned add_scheduled_event(const Hazard &hazard,
+				 const AgentEvent &action,
+				 const std::vector<unsigned> &parameters = {});
+    // An event whose hazard is the rate parameter.
+    unsigned add_scheduled_event(const unsigned parameter,
+				 const AgentEvent &action);
+    void reschedule();
+    void reschedule(Agent *agent);
+    // Aggregates. add_aggregate registers the number of living agents for
+    // which predicate is true, or with value the sum of value over them,
+    // which aggregate() then returns without visiting the agents. In cohort
+    // mode each agent counts weight times. The engine counts agents as
+    // they are appended, when a phase of an iteration ends, and uncounts
+    // them as they are removed. It recomputes the aggregates when a
+    // simulation starts or resumes, and at the end of the phase an
+    // aggregate is added in. The changes of states are caught:
+    // - if states lists the states the aggregate depends on, by
+    //   set_state(), which agent and global events must then use to change
+    //   them (in cohort mode the weight state is always one of them; in
+    //   parallel step mode set_state takes lock_globals() itself),
+    // - otherwise by taking the difference of each agent's part before and
+    //   after its agent events and scheduled events. Global events that
+    //   change states must use set_state for these too, or call
+    //   recompute_aggregates().
+    size_t add_aggregate(const char *name,
+			 const std::function<bool(const Agent *)> &predicate,
+			 const std::vector<unsigned> &states = {},
+			 const std::function<real(const Agent *)> &value
+			 = nullptr);
+    real aggregate(const std::string &name) const;
+    inline real aggregate(const size_t index) const
+    {
+      return aggregate_totals_[index];
+    }
+    void recompute_aggregates();
+    void set_state(Agent *agent, const unsigned state, const size_t element,
+		   const real value);
+    // State indexes. add_state_index keeps the living agents in buckets by
+    // the value of element 0 of a state, which must be a whole number >= 0
+    // and, once the simulation has started, be changed with set_state().
+    // Agents are indexed when appended and when a phase ends, like the
+    // aggregates. indexed_agents returns a bucket, in no particular order.
+    void add_state_index(const unsigned state);
+    const std::vector<Agent *>& indexed_agents(const unsigned state,
+					       const real value) const;
+    // Guarded events. An event guarded by values of a state is only called
+    // for the agents in their buckets of the state's index, which is added
+    // if need be, so its cost is proportional to the number of agents
+    // eligible for it. Guarded events run after the agent events of each
+    // iteration and before the scheduled events, one after the other in the
+    // order they are added, each over the agents in its buckets when it
+    // starts. The agents are not shuffled: their order is that of the
+    // buckets, which changes as agents join and leave them, so events whose
+    // outcome depends on the order agents are visited in should not be
+    // guarded. Agents moved out of the buckets or killed by then are
+    // skipped. They run serially, treat a cohort as one agent and,
+    // with counter-based streams, draw from stream slot number of agent
+    // events + number of the guarded event.
+    void add_guarded_event(const unsigned state,
+			   const std::vector<real> &values,
+			   const AgentEvent &event);
+    // Cohort mode. Each agent is a cohort of weight_state[0] identical
+    // individuals, e.g. a row of an agent CSV file, which then creates one
+    // agent whose weight is the row's "#" column. In agent events,
+    // is_event draws the number of the cohort's individuals the event
+    // happens to from a binomial distribution. If it happens to all of
+    // them is_event returns true, and if to none false. Otherwise the
+    // cohort is split: it keeps the individuals the event didn't happen
+    // to, for which is_event returns false, and a copy of it with the
+    // others is appended to agents. The event is run again for the copy
+    // from the start, the calls to is_event so far returning the same as
+    // for the cohort and this one true, and then the rest of its agent
+    // events. So agent events:
+    // - must not change an agent's states before their last call to
+    //   is_event, or hold a reference to a state across a call to it,
+    // - must use is_event, not their own random numbers, to decide what
+    //   happens to some individuals only.
+    // Killing a cohort kills all its individuals, and num_dead and the
+    // death counters count individuals. Global events, batch trials and
+    // scheduled events treat a cohort as one agent, and the agent events
+    // run serially whatever set_agent_threads says. With a merge frequency
+    // K, merge_cohorts() runs after every K iterations.
+    void set_cohort_state(const unsigned weight_state,
+			  const unsigned merge_frequency = 0);
+    bool cohort_mode() const;
+    // The number of individuals of an agent: 1 unless in cohort mode.
+    real weight(const Agent *agent) const;
+    // The number of individuals alive.
+    real population() const;
+    // Merges the cohorts alive whose states, other than the weight, are
+    // equal. The cohorts merged into others are released, without being
+    // counted as deaths.
+    void merge_cohorts();
+    // The order the agents are visited in by the agent events of an
+    // iteration, set before them, after the global events:
+    // - FULL_SHUFFLE (the default) is a uniformly random permutation of
+    //   agents every iteration. It costs a random access per agent, and
+    //   scatters the agents over the store, which slows the loop after it.
+    // - BLOCK_SHUFFLE splits agents into blocks of block_size (1024 by
+    //   default), shuffles the order of the blocks and the agents within
+    //   each block. Agents never leave their block, so the agents of a
+    //   block are always visited close together and those of different
+    //   blocks never interleave: it is fair between blocks and within them,
+    //   but not between two agents' order in neighbouring blocks, and it
+    //   only suits models where an agent's outcome doesn't depend on which
+    //   agents it is visited near. It keeps most of the agents' locality.
+    // - ROTATE_SHUFFLE visits agents from a random start with a random
+    //   stride coprime with their number. Every agent is as likely to come
+    //   first, but only number * (number of coprime strides) of the
+    //   possible orders are ever used, and agents a given distance apart in
+    //   agents stay that distance apart: suitable when the order only
+    //   needs to vary which agents go first, e.g. first come first served
+    //   for a resource that rarely runs out.
+    // - NO_SHUFFLE keeps the order of agents (the order agents were
+    //   appended in, killed agents removed). Only for models whose
+    //   outcome doesn't depend on the order, e.g. agents that never read or
+    //   write global states or other agents.
+    // - PARALLEL_SHUFFLE is a uniformly random permutation like
+    //   FULL_SHUFFLE computed on the agent threads: each chunk of agents
+    //   scatters its agents to random buckets, and the buckets are then
+    //   shuffled in parallel. It draws from counter-based streams keyed
+    //   by iteration and chunk or bucket, not from sim::rng, so the order
+    //   depends on the number of threads but not on which thread runs what.
+    //   With one agent thread it is FULL_SHUFFLE.
+    void set_agent_order(const AgentOrder order, const size_t block_size = 0);
+    AgentOrder agent_order() const;
+    // Profiling. Compiled with SIM_PROFILE, simulate() and resume() time
+    // each phase of every iteration (global events, shuffle, agent events,
+    // guarded events, scheduled events, reports, checkpoint, and the
+    // bookkeeping between them), every call of each event and report, and
+    // print the profile when they end to the stream set by
+    // set_profile_output, std::clog by default or nullptr for none, as a
+    // table or, if json, a JSON object. montecarlo and montecarlo_parallel
+    // print that of all the replicates when they end instead. The times of
+    // agent events run in parallel are summed over the threads. Timing a
+    // call reads the clock twice, which for cheap agent events can double
+    // the time of the agent events phase: compare the events with each
+    // other rather than with an unprofiled run.
+    // set_profile_names names the events of a kind, in the order they were
+    // set or added, e.g.
+    //   set_profile_names(Profiler::AGENT_EVENT, {"infection", "death"});
+    // Without SIM_PROFILE nothing is timed and profile() stays empty.
+    void set_profile_output(std::ostream *out, const bool json = false);
+    void set_profile_names(const Profiler::Kind kind,
+			   const std::vector<std::string> &names);
+    const Profiler& profile() const;
+    // Parallel step mode. Agent events are applied to chunks of the agents
+    // concurrently on num_threads threads (1, the default, is serial).
+    // In this mode agent events:
+    // - may read and write the states of the agent they are passed,
+    // - may read parameters and global states, but may only write global
+    //   states while holding lock_globals(),
+    // - may kill the agent they are passed, but no other agent,
+    // - must not append agents or give a state a new or larger arity.
+    void set_agent_threads(const unsigned num_threads,
+			   const size_t chunk_size = 0);
+    unsigned agent_threads() const;
+    std::unique_lock<std::mutex> lock_globals();
     void set_parameter(const unsigned parameter,
 		       const std::initializer_list<real> values,
 		       const char* name = "");
@@ -72,7 +437,34 @@ namespace sim {
     void set_global_states();
     void set_global_states(const std::initializer_list<GlobalStateInit>
 			   init_funcs);
+    // Checks the headings of an agent CSV file and reads its rows during
+    // initialize_states(): one column must be "#", the number of agents
+    // for the row, and the others state names.
     void set_agent_csv_initializer(const char *filename, char delim=',');
+    // Population snapshots. write_snapshot saves the agents and global
+    // states, typically just after initialize_states(), and read_snapshot
+    // replaces the agents and global states with those saved. Once
+    // set_snapshot_initializer is called, initialize_states() reads the
+    // snapshot instead of running the global state initializers, the agent
+    // CSV file and the agent initializers.
+    void write_snapshot(const char *filename) const;
+    void read_snapshot(const char *filename);
+    void set_snapshot_initializer(const char *filename);
+    // Checkpoints. With a frequency K, simulate() writes a checkpoint to
+    // filename after every K iterations, replacing the last one. A
+    // checkpoint holds the agents, the kept dead agents, the dead agent and
+    // death counter counts, the global states, the parameters, the
+    // iteration, the replicate and the state of sim::rng. resume() reads
+    // one and runs the remaining iterations up to num_steps and the final
+    // reports; the result is the same as the run that wrote it as long as
+    // the events and reports keep no state of their own, the same death
+    // counters are added, and the run is serial or uses counter-based
+    // streams. A dead agent sink is not rewound.
+    void set_checkpoint(const char *filename, const unsigned frequency);
+    void write_checkpoint(const char *filename) const;
+    void read_checkpoint(const char *filename);
+    void resume(const char *filename, unsigned num_steps,
+		bool interim_reports = true);
     void set_agent_initializers(const std::initializer_list <AgentInit>
 				init_funcs);
     void set_global_events(const std::initializer_list<GlobalEvent> evnts);
@@ -87,6 +479,32 @@ namespace sim {
     };
 
     void set_reports(const std::initializer_list <report_parms_> reprts);
+    // Asynchronous reports. At a report point, with frequency, before and
+    // after as in set_reports, capture is called on the simulation thread
+    // and returns a snapshot of what the report needs, e.g. a few
+    // aggregates or a copy of some columns. write is then called with it
+    // on a reporter thread while the next iterations run, so it must not
+    // touch the simulation, and its output may interleave with that of
+    // the other reports. simulate() and resume() wait for the writes
+    // before they return, and rethrow the first exception of one, if not
+    // already rethrown by a later report point. set_report_buffers sets
+    // how many snapshots may wait or be written at a time (2 by default);
+    // when that many are, the next report point waits for one to finish.
+    template <typename Capture, typename Write>
+    void add_async_report(const Capture &capture, const Write &write,
+			  const unsigned frequency = 1,
+			  const bool before = true, const bool after = true)
+    {
+      typedef typename std::decay<typename std::result_of
+				  <Capture(const Simulation *)>::type>::type
+	Snapshot;
+      reports.push_back(Report([capture, write](const Simulation *s) {
+	    std::shared_ptr<Snapshot> snapshot =
+	      std::make_shared<Snapshot>(capture(s));
+	    s->post_report([write, snapshot]() { write(*snapshot); });
+	  }, frequency, before, after));
+    }
+    void set_report_buffers(const unsigned buffers);
     void initialize_states();
     virtual void simulate(const unsigned num_steps,
 			  const bool interim_reports);
@@ -94,14 +512,95 @@ namespace sim {
 		    const bool interim_reports,
 		    const Perturbers& peturbers,
 		    std::function<bool(const Simulation *, unsigned)> carryon);
+    void montecarlo_parallel(const unsigned num_steps,
+			     const bool interim_reports,
+			     const Perturbers& peturbers,
+			     std::function<bool(const Simulation *, unsigned)>
+			     carryon,
+			     unsigned num_threads = 0);
     // Helper functions
+    // While agent, guarded and scheduled events run, prob_event(parameter)
+    // and is_event(parameter) look the per time step probability of a rate
+    // parameter up in a table that is refreshed after the global events of
+    // every iteration, when
+    // the parameter or the time step has changed. set_parameter() and
+    // perturb_parameters() invalidate the table straight away. Agent events
+    // must not write the parameters map directly.
     real prob_event(real P1, real T1, real T2) const;
-    real prob_event(unsigned parameter) const;
+    inline real prob_event(unsigned parameter) const;
     bool is_event(real rand, real P1, real T1, real T2) const;
     bool is_event(real P1, real T1, real T2) const;
-    bool is_event(unsigned parameter) const;
+    inline bool is_event(unsigned parameter) const;
+    // In cohort mode, is_event called on a non-const simulation from an
+    // agent event splits the cohort.
+    bool is_event(real P1, real T1, real T2);
+    inline bool is_event(unsigned parameter);
+    // Uniform random number in [0, 1) from the current random stream.
+    inline real uniform() const;
+    // Batch Bernoulli trials over many agents at once, for events written
+    // as passes over the population (typically global events). eligible
+    // holds indices into agents; the indices of the agents whose event
+    // occurred are appended to fired, in the order of eligible. Random
+    // numbers are drawn and compared in fixed size blocks so that the
+    // compare loop vectorizes. With counter_rng() on, each agent draws
+    // from its own stream (iteration, agent id, BATCH_STREAM_SLOT +
+    // parameter, or BATCH_STATE_STREAM_SLOT + state), taking its draw
+    // number trial. Trials on the same parameter or state in an iteration
+    // must therefore have different trial numbers to be independent, as
+    // two is_event calls in an agent event are.
+    // The probability is the per time step probability of a rate parameter.
+    void fire_events(const unsigned parameter,
+		     const std::vector<size_t> &eligible,
+		     std::vector<size_t> &fired,
+		     const unsigned trial = 0) const;
+    // The probability of each agent is read from element 0 of a state,
+    // which must already be a per time step probability.
+    void fire_events_by_state(const unsigned prob_state,
+			      const std::vector<size_t> &eligible,
+			      std::vector<size_t> &fired,
+			      const unsigned trial = 0) const;
   };
 
+  inline real
+  Simulation::uniform() const
+  {
+    return counter_rng_ ? uniform_real(agent_rng) : uniform_real(rng);
+  }
+
+  inline real
+  Simulation::prob_event(unsigned parameter) const
+  {
+    if (prob_cache_valid_ && parameter < prob_cached_.size() &&
+	prob_cached_[parameter])
+      return prob_cache_[parameter];
+    return prob_event(parameters.at(parameter)[0],
+		      1.0, parameters.at(TIME_STEP_SIZE_PARM)[0]);
+  }
+
+  inline bool
+  Simulation::is_event(unsigned parameter) const
+  {
+    return uniform() < prob_event(parameter);
+  }
+
+  inline real
+  Simulation::contribution(const size_t aggregate, const Agent *agent) const
+  {
+    const Aggregate &a = aggregates_[aggregate];
+    if (a.predicate(agent) == false)
+      return 0.0;
+    return (a.value ? a.value(agent) : 1.0) *
+      (cohort_mode_ ? weight(agent) : 1.0);
+  }
+
+  inline bool
+  Simulation::is_event(unsigned parameter)
+  {
+    if (cohort_agent_)
+      return split_cohort(prob_event(parameter));
+    return uniform() < prob_event(parameter);
+  }
+
 
   /* Commonly used events */
 
@@ -0,0 +1,85 @@
+#include "ThreadPool.hh"
+
+using namespace sim;
+
+ThreadPool::ThreadPool(const unsigned num_threads,
+		       std::function<void(unsigned)> init) : next_task_(0)
+{
+  for (unsigned i = 1; i < num_threads; ++i)
+    threads_.push_back(std::thread([this, i, init]() {
+	  if (init)
+	    init(i);
+	  work(i);
+	}));
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  start_.notify_all();
+  for (auto & thread : threads_)
+    thread.join();
+}
+
+void
+ThreadPool::work_on_batch(const unsigned thread)
+{
+  for (size_t i = next_task_++; i < num_tasks_; i = next_task_++) {
+    try {
+      (*task_)(i, thread);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!exception_)
+	exception_ = std::current_exception();
+    }
+  }
+}
+
+void
+ThreadPool::work(const unsigned thread)
+{
+  unsigned generation = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      start_.wait(lock, [&]() { return stop_ || generation_ != generation; });
+      if (stop_)
+	return;
+      generation = generation_;
+    }
+    work_on_batch(thread);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      --busy_;
+    }
+    finish_.notify_one();
+  }
+}
+
+void
+ThreadPool::run(const size_t num_tasks, const Task& task)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    task_ = &task;
+    num_tasks_ = num_tasks;
+    next_task_ = 0;
+    exception_ = nullptr;
+    busy_ = threads_.size();
+    ++generation_;
+  }
+  start_.notify_all();
+  work_on_batch(0);
+  std::exception_ptr exception;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    finish_.wait(lock, [&]() { return busy_ == 0; });
+    task_ = nullptr;
+    exception = exception_;
+  }
+  if (exception)
+    std::rethrow_exception(exception);
+}
@@ -0,0 +1,49 @@
+#ifndef SIM_THREAD_POOL_H
+#define SIM_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sim {
+
+  // A fixed set of threads that repeatedly run batches of tasks. The thread
+  // calling run() takes part as thread 0, so a pool of size n starts n - 1
+  // threads. Workers sleep between batches, which makes it cheap to call
+  // run() once per iteration of a simulation.
+  class ThreadPool {
+  private:
+    typedef std::function<void(size_t, unsigned)> Task;
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable start_;
+    std::condition_variable finish_;
+    const Task *task_ = nullptr;
+    size_t num_tasks_ = 0;
+    std::atomic<size_t> next_task_;
+    unsigned generation_ = 0;
+    unsigned busy_ = 0;
+    bool stop_ = false;
+    std::exception_ptr exception_;
+    void work(const unsigned thread);
+    void work_on_batch(const unsigned thread);
+  public:
+    // init is called once on each started thread, with its thread number,
+    // before it runs any tasks. Use it to seed thread local state.
+    ThreadPool(const unsigned num_threads,
+	       std::function<void(unsigned)> init = nullptr);
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool& operator=(const ThreadPool &) = delete;
+    ~ThreadPool();
+    inline unsigned size() const { return threads_.size() + 1; }
+    // Calls task(i, thread) for every i in [0, num_tasks) and waits for
+    // them all. The first exception thrown by a task is rethrown here.
+    void run(const size_t num_tasks, const Task& task);
+  };
+}
+
+#endif
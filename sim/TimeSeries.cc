@@ -0,0 +1,181 @@
+#include <cstring>
+#include <sstream>
+
+#include "sim.hh"
+
+using namespace sim;
+
+namespace {
+  const char MAGIC[8] = {'S', 'I', 'M', 'S', 'E', 'R', 'S', '\0'};
+
+  template <typename T>
+  void write_value(std::ofstream &out, const T value)
+  {
+    out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+  }
+
+  template <typename T>
+  void write_column(std::ofstream &out, const std::vector<T> &column)
+  {
+    out.write(reinterpret_cast<const char *>(column.data()),
+	      column.size() * sizeof(T));
+  }
+
+  template <typename T>
+  bool read_column(std::ifstream &in, std::vector<T> &column,
+		   const size_t size)
+  {
+    column.resize(size);
+    in.read(reinterpret_cast<char *>(column.data()), size * sizeof(T));
+    return !in.fail();
+  }
+}
+
+void
+TimeSeriesWriter::File::write_block()
+{
+  if (replicates.empty())
+    return;
+  write_value<uint32_t>(out, replicates.size());
+  write_column(out, replicates);
+  write_column(out, iterations);
+  for (auto & column : values) {
+    write_column(out, column);
+    column.clear();
+  }
+  replicates.clear();
+  iterations.clear();
+}
+
+TimeSeriesWriter::File::~File()
+{
+  write_block();
+}
+
+TimeSeriesWriter::TimeSeriesWriter(const char *filename,
+				   const std::vector<std::string> &names,
+				   const size_t block_rows) :
+  file_(new File)
+{
+  file_->out.open(filename, std::ios::binary | std::ios::trunc);
+  if (file_->out.fail()) {
+    std::stringstream ss;
+    ss << "Can't open time series " << filename;
+    throw SimulationException(ss.str().c_str());
+  }
+  file_->block_rows = block_rows ? block_rows : 1;
+  file_->replicates.reserve(file_->block_rows);
+  file_->iterations.reserve(file_->block_rows);
+  file_->values.resize(names.size());
+  for (auto & column : file_->values)
+    column.reserve(file_->block_rows);
+  file_->out.write(MAGIC, sizeof(MAGIC));
+  write_value<uint32_t>(file_->out, VERSION);
+  write_value<uint32_t>(file_->out, names.size());
+  for (auto & name : names) {
+    write_value<uint32_t>(file_->out, name.size());
+    file_->out.write(name.data(), name.size());
+  }
+}
+
+void
+TimeSeriesWriter::append(const unsigned replicate,
+			 const unsigned long iteration,
+			 const std::vector<real> &values)
+{
+  std::lock_guard<std::mutex> lock(file_->mutex);
+  if (values.size() != file_->values.size())
+    throw SimulationException("Time series row has the wrong number of "
+			      "values.");
+  file_->replicates.push_back(replicate);
+  file_->iterations.push_back(iteration);
+  for (size_t i = 0; i < values.size(); ++i)
+    file_->values[i].push_back(values[i]);
+  if (file_->replicates.size() >= file_->block_rows) {
+    file_->write_block();
+    if (file_->out.fail())
+      throw SimulationException("Error writing time series.");
+  }
+}
+
+std::function<void(const Simulation *)>
+TimeSeriesWriter::report(const std::vector<Metric> &metrics) const
+{
+  TimeSeriesWriter writer(*this);
+  return [writer, metrics](const Simulation *s) mutable {
+    std::vector<real> values;
+    values.reserve(metrics.size());
+    for (auto & metric : metrics)
+      values.push_back(metric(s));
+    writer.append(s->replicate(), s->completed_iterations(), values);
+  };
+}
+
+void
+TimeSeriesWriter::flush()
+{
+  std::lock_guard<std::mutex> lock(file_->mutex);
+  file_->write_block();
+  file_->out.flush();
+  if (file_->out.fail())
+    throw SimulationException("Error writing time series.");
+}
+
+bool
+TimeSeriesWriter::read(const char *filename,
+		       std::function<void(unsigned,
+					  unsigned long,
+					  const std::vector<real> &)> row,
+		       std::vector<std::string> *names)
+{
+  std::ifstream in(filename, std::ios::binary);
+  char magic[sizeof(MAGIC)];
+  uint32_t version, num_metrics;
+
+  if (in.fail()) {
+    std::stringstream ss;
+    ss << "Can't open time series " << filename;
+    throw SimulationException(ss.str().c_str());
+  }
+  in.read(magic, sizeof(magic));
+  in.read(reinterpret_cast<char *>(&version), sizeof(version));
+  in.read(reinterpret_cast<char *>(&num_metrics), sizeof(num_metrics));
+  if (in.fail() || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+    throw SimulationException("Not a time series.");
+  if (version != VERSION)
+    throw SimulationException("Unsupported time series version.");
+  if (names)
+    names->clear();
+  for (uint32_t i = 0; i < num_metrics; ++i) {
+    uint32_t length;
+    in.read(reinterpret_cast<char *>(&length), sizeof(length));
+    std::string name(length, '\0');
+    in.read(&name[0], length);
+    if (in.fail())
+      throw SimulationException("Truncated time series header.");
+    if (names)
+      names->push_back(name);
+  }
+
+  uint32_t num_rows;
+  std::vector<uint32_t> replicates;
+  std::vector<uint64_t> iterations;
+  std::vector< std::vector<double> > columns(num_metrics);
+  std::vector<real> values(num_metrics);
+  while (in.read(reinterpret_cast<char *>(&num_rows), sizeof(num_rows))) {
+    bool ok = read_column(in, replicates, num_rows) &&
+      read_column(in, iterations, num_rows);
+    for (auto & column : columns)
+      ok = ok && read_column(in, column, num_rows);
+    // The last block of a file cut short is dropped
+    if (ok == false)
+      return false;
+    for (uint32_t r = 0; r < num_rows; ++r) {
+      for (uint32_t m = 0; m < num_metrics; ++m)
+	values[m] = columns[m][r];
+      row(replicates[r], iterations[r], values);
+    }
+  }
+  // Nothing but the start of a block's row count may follow the last one
+  return in.gcount() == 0;
+}
@@ -0,0 +1,77 @@
+#ifndef SIM_TIME_SERIES_H
+#define SIM_TIME_SERIES_H
+
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "common.hh"
+
+namespace sim {
+
+  // A report sink that appends rows of metrics, keyed by replicate and
+  // iteration, to a columnar binary file. Rows are buffered and written a
+  // block at a time, each block column by column. The file starts with the
+  // header
+  //   "SIMSERS" '\0', uint32 version, uint32 number of metrics,
+  //   for each metric uint32 length of its name and the name,
+  // followed by blocks of
+  //   uint32 number of rows n, uint32 replicate[n], uint64 iteration[n],
+  //   double value[n] for each metric,
+  // in the byte order of the machine that wrote it. Only whole blocks are
+  // written, so a file cut short holds every block before the last flush.
+  // Copies of a writer share the same file and buffer, under a lock, so
+  // the replicates of montecarlo_parallel can append to the same one. The
+  // last block is written by flush(), which callers must call once the
+  // simulations are done: the last copy's destructor writes it too, but
+  // cannot report a failed write.
+  class TimeSeriesWriter {
+  public:
+    typedef std::function<real(const Simulation *)> Metric;
+  private:
+    struct File {
+      std::mutex mutex;
+      std::ofstream out;
+      size_t block_rows;
+      std::vector<uint32_t> replicates;
+      std::vector<uint64_t> iterations;
+      std::vector< std::vector<double> > values;
+      void write_block();
+      ~File();
+    };
+    std::shared_ptr<File> file_;
+  public:
+    static const uint32_t VERSION = 1;
+    TimeSeriesWriter(const char *filename,
+		     const std::vector<std::string> &names,
+		     const size_t block_rows = 4096);
+    // Appends a row with a value per metric.
+    void append(const unsigned replicate, const unsigned long iteration,
+		const std::vector<real> &values);
+    // A report, for set_reports, that appends a row of the values of
+    // metrics, in the order of the names, keyed by the simulation's
+    // replicate and completed_iterations(): 0 before the simulation and k
+    // after the k-th iteration. The report after the simulation repeats
+    // the last interim row's key, so register it with after set only when
+    // interim reports are off.
+    std::function<void(const Simulation *)>
+    report(const std::vector<Metric> &metrics) const;
+    // Writes the rows buffered as a block and throws if the file could
+    // not be written.
+    void flush();
+    // Calls row for every row of a file, in the order written. A file cut
+    // short is read up to its last whole block, and read then returns
+    // false; it returns true if the file ends after a whole block.
+    static bool read(const char *filename,
+		     std::function<void(unsigned replicate,
+					unsigned long iteration,
+					const std::vector<real> &values)> row,
+		     std::vector<std::string> *names = nullptr);
+  };
+}
+
+#endif
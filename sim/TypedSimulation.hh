@@ -0,0 +1,338 @@
+#ifndef SIM_TYPED_SIMULATION_H
+#define SIM_TYPED_SIMULATION_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <iostream>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "common.hh"
+
+namespace sim {
+
+  // A state of a typed schema, with the type and number of its elements.
+  // A model declares each of its agent states as a struct derived from
+  // TypedState, e.g.
+  //   struct Dob : TypedState<double> {
+  //     static const char *name() { return "dob"; }
+  //   };
+  // A state with one element is stored as a T, one with N as std::array.
+  // A bool state is stored as uint8_t, so that its column is a plain array
+  // of bytes rather than a std::vector<bool> of bits: get() then returns a
+  // real reference and threads may write neighbouring agents. The name is
+  // the state's heading in write_agents_csv().
+  template <typename T, size_t N = 1>
+  struct TypedState {
+    typedef typename std::conditional<std::is_same<T, bool>::value,
+				      uint8_t, T>::type element_type;
+    static const size_t arity = N;
+    typedef typename std::conditional<N == 1, element_type,
+				      std::array<element_type, N> >::type
+    value_type;
+  };
+
+  namespace typed {
+    // Writes a value so that one byte states read as numbers.
+    template <typename T>
+    void write_value(std::ostream &out, const T &value, const char)
+    {
+      out << +value;
+    }
+    template <typename T, size_t N>
+    void write_value(std::ostream &out, const std::array<T, N> &values,
+		     const char delim)
+    {
+      for (size_t i = 0; i < N; ++i)
+	out << (i ? std::string(1, delim) : "") << +values[i];
+    }
+
+    // The position of State in States, a compile time constant.
+    template <typename State, typename... States>
+    struct IndexOf;
+    template <typename State, typename... States>
+    struct IndexOf<State, State, States...> :
+      std::integral_constant<size_t, 0> {};
+    template <typename State, typename Other, typename... States>
+    struct IndexOf<State, Other, States...> :
+      std::integral_constant<size_t, 1 + IndexOf<State, States...>::value>
+    {};
+    template <typename State>
+    struct IndexOf<State> {
+      static_assert(sizeof(State) == 0, "State is not in the schema.");
+    };
+
+    // Operations on every column of a tuple of columns, unrolled at
+    // compile time.
+    template <size_t I, size_t N>
+    struct Columns {
+      template <typename Tuple>
+      static void append(Tuple &columns)
+      {
+	std::get<I>(columns).emplace_back();
+	Columns<I + 1, N>::append(columns);
+      }
+      template <typename Tuple>
+      static void reserve(Tuple &columns, const size_t capacity)
+      {
+	std::get<I>(columns).reserve(capacity);
+	Columns<I + 1, N>::reserve(columns, capacity);
+      }
+      template <typename Tuple>
+      static void write(std::ostream &out, const Tuple &columns,
+			const size_t slot, const char delim)
+      {
+	out << delim;
+	write_value(out, std::get<I>(columns)[slot], delim);
+	Columns<I + 1, N>::write(out, columns, slot, delim);
+      }
+    };
+    template <size_t N>
+    struct Columns<N, N> {
+      template <typename Tuple>
+      static void append(Tuple &) {}
+      template <typename Tuple>
+      static void reserve(Tuple &, const size_t) {}
+      template <typename Tuple>
+      static void write(std::ostream &, const Tuple &, const size_t,
+			const char) {}
+    };
+  }
+
+  // A simulation whose agent states are fixed at compile time. Each state
+  // is a column of its own element type, and agent.get<State>() is an
+  // index into that column, so there is no lookup by name or number while
+  // the simulation runs. Globals is any struct the model uses for its
+  // global states and parameters; it is public as globals.
+  //
+  // Agents live in slots that are never reused. Killing an agent is
+  // deferred as in Simulation: its remaining events in the iteration are
+  // skipped and it is moved to the dead agents after the global events and
+  // after the agent events. Random numbers come from sim::rng.
+  template <typename Globals, typename... States>
+  class TypedSimulation {
+  public:
+    template <typename State>
+    using Column = std::vector<typename State::value_type>;
+
+    // A handle on an agent: the simulation and the agent's slot.
+    class AgentRef {
+    private:
+      TypedSimulation *simulation_;
+      size_t slot_;
+    public:
+      AgentRef(TypedSimulation *simulation, const size_t slot) :
+	simulation_(simulation), slot_(slot) {}
+      inline size_t slot() const { return slot_; }
+      inline unsigned long id() const { return simulation_->ids_[slot_]; }
+      template <typename State>
+      inline typename Column<State>::reference get() const
+      {
+	return simulation_->template column<State>()[slot_];
+      }
+    };
+
+    typedef std::function<void(TypedSimulation &)> GlobalEvent;
+    typedef std::function<void(TypedSimulation &, AgentRef)> AgentEvent;
+    typedef std::function<void(TypedSimulation &, AgentRef)> AgentInit;
+    typedef std::function<void(const TypedSimulation &)> Report;
+    struct ReportParms {
+      Report report;
+      unsigned frequency;
+      bool before;
+      bool after;
+    };
+
+  private:
+    std::tuple< Column<States>... > columns_;
+    std::vector<unsigned long> ids_;
+    std::vector<char> killed_;
+    std::vector<size_t> agents_;
+    std::vector<size_t> dead_agents_;
+    size_t num_killed_ = 0;
+    unsigned long iteration_ = 0;
+    std::vector<AgentInit> initializers_;
+    std::vector<GlobalEvent> global_events_;
+    std::vector<AgentEvent> events_;
+    std::vector<ReportParms> reports_;
+
+    // Moves the killed agents to the dead agents, keeping the order of the
+    // others.
+    void remove_killed_agents()
+    {
+      if (num_killed_ == 0)
+	return;
+      auto alive = std::stable_partition(agents_.begin(), agents_.end(),
+					 [this](const size_t slot) {
+					   return killed_[slot] == 0;
+					 });
+      dead_agents_.insert(dead_agents_.end(), alive, agents_.end());
+      agents_.erase(alive, agents_.end());
+      num_killed_ = 0;
+    }
+
+  public:
+    Globals globals;
+
+    static constexpr size_t num_states() { return sizeof...(States); }
+    template <typename State>
+    static constexpr size_t state_index()
+    {
+      return typed::IndexOf<State, States...>::value;
+    }
+    // The names of the states, in the order of the schema.
+    static std::vector<std::string> state_names()
+    {
+      return {States::name()...};
+    }
+    template <typename State>
+    inline Column<State>& column()
+    {
+      return std::get<state_index<State>()>(columns_);
+    }
+    template <typename State>
+    inline const Column<State>& column() const
+    {
+      return std::get<state_index<State>()>(columns_);
+    }
+
+    inline AgentRef agent(const size_t slot) { return AgentRef(this, slot); }
+    // The slots of the living agents, in the order they are visited.
+    inline const std::vector<size_t>& agents() const { return agents_; }
+    inline const std::vector<size_t>& dead_agents() const
+    {
+      return dead_agents_;
+    }
+    inline unsigned long iteration() const { return iteration_; }
+
+    AgentRef append_agent()
+    {
+      typed::Columns<0, sizeof...(States)>::append(columns_);
+      size_t slot = ids_.size();
+      ids_.push_back(slot);
+      killed_.push_back(0);
+      agents_.push_back(slot);
+      return AgentRef(this, slot);
+    }
+    void set_number_agents(const size_t num_agents)
+    {
+      size_t capacity = ids_.size() + num_agents;
+      typed::Columns<0, sizeof...(States)>::reserve(columns_, capacity);
+      ids_.reserve(capacity);
+      killed_.reserve(capacity);
+      agents_.reserve(agents_.size() + num_agents);
+      for (size_t i = 0; i < num_agents; ++i)
+	append_agent();
+    }
+    inline void kill_agent(const AgentRef agent)
+    {
+      if (killed_[agent.slot()] == 0) {
+	killed_[agent.slot()] = 1;
+	++num_killed_;
+      }
+    }
+    inline bool is_killed(const AgentRef agent) const
+    {
+      return killed_[agent.slot()];
+    }
+
+    // The probability of an event that has probability prob in
+    // prob_time_period happening in time_period.
+    static real prob_event(const real prob, const real prob_time_period,
+			   const real time_period)
+    {
+      return 1 - std::pow(1 - prob, time_period / prob_time_period);
+    }
+    inline bool is_event(const real probability) const
+    {
+      return uniform_real(rng) < probability;
+    }
+
+    void set_agent_initializers(std::initializer_list<AgentInit> inits)
+    {
+      initializers_ = inits;
+    }
+    void set_global_events(std::initializer_list<GlobalEvent> events)
+    {
+      global_events_ = events;
+    }
+    void set_events(std::initializer_list<AgentEvent> events)
+    {
+      events_ = events;
+    }
+    void set_reports(std::initializer_list<ReportParms> reports)
+    {
+      reports_ = reports;
+    }
+
+    // Starts the simulation over from iteration 0, like
+    // Simulation::initialize_states().
+    void initialize_states()
+    {
+      iteration_ = 0;
+      for (auto & init : initializers_)
+	for (auto & slot : agents_)
+	  init(*this, AgentRef(this, slot));
+    }
+
+    // Writes the living agents as CSV, headed by "id" and the name of each
+    // state, repeated for each of its elements.
+    void write_agents_csv(std::ostream &out, const char delim = ',') const
+    {
+      const size_t arities[] = {States::arity...};
+      std::vector<std::string> names = state_names();
+      out << "id";
+      for (size_t i = 0; i < names.size(); ++i)
+	for (size_t e = 0; e < arities[i]; ++e)
+	  out << delim << names[i];
+      out << std::endl;
+      for (auto & slot : agents_) {
+	out << ids_[slot];
+	typed::Columns<0, sizeof...(States)>::write(out, columns_, slot,
+						    delim);
+	out << std::endl;
+      }
+    }
+
+    void simulate(const unsigned num_steps, const bool interim_reports)
+    {
+      initialize_states();
+      for (auto & report : reports_)
+	if (report.before)
+	  report.report(*this);
+      for (; iteration_ < num_steps; ++iteration_) {
+	for (auto & event : global_events_)
+	  event(*this);
+	remove_killed_agents();
+	std::shuffle(agents_.begin(), agents_.end(), rng);
+	// Agents appended by events are not visited in this iteration.
+	size_t num_agents = agents_.size();
+	for (size_t i = 0; i < num_agents; ++i) {
+	  AgentRef agent(this, agents_[i]);
+	  for (auto & event : events_) {
+	    if (killed_[agent.slot()])
+	      break;
+	    event(*this, agent);
+	  }
+	}
+	remove_killed_agents();
+	if (interim_reports)
+	  for (auto & report : reports_)
+	    if (report.frequency && (iteration_ + 1) % report.frequency == 0)
+	      report.report(*this);
+      }
+      for (auto & report : reports_)
+	if (report.after)
+	  report.report(*this);
+    }
+  };
+}
+
+#endif
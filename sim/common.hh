@@ -1,13 +1,19 @@
 #ifndef SIM_COMMON_H
 #define SIM_COMMON_H
 
+#include <cassert>
 #include <functional>
 #include <list>
+#include <memory>
 #include <random>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <vector>
 #include <tuple>
+#include <type_traits>
+
+#include "CounterRng.hh"
 
 namespace sim {
 
@@ -48,6 +54,15 @@ namespace sim {
     DEAD = 0,
     ALIVE = 1
   };
+  // How the agents are ordered before the agent events of every
+  // iteration. See Simulation::set_agent_order.
+  enum AgentOrder {
+    FULL_SHUFFLE = 0,
+    BLOCK_SHUFFLE,
+    ROTATE_SHUFFLE,
+    NO_SHUFFLE,
+    PARALLEL_SHUFFLE
+  };
   class Agent;
   class Simulation;
 
@@ -76,8 +91,12 @@ namespace sim {
   typedef std::list< GlobalEvent > GlobalEvents;
   typedef std::function < void(Simulation *) > GlobalStateInit;
   typedef std::function < void(Simulation *, Agent *) >  AgentEvent;
+  // Probability per unit of time of an event for an agent.
+  typedef std::function < real(const Simulation *, const Agent *) > Hazard;
   typedef std::function < void(Agent *, Simulation *) > AgentInit;
   typedef std::list< AgentEvent > AgentEvents;
+  typedef std::function < void(const Simulation *, const Agent *) >
+  DeadAgentSink;
   typedef std::list< Report > Reports;
 
   class SimulationException : public std::exception {
@@ -108,16 +127,169 @@ namespace sim {
     bool after() const { return after_; }
   };
 
+  // Columnar storage for the states of all the agents in a simulation.
+  // Each state has one contiguous column per element (so a state with two
+  // values, like a position, has two columns), and every column is indexed
+  // by agent slot. The per-step agent loop therefore reads states without
+  // hashing, and a population needs a handful of large allocations instead
+  // of several small ones per agent.
+  class AgentStore {
+  private:
+    std::vector< std::vector< std::vector<real> > > columns_;
+    size_t size_ = 0;
+  public:
+    inline size_t size() const { return size_; }
+    inline size_t num_states() const { return columns_.size(); }
+    inline bool has_state(const unsigned state) const
+    {
+      return state < columns_.size() && columns_[state].size();
+    }
+    inline size_t arity(const unsigned state) const
+    {
+      return state < columns_.size() ? columns_[state].size() : 0;
+    }
+    // The state's column of element. Asserts, unless NDEBUG is defined,
+    // that the state has been given that many elements.
+    inline std::vector<real>& column(const unsigned state,
+				     const size_t element = 0)
+    {
+      assert(element < arity(state));
+      return columns_[state][element];
+    }
+    inline const std::vector<real>& column(const unsigned state,
+					   const size_t element = 0) const
+    {
+      assert(element < arity(state));
+      return columns_[state][element];
+    }
+    // Makes sure a state has at least arity columns. New columns are zeroed.
+    void set_arity(const unsigned state, const size_t arity)
+    {
+      if (state >= columns_.size())
+	columns_.resize(state + 1);
+      while (columns_[state].size() < arity)
+	columns_[state].push_back(std::vector<real>(size_, 0.0));
+    }
+    void reserve(const size_t capacity)
+    {
+      for (auto & state : columns_)
+	for (auto & column : state)
+	  column.reserve(capacity);
+    }
+    // Gives every column size slots. New slots are zeroed.
+    void resize(const size_t size)
+    {
+      for (auto & state : columns_)
+	for (auto & column : state)
+	  column.resize(size, 0.0);
+      size_ = size;
+    }
+    // Adds a zeroed slot to every column and returns its index.
+    size_t append_slot()
+    {
+      for (auto & state : columns_)
+	for (auto & column : state)
+	  column.push_back(0.0);
+      return size_++;
+    }
+    void zero_slot(const size_t slot)
+    {
+      for (auto & state : columns_)
+	for (auto & column : state)
+	  column[slot] = 0.0;
+    }
+    void copy_slot(const size_t from, const size_t to)
+    {
+      for (auto & state : columns_)
+	for (auto & column : state)
+	  column[to] = column[from];
+    }
+    void clear()
+    {
+      columns_.clear();
+      size_ = 0;
+    }
+  };
+
+  // A reference to one state of one agent. It behaves like the vector the
+  // state used to be stored in: elements are read and written with [] and
+  // the whole state can be assigned from an initializer list. Unlike that
+  // vector, its size is the arity of the state, which all agents share: it
+  // grows to the longest list assigned to the state by any agent and never
+  // shrinks. Assigning a shorter list zeroes this agent's elements past its
+  // end. Use at() to check elements against the arity; [] only asserts.
+  class StateRef {
+  private:
+    AgentStore *store_;
+    unsigned state_;
+    size_t slot_;
+  public:
+    StateRef(AgentStore *store, const unsigned state, const size_t slot) :
+      store_(store), state_(state), slot_(slot) {}
+    inline real& operator[](const size_t element) const
+    {
+      return store_->column(state_, element)[slot_];
+    }
+    real& at(const size_t element) const
+    {
+      if (element >= size())
+	throw std::out_of_range("StateRef::at");
+      return (*this)[element];
+    }
+    inline size_t size() const { return store_->arity(state_); }
+    const StateRef& operator=(const std::initializer_list<real> values) const
+    {
+      store_->set_arity(state_, values.size());
+      size_t i = 0;
+      for (auto & v : values)
+	(*this)[i++] = v;
+      for (; i < size(); ++i)
+	(*this)[i] = 0.0;
+      return *this;
+    }
+    operator std::vector<real>() const
+    {
+      std::vector<real> values(size());
+      for (size_t i = 0; i < values.size(); ++i)
+	values[i] = (*this)[i];
+      return values;
+    }
+  };
+
+  // The states of a single agent: a view onto its slot in an AgentStore.
+  class AgentStates {
+  private:
+    AgentStore *store_;
+    size_t slot_;
+  public:
+    AgentStates(AgentStore *store, const size_t slot) :
+      store_(store), slot_(slot) {}
+    inline StateRef operator[](const unsigned state) const
+    {
+      return StateRef(store_, state, slot_);
+    }
+    StateRef at(const unsigned state) const
+    {
+      if (store_->has_state(state) == false)
+	throw std::out_of_range("AgentStates::at");
+      return StateRef(store_, state, slot_);
+    }
+    inline size_t slot() const { return slot_; }
+  };
+
   class Agent {
   private:
     unsigned long id_;
   public:
-    Agent(unsigned long id) : id_(id) {}
+    Agent(unsigned long id, AgentStore *store, size_t slot) :
+      id_(id), states(store, slot) {}
     inline unsigned id() const { return id_; }
-    StateMap states;
+    inline size_t slot() const { return states.slot(); }
+    AgentStates states;
   };
-  extern unsigned thread_num;
+  extern thread_local unsigned thread_num;
   extern thread_local std::mt19937_64 rng;
+  extern thread_local CounterRng agent_rng;
 }
 
 #endif // SIM_COMMON_H
@@ -1,6 +1,7 @@
 #include <cerrno>
 #include <climits>
 #include <cfloat>
+#include <cstdint>
 #include <cstring>
 #include <sstream>
 
@@ -13,7 +14,6 @@ sim::strtou(const char *str)
 {
   char *endptr;
   long val;
-  std::stringstream msg;
 
   errno = 0;    /* To distinguish success/failure after call */
   val = strtol(str, &endptr, 10);
@@ -26,22 +26,26 @@ sim::strtou(const char *str)
   }
 
   if (strcmp(endptr, "") != 0) {
+    std::stringstream msg;
     msg << "Number " << str << " is not valid. " << std::endl;
     throw ArgException(msg.str().c_str());
   }
 
   if (endptr == str) {
+    std::stringstream msg;
     msg << "No digits were found in number" << std::endl;
     throw ArgException(msg.str().c_str());
   }
 
   if (val < 0) {
+    std::stringstream msg;
     msg << "Number " << str << " smaller than 0. "
 	<< "Must be unsigned integer." << std::endl;
     throw ArgException(msg.str().c_str());
   }
 
   if (val > UINT_MAX) {
+    std::stringstream msg;
     msg << "Number " << str << " too large. "
 	<< "Must be unsigned integer <= " << UINT_MAX << std::endl;
     throw ArgException(msg.str().c_str());
@@ -56,7 +60,6 @@ sim::strtor(const char *str)
 {
   char *endptr;
   double val;
-  std::stringstream msg;
 
   errno = 0;    /* To distinguish success/failure after call */
   val = strtod(str, &endptr);
@@ -68,11 +71,13 @@ sim::strtor(const char *str)
   }
 
   if (strcmp(endptr, "") != 0) {
+    std::stringstream msg;
     msg << "Number " << str << " is not valid. " << std::endl;
     throw ArgException(msg.str().c_str());
   }
 
   if (endptr == str) {
+    std::stringstream msg;
     msg << "No digits were found in number" << std::endl;
     throw ArgException(msg.str().c_str());
   }
@@ -80,6 +85,45 @@ sim::strtor(const char *str)
   return val;
 }
 
+/* Convert the characters in [begin, end) to double.
+   Decimals with at most 15 significant digits and no exponent are
+   converted exactly as an integer divided by a power of ten, both of which
+   are exact doubles (Clinger's fast path). Everything else, including
+   every invalid number, is copied to a buffer and handed to strtor. */
+double
+sim::strtor(const char *begin, const char *end)
+{
+  static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  const char *p = begin;
+  bool negative = false;
+  uint64_t mantissa = 0;
+  unsigned digits = 0, decimals = 0;
+
+  if (p < end && (*p == '-' || *p == '+'))
+    negative = *p++ == '-';
+  for (; p < end && *p >= '0' && *p <= '9'; ++p, ++digits)
+    mantissa = mantissa * 10 + (*p - '0');
+  if (p < end && *p == '.')
+    for (++p; p < end && *p >= '0' && *p <= '9'; ++p, ++digits, ++decimals)
+      mantissa = mantissa * 10 + (*p - '0');
+  if (p == end && digits > 0 && digits <= 15) {
+    double val = (double) mantissa / powers_of_ten[decimals];
+    return negative ? -val : val;
+  }
+
+  char buffer[64];
+  size_t length = end - begin;
+  if (length < sizeof(buffer)) {
+    memcpy(buffer, begin, length);
+    buffer[length] = '\0';
+    return strtor(buffer);
+  }
+  return strtor(std::string(begin, end).c_str());
+}
+
 std::vector< std::vector <sim::real> >
 sim::convert_csv_strings_to_reals(std::vector< std::vector
 				  <std::string> >& matrix_strings,
@@ -96,60 +140,117 @@ sim::convert_csv_strings_to_reals(std::vector< std::vector
       if (s == "")
 	row.push_back(0.0);
       else
-	row.push_back(strtor(s.c_str()));
+	row.push_back(strtor(s.data(), s.data() + s.size()));
     }
     matrix_real.push_back(row);
   }
   return matrix_real;
 }
 
-static std::vector< std::vector <std::string> >
-process_csv_lines(const std::vector<std::string> & lines,
-		       const char delim)
+sim::CsvFile::CsvFile(const char *filename) :
+  file_(filename, "CSV file"), data_(file_.data()), size_(file_.size())
 {
-  std::vector< std::vector <std::string> >  csv_matrix;
-  for (auto & line : lines) {
-    bool inquote = false;
-    std::vector <std::string> csv_line;
-    std::string csv_entry = "";
-    for (auto & c : line) {
-      if (c == delim && inquote == false) {
-	csv_line.push_back(csv_entry);
-	csv_entry = "";
-      } else {
-	if (c == '"')
-	  inquote = !inquote;
-	csv_entry = csv_entry + c;
-      }
-    }
-    if (csv_entry != "") {
-      csv_line.push_back(csv_entry);
+}
+
+/* Split the line starting at line into fields and return the start of the
+   next line. */
+const char *
+sim::CsvFile::split_line(const char *line, const char delim,
+			 std::vector<CsvField> &fields) const
+{
+  const char *end = data_ + size_;
+  const char *line_end = (const char *) memchr(line, '\n', end - line);
+  if (line_end == nullptr)
+    line_end = end;
+  bool inquote = false;
+  const char *field = line;
+  fields.clear();
+  for (const char *c = line; c < line_end; ++c) {
+    if (*c == delim && inquote == false) {
+      fields.push_back({field, c});
+      field = c + 1;
+    } else if (*c == '"') {
+      inquote = !inquote;
     }
-    csv_matrix.push_back(csv_line);
   }
-  return csv_matrix;
+  if (field != line_end)
+    fields.push_back({field, line_end});
+  return line_end + 1;
 }
 
-std::vector< std::vector <std::string> >
-sim::process_csv_file(const char *filename, const char delimiter)
+void
+sim::CsvFile::for_each_row(const char delim,
+			   const std::function<void(size_t,
+						    const std::vector<CsvField>
+						    &)> &row) const
 {
-  std::ifstream csv_in(filename);
-  std::string s;
-  std::vector<std::string> lines;
-  std::vector< std::vector <std::string> >  csv_matrix;
+  std::vector<CsvField> fields;
+  const char *end = data_ + size_;
+  const char *line = data_;
+  size_t row_num = 0;
 
-  if (csv_in.fail()) {
-    std::stringstream ss;
-    ss << "Can't open CSV file " << filename;
-    throw SimulationException(ss.str().c_str());
+  while (line < end) {
+    line = split_line(line, delim, fields);
+    row(row_num++, fields);
   }
+}
 
-  while (std::getline(csv_in, s)) {
-    lines.push_back(s);
-  }
-  if (csv_in.eof() == false && csv_in.fail() == true)
-    throw SimulationException("Error reading csv file.");
+std::vector<std::string>
+sim::CsvFile::headings(const char delim) const
+{
+  std::vector<CsvField> fields;
+  std::vector<std::string> result;
+
+  if (size_ == 0)
+    throw SimulationException("No headings in CSV file.");
+  split_line(data_, delim, fields);
+  for (auto & field : fields)
+    result.push_back(field.str());
+  return result;
+}
+
+/* Stream a CSV file with a header line, converting each row to reals in a
+   single reused vector. */
+void
+sim::read_csv_rows(const char *filename, const char delim,
+		   const std::function<void(const std::vector<std::string> &)>
+		   &header,
+		   const std::function<void(const std::vector<real> &)> &row)
+{
+  CsvFile csv(filename);
+  std::vector<std::string> headings = csv.headings(delim);
+  std::vector<real> values;
+
+  header(headings);
+  csv.for_each_row(delim, [&](size_t row_num,
+			      const std::vector<CsvField> &fields) {
+		     if (row_num == 0)
+		       return;
+		     if (fields.size() != headings.size())
+		       throw SimulationException("CSV rows must have same "
+						 "number entries.");
+		     values.clear();
+		     for (auto & field : fields)
+		       values.push_back(field.empty() ? 0.0 :
+					strtor(field.begin, field.end));
+		     row(values);
+		   });
+}
+
+std::vector< std::vector <std::string> >
+sim::process_csv_file(const char *filename, const char delimiter)
+{
+  CsvFile csv(filename);
+  std::vector< std::vector <std::string> >  csv_matrix;
 
-  csv_matrix = process_csv_lines(lines, delimiter);
+  csv.for_each_row(delimiter, [&csv_matrix](size_t,
+					    const std::vector<CsvField>
+					    &fields) {
+		     std::vector<std::string> csv_line;
+		     csv_line.reserve(fields.size());
+		     for (auto & field : fields)
+		       csv_line.push_back(field.str());
+		     csv_matrix.push_back(std::move(csv_line));
+		   });
   return csv_matrix;
 }
@@ -4,15 +4,64 @@
 
 #include <exception>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <string>
 #include <vector>
 
 #include "sim/common.hh"
+#include "sim/MappedFile.hh"
 
 namespace sim {
   unsigned strtou(const char *str);
   double strtor(const char *str);
+  // Converts the characters in [begin, end) to a double without allocating.
+  // Plain decimals are converted exactly in place; anything else falls back
+  // to strtor, so errors have the same messages.
+  double strtor(const char *begin, const char *end);
+
+  // A field of a CSV file: a view of its characters in the mapped file.
+  struct CsvField {
+    const char *begin;
+    const char *end;
+    inline bool empty() const { return begin == end; }
+    inline std::string str() const { return std::string(begin, end); }
+  };
+
+  // A CSV file mapped into memory and split into fields in place. Lines and
+  // fields follow the same rules as process_csv_file: fields are split on
+  // the delimiter outside double quotes, quotes are kept and an empty last
+  // field is dropped.
+  class CsvFile {
+  private:
+    MappedFile file_;
+    const char *data_;
+    size_t size_;
+    const char *split_line(const char *line, const char delimiter,
+			   std::vector<CsvField> &fields) const;
+  public:
+    CsvFile(const char *filename);
+    inline size_t size() const { return size_; }
+    // Calls row with the number and fields of every line in turn. The
+    // fields are only valid during the call.
+    void for_each_row(const char delimiter,
+		      const std::function<void(size_t,
+					       const std::vector<CsvField> &)>
+		      &row) const;
+    // The fields of the first line.
+    std::vector<std::string> headings(const char delimiter) const;
+  };
+
+  // Streams a CSV file with a header line. header is called with the
+  // headings, then row with the values of every following line in turn,
+  // empty fields being 0. Every line must have as many entries as the
+  // header. Only one row is held in memory at a time.
+  void read_csv_rows(const char *filename, const char delimiter,
+		     const std::function<void(const std::vector<std::string> &)>
+		     &header,
+		     const std::function<void(const std::vector<real> &)>
+		     &row);
+
   std::vector< std::vector <std::string> >
   process_csv_file(const char *filename, const char delimiter=',');
   std::vector< std::vector <real> >
@@ -2,8 +2,19 @@
 #define SIM_H
 
 #include "common.hh"
+#include "MappedFile.hh"
 #include "process_csv.hh"
+#include "ThreadPool.hh"
+#include "AgentPool.hh"
+#include "DeadAgentArchive.hh"
+#include "TimeSeries.hh"
+#include "EventScheduler.hh"
+#include "PopulationSnapshot.hh"
+#include "Profiler.hh"
+#include "AsyncReporter.hh"
 #include "Simulation.hh"
+#include "TypedSimulation.hh"
+#include "EventPipeline.hh"
 
 
 #endif // SIM_H
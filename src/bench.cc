@@ -0,0 +1,313 @@
+/*
+  Benchmarks of the engine: the Granich et al. HIV model of simplesim and
+  the position model of testsim, run over sweeps of the number of agents,
+  time steps, agent events and agent threads. Each run is a child process,
+  so that its peak resident set size is its own, and prints one line of
+  CSV, or of JSON with -j, with its wall time, agent-steps per second and
+  peak RSS. setup_s is the time to create the agents, and run_s that of
+  simulate(), which initializes their states; agent_steps counts the agents
+  alive at the start of each iteration.
+ */
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "sim/sim.hh"
+#include "granich.hh"
+
+using namespace sim;
+
+// The position model's parameters and state follow the Granich model's.
+enum PositionParameters {
+  POSITION_INIT_PARM = LAST_GRANICH_PARM + 1,
+  POSITION_UPDATE_PARM
+};
+
+enum PositionStates {
+  POSITION_STATE = LAST_GRANICH_STATE + 1
+};
+
+struct BenchConfig {
+  std::string model;
+  unsigned num_agents;
+  unsigned num_steps;
+  unsigned num_events;
+  unsigned num_threads;
+  unsigned repeat;
+};
+
+struct BenchResult {
+  double setup_seconds = 0.0;
+  double run_seconds = 0.0;
+  unsigned long agent_steps = 0;
+};
+
+/* GRANICH MODEL */
+
+/* The model of simplesim, from granich.cc, with its three agent events
+   whatever num_events is. */
+void granich_model(Simulation &s, const BenchConfig &config)
+{
+  granich_model(s);
+  s.set_events({hiv_infection_event, hiv_transition_event, death_event});
+}
+
+/* POSITION MODEL */
+
+void position_state_init(Agent* a, Simulation* s)
+{
+  double x = s->parameters[POSITION_INIT_PARM][0];
+  double y = s->parameters[POSITION_INIT_PARM][1];
+  x += s->parameters[POSITION_UPDATE_PARM][0] * a->id();
+  y += s->parameters[POSITION_UPDATE_PARM][1] * a->id();
+  a->states[POSITION_STATE] = {x, y};
+}
+
+void update_position_event(Simulation *s, Agent *a)
+{
+  a->states[POSITION_STATE][0] += s->parameters[POSITION_UPDATE_PARM][0];
+  a->states[POSITION_STATE][1] += s->parameters[POSITION_UPDATE_PARM][1];
+}
+
+/* The position model runs num_events copies of its update event. */
+void position_model(Simulation &s, const BenchConfig &config)
+{
+  s.set_parameters({
+      {START_DATE_PARM, {1980.0}},
+      {TIME_STEP_SIZE_PARM, {1.0 / 365}},
+      {POSITION_INIT_PARM, {0.0, 0.0}},
+      {POSITION_UPDATE_PARM, {1.0, 2.0}}});
+  s.set_global_states({
+      [](Simulation *s) {
+	s->states[CURRENT_DATE_STATE] = {s->parameters[START_DATE_PARM][0]};
+      }});
+  s.set_agent_initializers({position_state_init});
+  for (unsigned i = 0; i < config.num_events; ++i)
+    s.agent_events.push_back(update_position_event);
+}
+
+/* BENCHMARK */
+
+BenchResult run_benchmark(const BenchConfig &config)
+{
+  typedef std::chrono::steady_clock Clock;
+  BenchResult result;
+  Simulation s;
+  auto start = Clock::now();
+
+  if (config.model == "granich")
+    granich_model(s, config);
+  else if (config.model == "position")
+    position_model(s, config);
+  else
+    throw ArgException(("Unknown model: " + config.model).c_str());
+  real time_step = s.parameters[TIME_STEP_SIZE_PARM][0];
+  s.set_global_events({
+      IncrementTimeEvent(time_step),
+      [&result](Simulation *s) {
+	result.agent_steps += s->agents.size();
+      }});
+  s.set_agent_threads(config.num_threads);
+  s.set_keep_dead_agents(false);
+  s.set_number_agents(config.num_agents);
+  auto setup = Clock::now();
+  s.simulate(config.num_steps, false);
+  auto end = Clock::now();
+  result.setup_seconds = std::chrono::duration<double>(setup - start).count();
+  result.run_seconds = std::chrono::duration<double>(end - setup).count();
+  return result;
+}
+
+const char *CSV_HEADER = "model,agents,steps,events,threads,repeat,"
+  "setup_s,run_s,agent_steps,agent_steps_per_s,peak_rss_kb";
+
+void print_result(const BenchConfig &config, const BenchResult &result,
+		  const long peak_rss_kb, const bool json)
+{
+  double rate = result.run_seconds > 0.0 ?
+    result.agent_steps / result.run_seconds : 0.0;
+  unsigned events = config.model == "granich" ? 3 : config.num_events;
+  std::ostringstream line;
+  line.precision(6);
+  if (json)
+    line << "{\"model\": \"" << config.model << "\", \"agents\": "
+	 << config.num_agents << ", \"steps\": " << config.num_steps
+	 << ", \"events\": " << events << ", \"threads\": "
+	 << config.num_threads << ", \"repeat\": " << config.repeat
+	 << ", \"setup_s\": " << result.setup_seconds
+	 << ", \"run_s\": " << result.run_seconds
+	 << ", \"agent_steps\": " << result.agent_steps
+	 << ", \"agent_steps_per_s\": " << rate
+	 << ", \"peak_rss_kb\": " << peak_rss_kb << "}";
+  else
+    line << config.model << "," << config.num_agents << ","
+	 << config.num_steps << "," << events << "," << config.num_threads
+	 << "," << config.repeat << "," << result.setup_seconds << ","
+	 << result.run_seconds << "," << result.agent_steps << "," << rate
+	 << "," << peak_rss_kb;
+  std::cout << line.str() << std::endl;
+}
+
+/* Runs a benchmark in a child process and prints its result. The child's
+   peak RSS is that of a fresh process, not the largest run so far. */
+bool run_in_child(const BenchConfig &config, const bool json)
+{
+  std::cout.flush();
+  pid_t pid = fork();
+  if (pid < 0)
+    throw SimulationException(strerror(errno));
+  if (pid == 0) {
+    int status = EXIT_SUCCESS;
+    try {
+      BenchResult result = run_benchmark(config);
+      struct rusage usage;
+      getrusage(RUSAGE_SELF, &usage);
+      print_result(config, result, usage.ru_maxrss, json);
+    } catch (std::exception &e) {
+      std::cerr << "Benchmark " << config.model << " with "
+		<< config.num_agents << " agents failed: " << e.what()
+		<< std::endl;
+      status = EXIT_FAILURE;
+    }
+    std::cout.flush();
+    _exit(status);
+  }
+  int status;
+  if (waitpid(pid, &status, 0) < 0)
+    throw SimulationException(strerror(errno));
+  return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+std::vector<std::string> split_list(const char *list)
+{
+  std::vector<std::string> items;
+  std::stringstream ss(list);
+  std::string item;
+  while (std::getline(ss, item, ','))
+    if (item.size())
+      items.push_back(item);
+  if (items.size() == 0)
+    throw ArgException("Empty list");
+  return items;
+}
+
+std::vector<unsigned> split_numbers(const char *list)
+{
+  std::vector<unsigned> numbers;
+  for (auto & item : split_list(list)) {
+    unsigned n = strtou(item.c_str());
+    if (n == 0)
+      throw ArgException("Numbers must be > 0");
+    numbers.push_back(n);
+  }
+  return numbers;
+}
+
+void display_help(const char *prog_name, const char *msg)
+{
+  if (strcmp(msg, "") != 0)
+    std::cerr << msg << std::endl;
+
+  std::cerr << "Microsimulation benchmark program\n\n"
+	    << "Usage: "
+	    << prog_name
+	    << " [-m models] [-a agents] [-t steps] [-e events]"
+	    << " [-p threads] [-r repeats] [-j] [-h]\n\n"
+	    << "Every list is comma separated, and every combination is run.\n"
+	    << "\t-m\tmodels: granich, position (default both)\n"
+	    << "\t-a\tnumbers of agents (default 1000,10000,100000,1000000,"
+	    << "10000000)\n"
+	    << "\t-t\tnumbers of time steps (default 10)\n"
+	    << "\t-e\tnumbers of agent events of the position model "
+	    << "(default 1)\n"
+	    << "\t-p\tnumbers of agent threads (default 1)\n"
+	    << "\t-r\ttimes to run each combination (default 1)\n"
+	    << "\t-j\tprints JSON lines instead of CSV\n"
+	    << "\t-h\tprints out this help text"
+	    << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+  std::vector<std::string> models = {"granich", "position"};
+  std::vector<unsigned> agents = {1000, 10000, 100000, 1000000, 10000000};
+  std::vector<unsigned> steps = {10};
+  std::vector<unsigned> events = {1};
+  std::vector<unsigned> threads = {1};
+  unsigned repeats = 1;
+  bool json = false;
+  int opt;
+
+  try {
+    while ((opt = getopt(argc, argv, "m:a:t:e:p:r:jh")) != -1) {
+      switch (opt) {
+      case 'm':
+	models = split_list(optarg);
+	break;
+      case 'a':
+	agents = split_numbers(optarg);
+	break;
+      case 't':
+	steps = split_numbers(optarg);
+	break;
+      case 'e':
+	events = split_numbers(optarg);
+	break;
+      case 'p':
+	threads = split_numbers(optarg);
+	break;
+      case 'r':
+	repeats = strtou(optarg);
+	if (repeats == 0)
+	  throw ArgException("Repeats must be > 0");
+	break;
+      case 'j':
+	json = true;
+	break;
+      case 'h':
+	display_help(argv[0], "");
+	return EXIT_SUCCESS;
+      default:
+	throw ArgException();
+      }
+    }
+    for (auto & model : models)
+      if (model != "granich" && model != "position")
+	throw ArgException(("Unknown model " + model).c_str());
+  } catch (std::exception &e) {
+    display_help(argv[0], e.what());
+    return EXIT_FAILURE;
+  }
+
+  bool ok = true;
+  try {
+    if (json == false)
+      std::cout << CSV_HEADER << std::endl;
+    for (auto & model : models)
+      for (auto & num_events : events) {
+	// The Granich model's events are fixed, so it runs once per sweep
+	if (model == "granich" && num_events != events[0])
+	  continue;
+	for (auto & num_threads : threads)
+	  for (auto & num_steps : steps)
+	    for (auto & num_agents : agents)
+	      for (unsigned repeat = 0; repeat < repeats; ++repeat)
+		ok = run_in_child({model, num_agents, num_steps, num_events,
+		      num_threads, repeat}, json) && ok;
+      }
+  } catch(std::exception &e) {
+    std::cerr << "An Exception occurred: " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,200 @@
+/*
+  The model of some aspects of Granich et al.
+  DOI:10.1016/S0140-6736(08)61697-9
+ */
+
+#include <algorithm>
+
+#include "granich.hh"
+
+using namespace sim;
+
+/* Initialize states */
+
+/* STATE INITIATION */
+
+void dob_state_init(Agent *a, Simulation *s)
+{
+  std::normal_distribution<double> dis (25.0, 10.0);
+  double r = std::max(dis(rng), 15.0);
+  a->states[DOB_STATE] = {s->parameters[START_DATE_PARM][0] - r};
+}
+
+void alive_state_init(Agent *a, Simulation *s)
+{
+  a->states[ALIVE_STATE] = {1};
+  a->states[DEATH_AGE_STATE] = {0.0};
+}
+
+void sex_state_init(Agent* a, Simulation* s)
+{
+  // This is an improper deterministic implementation, necessary for testing
+  std::uniform_real_distribution<> dis;
+  if (dis(sim::rng) < s->parameters[PROB_MALE_PARM][0])
+    a->states[SEX_STATE] = {MALE};
+  else
+    a->states[SEX_STATE] = {FEMALE};
+}
+
+
+void hiv_state_init(Agent *a, Simulation *s)
+{
+  std::uniform_real_distribution<> dis;
+  if (dis(sim::rng) <
+      s->parameters[INITIAL_HIV_INFECTION_RATE_PARM][0])  {
+    a->states[HIV_STATE] = {1};
+    a->states[HIV_INFECTION_DATE_STATE] =
+      {s->parameters[START_DATE_PARM][0]};
+  } else {
+    a->states[HIV_STATE] = {0};
+    a->states[HIV_INFECTION_DATE_STATE] = {0};
+  }
+}
+
+/* EVENTS */
+
+/* Agent Events */
+
+void hiv_infection_event(Simulation *s, Agent *a)
+{
+  bool infected;
+  if (a->states[HIV_STATE][0] == 0) {
+    infected = s->is_event( (unsigned) HIV_INFECTION_RATE_PARM);
+    if (infected) {
+      // set_state keeps the HIV+ aggregate up to date
+      s->set_state(a, HIV_STATE, 0, 1);
+      a->states[HIV_INFECTION_DATE_STATE][0] =
+	s->states[CURRENT_DATE_STATE][0];
+    }
+  }
+}
+
+void hiv_transition_event(Simulation *s, Agent *a)
+{
+  bool transition;
+  if (a->states[UserStates::HIV_STATE][0] > 0 &&
+      a->states[UserStates::HIV_STATE][0] < 4) {
+    transition = s->is_event( (unsigned) HIV_TRANSITION_PARM);
+    if (transition) {
+      s->set_state(a, HIV_STATE, 0, a->states[HIV_STATE][0] + 1);
+      // Stage 4 raises the scheduled risk of death
+      if (a->states[UserStates::HIV_STATE][0] == 4)
+	s->reschedule(a);
+    }
+  }
+}
+
+void death_event(Simulation *s, Agent *a)
+{
+  bool must_die = false;
+
+  // Risk of death for everyone
+  must_die = s->is_event( (unsigned) BACKGROUND_MORTALITY_PARM);
+  if (must_die == false && a->states[HIV_STATE][0] == 4)
+    must_die = s->is_event( (unsigned) BACKGROUND_MORTALITY_PARM);
+  if (must_die) {
+    a->states[ALIVE_STATE][0] = 0;
+    a->states[DEATH_AGE_STATE][0] = s->states[CURRENT_DATE_STATE][0];
+    s->kill_agent();
+  }
+}
+
+/* The death event for scheduled mortality: the agent's sampled time of
+   death has come. */
+void die_action(Simulation *s, Agent *a)
+{
+  a->states[ALIVE_STATE][0] = 0;
+  a->states[DEATH_AGE_STATE][0] = s->states[CURRENT_DATE_STATE][0];
+  s->kill_agent();
+}
+
+/* Global Events */
+
+/* The three agent events above, written as passes over the whole
+   population. Each pass draws the random numbers of all its eligible
+   agents in one batch. States are read from the columns but written with
+   set_state, so that aggregates and indexes on them stay up to date. */
+
+void hiv_batch_event(Simulation *s)
+{
+  const std::vector<real> &hiv = s->agent_store.column(HIV_STATE);
+  std::vector<size_t> eligible, fired;
+  real date = s->states[CURRENT_DATE_STATE][0];
+
+  eligible.reserve(s->agents.size());
+  fired.reserve(s->agents.size());
+
+  // Infection
+  for (size_t i = 0; i < s->agents.size(); ++i)
+    if (hiv[s->agents[i]->slot()] == 0)
+      eligible.push_back(i);
+  s->fire_events(HIV_INFECTION_RATE_PARM, eligible, fired);
+  for (auto & i : fired) {
+    s->set_state(s->agents[i], HIV_STATE, 0, 1);
+    s->set_state(s->agents[i], HIV_INFECTION_DATE_STATE, 0, date);
+  }
+
+  // Stage transition
+  eligible.clear();
+  fired.clear();
+  for (size_t i = 0; i < s->agents.size(); ++i) {
+    real stage = hiv[s->agents[i]->slot()];
+    if (stage > 0 && stage < 4)
+      eligible.push_back(i);
+  }
+  s->fire_events(HIV_TRANSITION_PARM, eligible, fired);
+  for (auto & i : fired)
+    s->set_state(s->agents[i], HIV_STATE, 0,
+		 hiv[s->agents[i]->slot()] + 1);
+
+  // Background mortality, then stage 4 mortality for the survivors
+  std::vector<size_t> dead;
+  eligible.resize(s->agents.size());
+  for (size_t i = 0; i < eligible.size(); ++i)
+    eligible[i] = i;
+  s->fire_events(BACKGROUND_MORTALITY_PARM, eligible, dead);
+  eligible.clear();
+  fired.clear();
+  std::vector<char> dying(s->agents.size(), 0);
+  for (auto & i : dead)
+    dying[i] = 1;
+  for (size_t i = 0; i < s->agents.size(); ++i)
+    if (dying[i] == 0 && hiv[s->agents[i]->slot()] == 4)
+      eligible.push_back(i);
+  // The second trial on the parameter this iteration takes the next draw
+  s->fire_events(BACKGROUND_MORTALITY_PARM, eligible, fired, 1);
+  for (auto & i : fired)
+    dying[i] = 1;
+  for (size_t i = 0; i < s->agents.size(); ++i)
+    if (dying[i]) {
+      s->set_state(s->agents[i], ALIVE_STATE, 0, 0);
+      s->set_state(s->agents[i], DEATH_AGE_STATE, 0, date);
+      s->kill_agent(i);
+    }
+}
+
+/* MODEL */
+
+void granich_model(Simulation &s)
+{
+  // Set parameters
+  s.set_parameters({
+      {START_DATE_PARM, {2010.0}},
+	{TIME_STEP_SIZE_PARM, {1.0 / 365}},
+	  {NUM_TIME_STEPS_PARM, {20.0 / (1.0 / 365)}},
+	    {PROB_MALE_PARM, {0.5}},
+	      {BACKGROUND_MORTALITY_PARM, {0.01}},
+		{INITIAL_HIV_INFECTION_RATE_PARM, {0.1}},
+		  {HIV_INFECTION_RATE_PARM, {0.02}},
+		    {HIV_TRANSITION_PARM, {0.3}}});
+
+  // Set global state functions
+  s.set_global_states({
+      [](Simulation *s) {
+	s->states[CURRENT_DATE_STATE] = {s->parameters[START_DATE_PARM][0]};
+      }});
+
+  // Set agent initiation functions
+  s.set_agent_initializers({dob_state_init, alive_state_init,
+	sex_state_init,  hiv_state_init});
+}
@@ -0,0 +1,50 @@
+#ifndef __GRANICH_H__
+#define __GRANICH_H__
+
+/*
+  The model of some aspects of Granich et al.
+  DOI:10.1016/S0140-6736(08)61697-9
+  shared by simplesim and bench.
+ */
+
+#include "sim/sim.hh"
+
+// Greek parameters from Figure 2 of Granich et al.
+enum UserParameters {
+  INITIAL_POP_PARM = sim::LAST_PARM + 1,
+  INITIAL_HIV_INFECTION_RATE_PARM,
+  HIV_INFECTION_RATE_PARM, // Gamma
+  HIV_TRANSITION_PARM,
+  BACKGROUND_MORTALITY_PARM,
+  LAST_GRANICH_PARM = BACKGROUND_MORTALITY_PARM
+};
+
+enum UserStates {
+  HIV_STATE = sim::LAST_STATE + 1,
+  HIV_INFECTION_DATE_STATE,
+  LAST_GRANICH_STATE = HIV_INFECTION_DATE_STATE
+};
+
+// State initializers
+void dob_state_init(sim::Agent *a, sim::Simulation *s);
+void alive_state_init(sim::Agent *a, sim::Simulation *s);
+void sex_state_init(sim::Agent *a, sim::Simulation *s);
+void hiv_state_init(sim::Agent *a, sim::Simulation *s);
+
+// Agent events
+void hiv_infection_event(sim::Simulation *s, sim::Agent *a);
+void hiv_transition_event(sim::Simulation *s, sim::Agent *a);
+void death_event(sim::Simulation *s, sim::Agent *a);
+// The action of scheduled mortality: the agent's time of death has come.
+void die_action(sim::Simulation *s, sim::Agent *a);
+
+// The three agent events as batch passes over the whole population, to run
+// as a global event instead of them.
+void hiv_batch_event(sim::Simulation *s);
+
+// Sets the model's parameters, global states and agent initializers. The
+// caller chooses how the events run: as agent events, guarded, scheduled or
+// as hiv_batch_event.
+void granich_model(sim::Simulation &s);
+
+#endif
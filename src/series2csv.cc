@@ -0,0 +1,113 @@
+/*
+  Converts a time series written by sim::TimeSeriesWriter to CSV: a header
+  line of replicate, iteration and the metric names, then a line per row.
+ */
+
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <unistd.h>
+
+#include "sim/sim.hh"
+
+using namespace sim;
+
+/* The names are read before the first row, so the header is written with
+   it, or after the file if it has no rows. */
+void series_to_csv(const char *filename, std::ostream &out, const char delim)
+{
+  bool header = false;
+  std::vector<std::string> names;
+  auto write_header = [&]() {
+    out << "replicate" << delim << "iteration";
+    for (auto & name : names)
+      out << delim << name;
+    out << "\n";
+    header = true;
+  };
+
+  out.precision(std::numeric_limits<real>::max_digits10);
+  auto write_row = [&](unsigned replicate, unsigned long iteration,
+		       const std::vector<real> &values) {
+    if (header == false)
+      write_header();
+    out << replicate << delim << iteration;
+    for (auto & value : values)
+      out << delim << value;
+    out << "\n";
+  };
+  bool complete = TimeSeriesWriter::read(filename, write_row, &names);
+  if (header == false)
+    write_header();
+  if (complete == false)
+    std::cerr << "Warning: " << filename << " was cut short; its last, "
+	      << "partial block was skipped." << std::endl;
+  out.flush();
+  if (out.fail())
+    throw SimulationException("Error writing CSV output.");
+}
+
+void display_help(const char *prog_name, const char *msg)
+{
+  if (strcmp(msg, "") != 0)
+    std::cerr << msg << std::endl;
+
+  std::cerr << "Time series to CSV converter\n\n"
+	    << "Usage: "
+	    << prog_name
+	    << " [-o output_file] [-d delimiter] [-h] time_series_file\n\n"
+	    << "\t-o\twrites to output_file instead of standard output\n"
+	    << "\t-d\tsets the field delimiter (default ,)\n"
+	    << "\t-h\tprints out this help text"
+	    << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+  std::string output_filename;
+  char delim = ',';
+  int opt;
+
+  try {
+    while ((opt = getopt(argc, argv, "o:d:h")) != -1) {
+      switch (opt) {
+      case 'o':
+	output_filename = optarg;
+	break;
+      case 'd':
+	if (strlen(optarg) != 1)
+	  throw ArgException("The delimiter must be one character");
+	delim = optarg[0];
+	break;
+      case 'h':
+	display_help(argv[0], "");
+	return EXIT_SUCCESS;
+      default:
+	throw ArgException();
+      }
+    }
+    if (optind != argc - 1)
+      throw ArgException("Expected one time series file");
+  } catch (std::exception &e) {
+    display_help(argv[0], e.what());
+    return EXIT_FAILURE;
+  }
+
+  try {
+    if (output_filename.size()) {
+      std::ofstream out(output_filename);
+      if (out.fail())
+	throw SimulationException(("Can't open " + output_filename).c_str());
+      series_to_csv(argv[optind], out, delim);
+    } else {
+      series_to_csv(argv[optind], std::cout, delim);
+    }
+  } catch(std::exception &e) {
+    std::cerr << "An Exception occurred: " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
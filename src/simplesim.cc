@@ -4,125 +4,24 @@
  */
 
 #include <algorithm>
-#include <cassert>
 #include <cerrno>
 #include <climits>
 #include <cstring>
 #include <ctime>
 #include <exception>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <unistd.h>
 
 #include "sim/sim.hh"
+#include "granich.hh"
 #include "test.hh"
 
 using namespace sim;
 
-// Greek parameters from Figure 2 of Granich et al.
-enum UserParameters {
-  INITIAL_POP_PARM = LAST_PARM + 1,
-  INITIAL_HIV_INFECTION_RATE_PARM,
-  HIV_INFECTION_RATE_PARM, // Gamma
-  HIV_TRANSITION_PARM,
-  BACKGROUND_MORTALITY_PARM
-};
-
-enum UserStates {
-  HIV_STATE = LAST_STATE + 1,
-  HIV_INFECTION_DATE_STATE
-};
-
-/* Initialize states */
-
-/* STATE INITIATION */
-
-void dob_state_init(Agent *a, Simulation *s)
-{
-  std::normal_distribution<double> dis (25.0, 10.0);
-  double r = std::max(dis(rng), 15.0);
-  a->states[DOB_STATE] = {s->parameters[START_DATE_PARM][0] - r};
-}
-
-void alive_state_init(Agent *a, Simulation *s)
-{
-  a->states[ALIVE_STATE] = {1};
-  a->states[DEATH_AGE_STATE] = {0.0};
-}
-
-void sex_state_init(Agent* a, Simulation* s)
-{
-  // This is an improper deterministic implementation, necessary for testing
-  std::uniform_real_distribution<> dis;
-  if (dis(sim::rng) < s->parameters[PROB_MALE_PARM][0])
-    a->states[SEX_STATE] = {MALE};
-  else
-    a->states[SEX_STATE] = {FEMALE};
-}
-
-
-void hiv_state_init(Agent *a, Simulation *s)
-{
-  std::uniform_real_distribution<> dis;
-  if (dis(sim::rng) <
-      s->parameters[INITIAL_HIV_INFECTION_RATE_PARM][0])  {
-    a->states[HIV_STATE] = {1};
-    a->states[HIV_INFECTION_DATE_STATE] =
-      {s->parameters[START_DATE_PARM][0]};
-  } else {
-    a->states[HIV_STATE] = {0};
-    a->states[HIV_INFECTION_DATE_STATE] = {0};
-  }
-}
-
 /* EVENTS */
 
-/* Agent Events */
-
-void hiv_infection_event(Simulation *s, Agent *a)
-{
-  bool infected;
-  if (a->states[HIV_STATE][0] == 0) {
-    infected = s->is_event( (unsigned) HIV_INFECTION_RATE_PARM);
-    if (infected) {
-      a->states[HIV_STATE][0] = 1;
-      a->states[HIV_INFECTION_DATE_STATE][0] =
-	s->states[CURRENT_DATE_STATE][0];
-    }
-  }
-}
-
-void hiv_transition_event(Simulation *s, Agent *a)
-{
-  std::uniform_real_distribution<> dis;
-  bool transition;
-  if (a->states[UserStates::HIV_STATE][0] > 0 &&
-      a->states[UserStates::HIV_STATE][0] < 4) {
-    transition = s->is_event( (unsigned) HIV_TRANSITION_PARM);
-    if (transition) {
-      ++a->states[UserStates::HIV_STATE][0];
-    }
-  }
-}
-
-void death_event(Simulation *s, Agent *a)
-{
-  double background_mortality = s->parameters[BACKGROUND_MORTALITY_PARM][0];
-  double stage4_death = s->parameters[BACKGROUND_MORTALITY_PARM][0];
-  bool must_die = false;
-  std::uniform_real_distribution<> dis;
-
-  // Risk of death for everyone
-  must_die = s->is_event(background_mortality);
-  if (must_die == false && a->states[HIV_STATE][0] == 4)
-    must_die = s->is_event(stage4_death);
-  if (must_die) {
-    a->states[ALIVE_STATE][0] = 0;
-    a->states[DEATH_AGE_STATE][0] = s->states[CURRENT_DATE_STATE][0];
-    s->kill_agent();
-  }
-}
-
 class DeathEvent {
 private:
   double max_age(const double start, const std::vector<Agent *> &agents)
@@ -157,29 +56,11 @@ public:
 
 void mortality_report(const Simulation *s)
 {
-  size_t num_alive = std::count_if(s->agents.begin(), s->agents.end(),
-				   [&num_alive](const Agent *agent){
-				     return agent->states.at(ALIVE_STATE)[0];
-				   });
-  assert(num_alive == s->agents.size());
-  size_t num_dead = std::count_if(s->dead_agents.begin(), s->dead_agents.end(),
-				  [&num_alive](const Agent *agent){
-				    if (agent->states.at(ALIVE_STATE)[0])
-				      return false;
-				    else
-				      return true;
-				  });
-  assert(num_dead == s->dead_agents.size());
-  size_t num_alive_hiv =
-    std::count_if(s->agents.begin(), s->agents.end(),
-		  [&num_alive](const Agent *agent){
-		    return agent->states.at(HIV_STATE)[0] > 0;
-		  });
-  size_t num_dead_hiv =
-    std::count_if(s->dead_agents.begin(), s->dead_agents.end(),
-		  [&num_alive](const Agent *agent){
-		    return agent->states.at(HIV_STATE)[0] > 0;
-		  });
+  size_t num_alive = s->population();
+  size_t num_alive_hiv = s->aggregate("HIV+");
+  // Dead agents may have been archived, so use the death counters
+  size_t num_dead = s->num_dead();
+  size_t num_dead_hiv = s->num_dead("HIV+");
   std::cout << "Alive\tHIV+\tDead\tHIV+" << std::endl;
   std::cout << num_alive << "\t" << num_alive_hiv << "\t"
 	    << num_dead << "\t" << num_dead_hiv << std::endl;
@@ -190,47 +71,88 @@ void mortality_report(const Simulation *s)
 /* SIMULATION */
 
 void simple_simulation(unsigned num_agents,
-		       unsigned num_simulations)
+		       unsigned num_simulations,
+		       bool batch,
+		       bool scheduled,
+		       bool guarded,
+		       const std::string &archive_filename,
+		       const std::string &series_filename)
 {
   Simulation s;
 
-  // Set parameters
-  s.set_parameters({
-      {START_DATE_PARM, {2010.0}},
-	{TIME_STEP_SIZE_PARM, {1.0 / 365}},
-	  {NUM_TIME_STEPS_PARM, {20.0 / (1.0 / 365)}},
-	    {PROB_MALE_PARM, {0.5}},
-	      {BACKGROUND_MORTALITY_PARM, {0.01}},
-		{INITIAL_HIV_INFECTION_RATE_PARM, {0.1}},
-		  {HIV_INFECTION_RATE_PARM, {0.02}},
-		    {HIV_TRANSITION_PARM, {0.3}}});
-
-  // Set global state functions
-  s.set_global_states({
-      [](Simulation *s) {
-	s->states[CURRENT_DATE_STATE] = {s->parameters[START_DATE_PARM][0]};
-      }});
+  granich_model(s);
 
   // Set global events
-  s.set_global_events({
-      IncrementTimeEvent(s.parameters[TIME_STEP_SIZE_PARM][0])});
+  if (batch)
+    s.set_global_events({
+	IncrementTimeEvent(s.parameters[TIME_STEP_SIZE_PARM][0]),
+	  hiv_batch_event});
+  else
+    s.set_global_events({
+	IncrementTimeEvent(s.parameters[TIME_STEP_SIZE_PARM][0])});
 
   // Set number of agents
   s.set_number_agents(num_agents);
 
-  // Set agent initiation functions
-  s.set_agent_initializers({dob_state_init, alive_state_init,
-	sex_state_init,  hiv_state_init});
-
   // Set agent events
-  s.set_events({hiv_infection_event, hiv_transition_event, death_event});
+  if (batch == false && guarded) {
+    // Only the agents eligible for the HIV events are visited
+    s.add_guarded_event(HIV_STATE, {0}, hiv_infection_event);
+    s.add_guarded_event(HIV_STATE, {1, 2, 3}, hiv_transition_event);
+    if (scheduled == false)
+      s.set_events({death_event});
+  } else if (batch == false && scheduled) {
+    s.set_events({hiv_infection_event, hiv_transition_event});
+  } else if (batch == false) {
+    s.set_events({hiv_infection_event, hiv_transition_event, death_event});
+  }
+
+  // Schedule mortality instead of trying it for every agent at every step.
+  // Stage 4 doubles the hazard as in death_event.
+  if (batch == false && scheduled) {
+    s.add_scheduled_event(BACKGROUND_MORTALITY_PARM, die_action);
+    s.add_scheduled_event([](const Simulation *s, const Agent *a) {
+	return a->states[HIV_STATE][0] == 4 ?
+	  s->parameters.at(BACKGROUND_MORTALITY_PARM)[0] : 0.0;
+      }, die_action, {BACKGROUND_MORTALITY_PARM});
+  }
+
+  // Count HIV positive agents alive and dead, and stream the dead to an
+  // archive if asked. Infections change the HIV state with set_state.
+  s.add_aggregate("HIV+", [](const Agent *a) {
+      return a->states.at(HIV_STATE)[0] > 0;
+    }, {HIV_STATE});
+  s.add_death_counter("HIV+", [](const Agent *a) {
+      return a->states[HIV_STATE][0] > 0;
+    });
+  if (archive_filename != "")
+    s.set_dead_agent_sink(DeadAgentArchive(archive_filename.c_str(),
+					   {DOB_STATE, SEX_STATE,
+					       DEATH_AGE_STATE, HIV_STATE}));
 
   // Set reports
   s.set_reports({
       {mortality_report, 0, true, true} });
+  // Write the population before the simulation and after every step to a
+  // time series if asked. The interim rows cover the end of the
+  // simulation, so there is no report after it.
+  std::unique_ptr<TimeSeriesWriter> series;
+  if (series_filename != "") {
+    series.reset(new TimeSeriesWriter(series_filename.c_str(),
+				      {"alive", "HIV+", "dead",
+					  "dead HIV+"}));
+    s.reports.push_back(Report(series->report({
+	    [](const Simulation *s) { return s->population(); },
+	    [](const Simulation *s) { return s->aggregate("HIV+"); },
+	    [](const Simulation *s) { return (real) s->num_dead(); },
+	    [](const Simulation *s) { return (real) s->num_dead("HIV+"); }}),
+	  1, true, false));
+  }
 
   s.initialize_states();
-  s.simulate(s.parameters[NUM_TIME_STEPS_PARM][0], false);
+  s.simulate(s.parameters[NUM_TIME_STEPS_PARM][0], series != nullptr);
+  if (series)
+    series->flush();
   // s.montecarlo(s.parameters[NUM_TIME_STEPS_PARM][0],
   // 	       s.parameters[INTERIM_REPORT_PARM][0],
   // 	       dists,
@@ -298,12 +220,19 @@ unsigned strtou(char *str)
   std::cerr << "Microsimulation test program\n\n"
 	    << "Usage: "
 	    << prog_name
-	    << " [-a num_agents] [-s num_simulations] [-v]"
-	    << " [-h]\n\n"
+	    << " [-a num_agents] [-s num_simulations] [-b] [-t] [-g] [-d file]"
+	    << " [-o file] [-v] [-h]\n\n"
 	    << "\t-a\tsets the number of agents\n"
 	    << "\t-s\tsets the number of simple simulations (0 for none)\n"
 	    << "\t-m\tsets the number of Monte Carlo simulations "
 	    << "(0 for none)\n"
+	    << "\t-b\truns the agent events as batch passes over all agents\n"
+	    << "\t-t\tschedules mortality by sampled times of death\n"
+	    << "\t-g\truns the HIV events as events guarded by HIV stage\n"
+	    << "\t-d\tarchives dead agents to this file instead of keeping "
+	    << "them\n"
+	    << "\t-o\twrites the population at every step to this time "
+	    << "series file\n"
 	    << "\t-v\tprints out verbose information including times\n"
 	    << "\t-h\tprints out this help text"
 	    << std::endl;
@@ -313,14 +242,34 @@ int main(int argc, char *argv[])
 {
   unsigned num_agents = 12;
   bool verbose = false;
+  bool batch = false;
+  bool scheduled = false;
+  bool guarded = false;
+  std::string archive_filename = "";
+  std::string series_filename = "";
   int opt;
 
   try {
-    while ((opt = getopt(argc, argv, "a:vh")) != -1) {
+    while ((opt = getopt(argc, argv, "a:btgd:o:vh")) != -1) {
       switch (opt) {
       case 'a':
 	num_agents = strtou(optarg);
 	break;
+      case 'b':
+	batch = true;
+	break;
+      case 't':
+	scheduled = true;
+	break;
+      case 'g':
+	guarded = true;
+	break;
+      case 'd':
+	archive_filename = std::string(optarg);
+	break;
+      case 'o':
+	series_filename = std::string(optarg);
+	break;
       case 'v':
 	verbose = true;
 	break;
@@ -338,7 +287,8 @@ int main(int argc, char *argv[])
 
   try {
     // Run the simple simulation (default once)
-    simple_simulation(num_agents, verbose);
+    simple_simulation(num_agents, verbose, batch, scheduled, guarded,
+		      archive_filename, series_filename);
   } catch(std::exception &e) {
     std::cerr << "An Exception occurred: " << e.what() << std::endl;
     return EXIT_FAILURE;
@@ -1,11 +1,17 @@
 #include <algorithm>
 #include <cerrno>
+#include <chrono>
 #include <climits>
 #include <cstring>
 #include <ctime>
 #include <exception>
+#include <iterator>
+#include <map>
+#include <set>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "sim/sim.hh"
@@ -23,6 +29,7 @@ enum UserParameters {
 
 enum UserStates {
   POSITION_STATE = LAST_STATE + 1,
+  WEIGHT_STATE
 };
 
 tst::TestSeries t("Sim");
@@ -143,20 +150,10 @@ public:
     t_(t), tot_agents_(tot_agents) { }
   void operator()(const Simulation *s)
   {
-    size_t num_alive = std::count_if(s->agents.begin(), s->agents.end(),
-				     [](const Agent *agent){
-				       return agent->states.at(ALIVE_STATE)[0];
-				     });
+    size_t num_alive = s->aggregate("alive");
     TESTLT(t_, 0, num_alive,  "Number alive > 0.");
     TESTEQ(t_, num_alive, s->agents.size(), "Number alive.");
-    size_t num_dead = std::count_if(s->dead_agents.begin(), s->dead_agents.end(),
-				    [](const Agent *agent){
-				      if (agent->states.at(ALIVE_STATE)[0])
-					return false;
-				      else
-					return true;
-				    });
-    num_dead = s->dead_agents.size();
+    size_t num_dead = s->dead_agents.size();
     TESTLT(t_, 0, num_dead, "Number dead > 0.");
     TESTEQ(t_, num_dead + num_alive, tot_agents_, "Dead + alive == total agents.");
   }
@@ -244,6 +241,12 @@ void test_simple_simulation(tst::TestSeries &tst,
   // Agent events
   s.set_events({UpdatePositionEvent(), DeathEvent()});
 
+  // The death event sets the alive state, so the count of the living is
+  // kept up to date by differences
+  s.add_aggregate("alive", [](const Agent *a) {
+      return a->states.at(ALIVE_STATE)[0] != 0;
+    });
+
   s.set_reports({{age_report, 1000, false, false},
 	{gender_report, 0, true, false},
 	  {MortalityReport(tst, num_agents), 0, false, true},
@@ -437,6 +440,135 @@ void test_norm_functions(tst::TestSeries &tst)
 	 "Adjusted time period for random event.");
 }
 
+void test_agent_store(tst::TestSeries &tst)
+{
+  Simulation s;
+
+  s.set_number_agents(3);
+  for (auto & agent : s.agents) {
+    agent->states[DOB_STATE] = {1980.0 - agent->id()};
+    agent->states[UserStates::POSITION_STATE] = {1.0 * agent->id(),
+						 2.0 * agent->id()};
+  }
+  TESTEQ(tst, s.agent_store.size(), 3, "agent store slots");
+  TESTEQ(tst, s.agent_store.arity(UserStates::POSITION_STATE), 2,
+	 "agent store arity of position");
+  TESTEQ(tst, s.agent_store.column(DOB_STATE)[s.agents[2]->slot()], 1978.0,
+	 "agent store dob column");
+  TESTEQ(tst, s.agent_store.column(UserStates::POSITION_STATE, 1)
+	 [s.agents[1]->slot()], 2.0, "agent store second position column");
+  std::vector<real> position = s.agents[2]->states[POSITION_STATE];
+  TESTEQ(tst, position.size(), 2, "agent state copied to vector");
+  TESTEQ(tst, position[0] + position[1], 6.0, "agent state vector values");
+  bool thrown = false;
+  try {
+    s.agents[0]->states.at(SEX_STATE);
+  } catch (std::out_of_range &e) {
+    thrown = true;
+  }
+  TEST(tst, thrown, "agent store throws on unknown state");
+  s.agents[1]->states[POSITION_STATE] = {5.0};
+  TESTEQ(tst, s.agents[1]->states[POSITION_STATE].size(), 2,
+	 "shorter assignment keeps the arity of the state");
+  TESTEQ(tst, s.agents[1]->states[POSITION_STATE][1], 0.0,
+	 "shorter assignment zeroes the elements past it");
+  TESTEQ(tst, s.agents[2]->states[POSITION_STATE][1], 4.0,
+	 "shorter assignment leaves other agents alone");
+}
+
+void test_probability_cache(tst::TestSeries &tst)
+{
+  Simulation s;
+
+  s.set_parameters({
+      {TIME_STEP_SIZE_PARM, {0.5}},
+	{PROB_MALE_PARM, {0.5}}});
+  s.set_global_events({
+      [](Simulation *s) {
+	if (s->iteration() == 3)
+	  s->set_parameter(PROB_MALE_PARM, {0.2});
+	if (s->iteration() == 6)
+	  s->parameters[TIME_STEP_SIZE_PARM][0] = 0.1;
+      }});
+  s.set_number_agents(2);
+  s.set_agent_initializers({
+      [](Agent *a, Simulation *s) {
+	a->states[POSITION_STATE] = {0.0, 0.0, 0.0, 0.0, 0.0};
+      }});
+  s.set_events({
+      [](Simulation *s, Agent *a) {
+	if (s->iteration() == 2 || s->iteration() == 4 || s->iteration() == 7)
+	  a->states[POSITION_STATE][s->iteration() / 2] =
+	    s->prob_event(PROB_MALE_PARM);
+      }});
+  s.simulate(8, false);
+  TESTLT(tst, fabs(s.agents[0]->states[POSITION_STATE][1] - 0.292893),
+	 0.0001, "Cached probability of event: ts = 0.5, prob=0.5");
+  TESTLT(tst, fabs(s.agents[0]->states[POSITION_STATE][2] - 0.105573),
+	 0.0001, "Cached probability refreshed after set_parameter");
+  TESTLT(tst, fabs(s.agents[1]->states[POSITION_STATE][3] - 0.0220672),
+	 0.0001, "Cached probability refreshed after time step change");
+}
+
+void test_batch_events(tst::TestSeries &tst)
+{
+  Simulation s;
+  std::vector<size_t> eligible, fired;
+
+  s.set_parameters({
+      {TIME_STEP_SIZE_PARM, {1.0}},
+	{PROB_MALE_PARM, {0.3}}});
+  s.set_number_agents(100000);
+  for (auto & agent : s.agents)
+    agent->states[POSITION_STATE] = {(real) (agent->id() % 4 == 0)};
+  for (size_t i = 0; i < s.agents.size(); i += 2)
+    eligible.push_back(i);
+
+  s.fire_events(PROB_MALE_PARM, eligible, fired);
+  TESTLT(tst, fabs((double) fired.size() / eligible.size() - 0.3), 0.01,
+	 "batch events fire with parameter probability");
+  TEST(tst, std::is_sorted(fired.begin(), fired.end()),
+       "batch events fired in eligible order");
+  size_t odd = std::count_if(fired.begin(), fired.end(),
+			     [](size_t i) { return i % 2; });
+  TESTEQ(tst, odd, 0, "batch events only fire for eligible agents");
+
+  fired.clear();
+  s.fire_events_by_state(POSITION_STATE, eligible, fired);
+  size_t expected = std::count_if(eligible.begin(), eligible.end(),
+				  [&s](size_t i) {
+				    return s.agents[i]->states[POSITION_STATE]
+				      [0] == 1.0;
+				  });
+  TESTEQ(tst, fired.size(), expected,
+	 "batch events fire with per agent probability");
+
+  // With counter streams, stage 4 mortality is a second trial on the
+  // background mortality parameter for the agents that survived the first
+  s.set_counter_rng();
+  std::vector<size_t> first, survivors, second;
+  eligible.resize(s.agents.size());
+  for (size_t i = 0; i < eligible.size(); ++i)
+    eligible[i] = i;
+  s.fire_events(PROB_MALE_PARM, eligible, first);
+  std::set_difference(eligible.begin(), eligible.end(), first.begin(),
+		      first.end(), std::back_inserter(survivors));
+  s.fire_events(PROB_MALE_PARM, survivors, second, 1);
+  TESTLT(tst, fabs((double) (first.size() + second.size()) / eligible.size()
+		   - 0.51), 0.01,
+	 "counter rng batch events: second trial independent of first");
+
+  // A parameter and a state with the same number draw different numbers
+  for (auto & agent : s.agents)
+    agent->states[PROB_MALE_PARM] = {0.3};
+  std::vector<size_t> by_state, both;
+  s.fire_events_by_state(PROB_MALE_PARM, eligible, by_state);
+  std::set_intersection(first.begin(), first.end(), by_state.begin(),
+			by_state.end(), std::back_inserter(both));
+  TESTLT(tst, fabs((double) both.size() / eligible.size() - 0.09), 0.01,
+	 "counter rng batch events: parameter and state independent");
+}
+
 void test_monte_carlo(tst::TestSeries &tst,
 		      unsigned num_agents,
 		      unsigned num_simulations,
@@ -507,6 +639,1333 @@ void test_monte_carlo(tst::TestSeries &tst,
   return;
 }
 
+void test_parallel_monte_carlo(tst::TestSeries &tst,
+			       unsigned num_agents,
+			       unsigned num_simulations,
+			       bool verbose)
+{
+  Simulation s;
+  unsigned replicates = 0;
+  PositionReport position_report(tst);
+  Perturbers dists = {
+    {POSITION_INIT_PARM, std::normal_distribution<>(-2.0, 5.0) },
+    {POSITION_UPDATE_PARM, std::normal_distribution<>(-13.5, 10.0) }
+  };
+
+  s.set_parameters({
+      {START_DATE_PARM, {1980.0}},
+      {TIME_STEP_SIZE_PARM, {1.0 / 365}},
+      {NUM_TIME_STEPS_PARM, {365.0}},
+      {POSITION_INIT_PARM, {0.0, 0.0}},
+      {POSITION_UPDATE_PARM, {1.0, 2.0}},
+      {PROB_MALE_PARM, {1.0}}
+    });
+  s.set_global_states({
+      [](Simulation *s) {
+	s->states[CURRENT_DATE_STATE] = {s->parameters[START_DATE_PARM][0]};
+      }});
+  s.set_global_events({
+      IncrementTimeEvent(s.parameters[TIME_STEP_SIZE_PARM][0])});
+  s.set_number_agents(num_agents);
+  s.set_agent_initializers({position_state_init});
+  s.set_events({UpdatePositionEvent()});
+
+  // The callback is serialized, so the test series can be used safely here.
+  s.montecarlo_parallel(s.parameters[NUM_TIME_STEPS_PARM][0], false, dists,
+			[&](const Simulation *simulation, unsigned sim_num) {
+			  if (simulation != &s) {
+			    ++replicates;
+			    position_report(simulation);
+			    TESTEQ(tst, simulation->agents.size(), num_agents,
+				   "parallel replicate agents");
+			  }
+			  return sim_num < num_simulations;
+			}, 4);
+  TESTEQ(tst, replicates, num_simulations, "parallel replicates run");
+  TESTEQ(tst, s.parameters[POSITION_UPDATE_PARM][0], 1.0,
+	 "parallel Monte Carlo leaves parameters unperturbed");
+}
+
+void test_parallel_agent_events(tst::TestSeries &tst,
+				unsigned num_agents)
+{
+  Simulation s;
+  PositionReport position_report(tst);
+  unsigned num_killed = 0;
+
+  s.set_parameters({
+      {START_DATE_PARM, {1980.0}},
+      {TIME_STEP_SIZE_PARM, {1.0 / 365}},
+      {POSITION_INIT_PARM, {0.0, 0.0}},
+      {POSITION_UPDATE_PARM, {1.0, 2.0}}
+    });
+  s.set_global_states({
+      [](Simulation *s) {
+	s->states[CURRENT_DATE_STATE] = {s->parameters[START_DATE_PARM][0]};
+	s->states[DEATH_AGE_STATE] = {0.0};
+      }});
+  s.set_number_agents(num_agents);
+  for (auto & agent : s.agents)
+    if (agent->id() % 3 == 0)
+      ++num_killed;
+  s.set_agent_initializers({position_state_init});
+  s.set_events({
+      UpdatePositionEvent(),
+	[](Simulation *s, Agent *a) {
+	if (s->iteration() == 10 && a->id() % 3 == 0) {
+	  s->kill_agent();
+	  auto lock = s->lock_globals();
+	  ++s->states[DEATH_AGE_STATE][0];
+	}
+      }});
+  s.set_agent_threads(4, 16);
+  s.simulate(20, false);
+
+  TESTEQ(tst, s.agents.size(), num_agents - num_killed,
+	 "parallel step agents alive");
+  TESTEQ(tst, s.dead_agents.size(), num_killed, "parallel step agents dead");
+  TESTEQ(tst, s.states[DEATH_AGE_STATE][0], num_killed,
+	 "parallel step locked global state writes");
+  size_t wrongly_killed = std::count_if(s.dead_agents.begin(),
+					s.dead_agents.end(),
+					[](const Agent *agent) {
+					  return agent->id() % 3 != 0;
+					});
+  TESTEQ(tst, wrongly_killed, 0, "parallel step kills the right agents");
+  position_report(&s);
+}
+
+void test_agent_pool(tst::TestSeries &tst)
+{
+  Simulation s;
+
+  s.set_number_agents(100);
+  s.set_agent_initializers({
+      [](Agent *a, Simulation *s) {
+	a->states[POSITION_STATE] = {1.0 + a->id()};
+      }});
+  s.set_global_events({
+      [](Simulation *s) {
+	if (s->iteration() == 1)
+	  for (size_t i = s->agents.size(); i-- > 0; )
+	    if (s->agents[i]->id() < 10)
+	      s->kill_agent(i);
+	if (s->iteration() == 2)
+	  for (unsigned i = 0; i < 10; ++i)
+	    s->append_agent();
+      }});
+  s.set_keep_dead_agents(false);
+  s.simulate(3, false);
+
+  TESTEQ(tst, s.agents.size(), 100, "pooled agents alive");
+  TESTEQ(tst, s.dead_agents.size(), 0, "pooled dead agents not kept");
+  TESTEQ(tst, s.num_dead(), 10, "pooled dead agents counted");
+  TESTEQ(tst, s.agent_store.size(), 100, "pooled agent slots reused");
+  size_t fresh = std::count_if(s.agents.begin(), s.agents.end(),
+			       [](const Agent *a) {
+				 return a->id() >= 100 &&
+				   a->states.at(POSITION_STATE)[0] == 0.0;
+			       });
+  TESTEQ(tst, fresh, 10, "pooled agents get new ids and zeroed slots");
+
+  Simulation original;
+  original.set_number_agents(20);
+  original.set_global_events({
+      [](Simulation *s) {
+	for (size_t i = 0; i < s->agents.size(); ++i)
+	  if (s->agents[i]->id() < 10)
+	    s->kill_agent(i);
+      }});
+  original.set_keep_dead_agents(false);
+  original.simulate(1, false);
+  Simulation copy(original);
+  for (unsigned i = 0; i < 10; ++i)
+    copy.append_agent();
+  TESTEQ(tst, copy.agent_store.size(), 20,
+	 "copied simulation reuses the free pooled slots");
+
+  s.clear_agents();
+  TESTEQ(tst, s.agents.size() + s.agent_store.size(), 0,
+	 "pooled agents cleared");
+}
+
+void test_deferred_kills(tst::TestSeries &tst, unsigned num_agents)
+{
+  Simulation s;
+
+  s.set_number_agents(num_agents);
+  s.set_agent_initializers({
+      [](Agent *a, Simulation *s) {
+	a->states[POSITION_STATE] = {0.0};
+      }});
+  s.set_events({
+      [](Simulation *s, Agent *a) {
+	if (s->iteration() == 1 && a->id() % 2)
+	  s->kill_agent();
+      },
+	[](Simulation *s, Agent *a) {
+	  ++a->states[POSITION_STATE][0];
+	}});
+  s.simulate(3, false);
+
+  TESTEQ(tst, s.agents.size(), num_agents / 2, "deferred kills alive");
+  TESTEQ(tst, s.dead_agents.size(), num_agents / 2, "deferred kills dead");
+  size_t dead_ok = std::count_if(s.dead_agents.begin(), s.dead_agents.end(),
+				 [](const Agent *a) {
+				   return a->id() % 2 &&
+				     a->states.at(POSITION_STATE)[0] == 1.0;
+				 });
+  TESTEQ(tst, dead_ok, num_agents / 2,
+	 "killed agents skip their remaining events");
+  size_t alive_ok = std::count_if(s.agents.begin(), s.agents.end(),
+				  [](const Agent *a) {
+				    return a->id() % 2 == 0 &&
+				      a->states.at(POSITION_STATE)[0] == 3.0;
+				  });
+  TESTEQ(tst, alive_ok, num_agents / 2,
+	 "no agent skipped when others are killed");
+  bool thrown = false;
+  try {
+    s.kill_agent(s.agents.size());
+  } catch (SimulationException &e) {
+    thrown = true;
+  }
+  TEST(tst, thrown, "killing an agent index out of range throws");
+}
+
+void test_dead_agent_archive(tst::TestSeries &tst, unsigned num_agents)
+{
+  char filename[] = "/tmp/testsimdeadXXXXXX";
+  int fd = mkstemp(filename);
+  if (fd == -1)
+    throw SimulationException("Can't create temporary file.");
+  close(fd);
+  {
+    Simulation s;
+    s.set_number_agents(num_agents);
+    s.set_agent_initializers({
+	[](Agent *a, Simulation *s) {
+	  a->states[POSITION_STATE] = {2.0 * a->id()};
+	}});
+    s.set_events({
+	[](Simulation *s, Agent *a) {
+	  if (s->iteration() == a->id() % 5)
+	    s->kill_agent();
+	}});
+    s.add_death_counter("even", [](const Agent *a) {
+	return a->id() % 2 == 0;
+      });
+    s.set_dead_agent_sink(DeadAgentArchive(filename, {POSITION_STATE}));
+    s.simulate(3, false);
+    TESTEQ(tst, s.dead_agents.size(), 0, "archived dead agents not kept");
+    TESTEQ(tst, s.num_dead(), num_agents / 5 * 3, "archived dead counted");
+    TESTEQ(tst, s.num_dead("even"), (num_agents / 5 * 3 + 1) / 2,
+	   "archived dead counter");
+  }
+  unsigned long records = 0, correct = 0;
+  DeadAgentArchive::read(filename,
+			 [&](unsigned long id, unsigned replicate,
+			     unsigned long iteration,
+			     const std::vector<real> &values) {
+			   ++records;
+			   if (replicate == 0 && iteration == id % 5 &&
+			       values[0] == 2.0 * id)
+			     ++correct;
+			 });
+  TESTEQ(tst, records, num_agents / 5 * 3, "dead agent archive records");
+  TESTEQ(tst, correct, records, "dead agent archive contents");
+
+  // Parallel replicates share one archive
+  {
+    Simulation s;
+    s.set_number_agents(num_agents);
+    s.set_agent_initializers({[](Agent *a, Simulation *s) {}});
+    s.set_events({
+	[](Simulation *s, Agent *a) {
+	  if (s->iteration() == a->id() % 5)
+	    s->kill_agent();
+	}});
+    DeadAgentArchive archive(filename, {});
+    s.set_dead_agent_sink(archive);
+    s.montecarlo_parallel(3, false, {},
+			  [](const Simulation *s, unsigned sim_num) {
+			    return sim_num < 8;
+			  }, 4);
+    archive.flush();
+  }
+  std::map<unsigned, unsigned long> replicate_records;
+  DeadAgentArchive::read(filename,
+			 [&](unsigned long id, unsigned replicate,
+			     unsigned long iteration,
+			     const std::vector<real> &values) {
+			   ++replicate_records[replicate];
+			 });
+  TESTEQ(tst, replicate_records.size(), 8,
+	 "dead agent archive records the replicates");
+  bool all = true;
+  for (auto & replicate : replicate_records)
+    if (replicate.second != num_agents / 5 * 3)
+      all = false;
+  TEST(tst, all, "dead agent archive records every replicate's deaths");
+  unlink(filename);
+}
+
+void test_csv_file(tst::TestSeries &tst)
+{
+  char filename[] = "/tmp/testsimcsvXXXXXX";
+  int fd = mkstemp(filename);
+  if (fd == -1)
+    throw SimulationException("Can't create temporary file.");
+  const char contents[] = "a,b,\"c,d\"\n1,,2.5,\n\n-0.125,1e3";
+  if (write(fd, contents, sizeof(contents) - 1) !=
+      (ssize_t) (sizeof(contents) - 1))
+    throw SimulationException("Can't write temporary file.");
+  close(fd);
+
+  auto csv_matrix = process_csv_file(filename);
+  TESTEQ(tst, csv_matrix.size(), 4, "csv lines");
+  TESTEQ(tst, csv_matrix[0].size(), 3, "csv quoted delimiter not split");
+  TEST(tst, csv_matrix[0][2] == "\"c,d\"", "csv quotes kept");
+  TESTEQ(tst, csv_matrix[1].size(), 3, "csv empty last field dropped");
+  TEST(tst, csv_matrix[1][1] == "", "csv empty field");
+  TESTEQ(tst, csv_matrix[2].size(), 0, "csv empty line");
+  TESTEQ(tst, csv_matrix[3].size(), 2, "csv last line without newline");
+  unlink(filename);
+
+  char rows_filename[] = "/tmp/testsimcsvXXXXXX";
+  fd = mkstemp(rows_filename);
+  if (fd == -1)
+    throw SimulationException("Can't create temporary file.");
+  const char rows[] = "#,X\n3,1.5\n2,0\n";
+  if (write(fd, rows, sizeof(rows) - 1) != (ssize_t) (sizeof(rows) - 1))
+    throw SimulationException("Can't write temporary file.");
+  close(fd);
+  unsigned num_rows = 0;
+  real total = 0.0;
+  read_csv_rows(rows_filename, ',',
+		[&](const std::vector<std::string> &headings) {
+		  TESTEQ(tst, headings.size(), 2, "csv streamed headings");
+		},
+		[&](const std::vector<real> &row) {
+		  ++num_rows;
+		  total += row[0] * row[1];
+		});
+  TESTEQ(tst, num_rows, 2, "csv streamed rows");
+  TESTEQ(tst, total, 4.5, "csv streamed values");
+  Simulation s;
+  s.set_state_names({{POSITION_STATE, "X"}});
+  s.set_agent_csv_initializer(rows_filename);
+  s.initialize_states();
+  unsigned num_at_x = 0;
+  for (auto & a : s.agents)
+    if (a->states[POSITION_STATE][0] == 1.5)
+      ++num_at_x;
+  TESTEQ(tst, s.agents.size(), 5, "csv streamed agents");
+  TESTEQ(tst, num_at_x, 3, "csv streamed agent states");
+  unlink(rows_filename);
+
+  unsigned same = 0;
+  std::vector<std::string> numbers = {
+    "0", "-0", "+7", "42", "0.1", "3.14159", "-2.5", ".5", "7.",
+    "123456789012345", "1234567890123456789", "0.000000000000001",
+    "1e-7", "2.5E10", "inf", "0x1p3"
+  };
+  for (auto & n : numbers)
+    if (strtor(n.data(), n.data() + n.size()) == strtod(n.c_str(), NULL))
+      ++same;
+  TESTEQ(tst, same, numbers.size(), "csv number conversion matches strtod");
+  bool thrown = false;
+  std::string bad = "1.5x";
+  try {
+    strtor(bad.data(), bad.data() + bad.size());
+  } catch (ArgException &e) {
+    thrown = std::string(e.what()).find("Number 1.5x is not valid.") !=
+      std::string::npos;
+  }
+  TEST(tst, thrown, "csv invalid number message");
+}
+
+void test_population_snapshot(tst::TestSeries &tst, unsigned num_agents)
+{
+  char filename[] = "/tmp/testsimsnapXXXXXX";
+  int fd = mkstemp(filename);
+  if (fd == -1)
+    throw SimulationException("Can't create temporary file.");
+  close(fd);
+
+  Simulation s;
+  s.set_number_agents(num_agents);
+  s.set_global_states({
+      [](Simulation *s) {
+	s->states[POSITION_STATE] = {1.0, 2.0, 3.0};
+      }});
+  s.set_agent_initializers({
+      [](Agent *a, Simulation *s) {
+	a->states[POSITION_STATE] = {std::uniform_real_distribution<real>()
+				     (rng), 2.0 * a->id()};
+	a->states[SEX_STATE] = {(real) (a->id() % 2)};
+      }});
+  s.initialize_states();
+  s.kill_agent(0);
+  s.remove_killed_agents();
+  s.write_snapshot(filename);
+
+  unsigned initializer_calls = 0;
+  Simulation t;
+  t.set_agent_initializers({
+      [&initializer_calls](Agent *a, Simulation *s) {
+	++initializer_calls;
+      }});
+  t.set_snapshot_initializer(filename);
+  t.initialize_states();
+  TESTEQ(tst, initializer_calls, 0, "snapshot skips agent initializers");
+  TESTEQ(tst, t.agents.size(), s.agents.size(), "snapshot agents");
+  TEST(tst, t.states[POSITION_STATE] == s.states[POSITION_STATE],
+       "snapshot global states");
+  unsigned same = 0;
+  for (size_t i = 0; i < s.agents.size() && i < t.agents.size(); ++i)
+    if (t.agents[i]->id() == s.agents[i]->id() &&
+	t.agents[i]->states[POSITION_STATE][0] ==
+	s.agents[i]->states[POSITION_STATE][0] &&
+	t.agents[i]->states[POSITION_STATE][1] ==
+	s.agents[i]->states[POSITION_STATE][1] &&
+	t.agents[i]->states[SEX_STATE][0] == s.agents[i]->states[SEX_STATE][0])
+      ++same;
+  TESTEQ(tst, same, s.agents.size(), "snapshot agent states");
+  TESTEQ(tst, t.append_agent()->id(), num_agents, "snapshot next agent id");
+  unlink(filename);
+}
+
+/* A small birth and death model whose results depend on every draw from
+   sim::rng. */
+void checkpoint_simulation(Simulation &s, unsigned num_agents)
+{
+  s.set_number_agents(num_agents);
+  s.set_global_states({
+      [](Simulation *s) {
+	s->states[POSITION_STATE] = {0.0};
+      }});
+  s.set_agent_initializers({
+      [](Agent *a, Simulation *s) {
+	a->states[POSITION_STATE] = {uniform_real(rng)};
+      }});
+  s.set_global_events({
+      [](Simulation *s) {
+	size_t births = s->agents.size() / 50;
+	for (size_t i = 0; i < births; ++i)
+	  s->append_agent()->states[POSITION_STATE] = {uniform_real(rng)};
+	s->states[POSITION_STATE][0] += births;
+      }});
+  s.set_events({
+      [](Simulation *s, Agent *a) {
+	a->states[POSITION_STATE][0] += uniform_real(rng);
+	if (uniform_real(rng) < 0.02)
+	  s->kill_agent();
+      }});
+  s.add_death_counter("all", [](const Agent *) { return true; });
+}
+
+void test_checkpoint(tst::TestSeries &tst, unsigned num_agents)
+{
+  char filename[] = "/tmp/testsimckptXXXXXX";
+  int fd = mkstemp(filename);
+  if (fd == -1)
+    throw SimulationException("Can't create temporary file.");
+  close(fd);
+
+  Simulation s;
+  checkpoint_simulation(s, num_agents);
+  s.set_checkpoint(filename, 10);
+  rng.seed(7);
+  s.simulate(25, false);
+
+  Simulation t;
+  checkpoint_simulation(t, num_agents);
+  rng.seed(8);
+  t.resume(filename, 25, false);
+
+  TESTEQ(tst, t.iteration(), s.iteration(), "resumed iteration");
+  TESTEQ(tst, t.agents.size(), s.agents.size(), "resumed agents");
+  TESTEQ(tst, t.dead_agents.size(), s.dead_agents.size(),
+	 "resumed dead agents");
+  TESTEQ(tst, t.num_dead("all"), s.num_dead("all"),
+	 "resumed death counter");
+  TEST(tst, t.states[POSITION_STATE] == s.states[POSITION_STATE],
+       "resumed global states");
+  unsigned same = 0;
+  for (size_t i = 0; i < s.agents.size() && i < t.agents.size(); ++i)
+    if (t.agents[i]->id() == s.agents[i]->id() &&
+	t.agents[i]->states[POSITION_STATE][0] ==
+	s.agents[i]->states[POSITION_STATE][0])
+      ++same;
+  TESTEQ(tst, same, s.agents.size(), "resumed agents identical");
+  unlink(filename);
+}
+
+struct TypedPosition : TypedState<double> {
+  static const char *name() { return "position"; }
+};
+struct TypedFlag : TypedState<bool> {
+  static const char *name() { return "flag"; }
+};
+struct TypedTriple : TypedState<uint16_t, 3> {
+  static const char *name() { return "triple"; }
+};
+struct TypedGlobals {
+  unsigned steps = 0;
+};
+
+void test_typed_simulation(tst::TestSeries &tst, unsigned num_agents)
+{
+  typedef TypedSimulation<TypedGlobals, TypedPosition, TypedFlag,
+			  TypedTriple> Typed;
+  Typed s;
+
+  static_assert(Typed::state_index<TypedTriple>() == 2,
+		"typed state index is a compile time constant");
+  TESTEQ(tst, sizeof(Typed::Column<TypedTriple>::value_type), 6,
+	 "typed state with arity stored in its own type");
+  static_assert(std::is_same<Typed::Column<TypedFlag>::value_type,
+		uint8_t>::value, "typed bool state stored as a byte");
+  s.set_number_agents(num_agents);
+  s.set_agent_initializers({
+      [](Typed &s, Typed::AgentRef a) {
+	a.get<TypedPosition>() = a.id();
+	a.get<TypedTriple>() = {{1, 2, 3}};
+      }});
+  s.set_global_events({
+      [](Typed &s) {
+	++s.globals.steps;
+      }});
+  s.set_events({
+      [](Typed &s, Typed::AgentRef a) {
+	if (s.iteration() == 1 && a.id() % 2)
+	  s.kill_agent(a);
+      },
+	[](Typed &s, Typed::AgentRef a) {
+	  a.get<TypedPosition>() += 1.0;
+	  a.get<TypedFlag>() = true;
+	  ++a.get<TypedTriple>()[2];
+	}});
+  s.simulate(3, false);
+
+  TESTEQ(tst, s.globals.steps, 3, "typed global events");
+  TESTEQ(tst, s.agents().size(), num_agents / 2, "typed alive");
+  TESTEQ(tst, s.dead_agents().size(), num_agents / 2, "typed dead");
+  size_t alive_ok = std::count_if(s.agents().begin(), s.agents().end(),
+				  [&s](const size_t slot) {
+				    Typed::AgentRef a = s.agent(slot);
+				    return a.id() % 2 == 0 &&
+				      a.get<TypedPosition>() == a.id() + 3.0 &&
+				      a.get<TypedFlag>() &&
+				      a.get<TypedTriple>()[2] == 6;
+				  });
+  TESTEQ(tst, alive_ok, num_agents / 2, "typed agent states");
+  size_t dead_ok = std::count_if(s.dead_agents().begin(),
+				 s.dead_agents().end(),
+				 [&s](const size_t slot) {
+				   Typed::AgentRef a = s.agent(slot);
+				   return a.get<TypedPosition>() ==
+				     a.id() + 1.0;
+				 });
+  TESTEQ(tst, dead_ok, num_agents / 2,
+	 "typed killed agents skip their remaining events");
+
+  std::ostringstream out;
+  s.write_agents_csv(out);
+  std::string csv = out.str();
+  std::string heading = csv.substr(0, csv.find('\n'));
+  TESTEQ(tst, heading, "id,position,flag,triple,triple,triple",
+	 "typed agents CSV headed by the state names");
+  TESTEQ(tst, std::count(csv.begin(), csv.end(), '\n'), num_agents / 2 + 1,
+	 "typed agents CSV has a row per living agent");
+  std::string first = csv.substr(heading.size() + 1);
+  first = first.substr(0, first.find('\n'));
+  TESTEQ(tst, std::count(first.begin(), first.end(), ','), 5,
+	 "typed agents CSV row has a value per element");
+  TEST(tst, first.find(",1,1,2,6") != std::string::npos,
+       "typed agents CSV writes bytes as numbers");
+
+  s.simulate(2, false);
+  TESTEQ(tst, s.globals.steps, 5, "typed simulation simulated again");
+  TESTEQ(tst, s.iteration(), 2, "typed simulation restarts at iteration 0");
+}
+
+/* The simple simulation's agent events, set separately or as one
+   pipeline. Returns the time taken to simulate. */
+double pipeline_simulation(Simulation &s, unsigned num_agents, bool pipeline)
+{
+  s.set_parameters({
+      {START_DATE_PARM, {1980.0}},
+	{TIME_STEP_SIZE_PARM, {1.0 / 365}},
+	  {POSITION_INIT_PARM, {0.0, 0.0}},
+	    {POSITION_UPDATE_PARM, {1.0, 2.0}},
+	      {PROB_MALE_PARM, {1.0}}
+    });
+  s.set_global_states({
+      [](Simulation *s) {
+	s->states[CURRENT_DATE_STATE] = {s->parameters[START_DATE_PARM][0]};
+      }});
+  s.set_global_events({
+      IncrementTimeEvent(s.parameters[TIME_STEP_SIZE_PARM][0])});
+  s.set_number_agents(num_agents);
+  s.set_agent_initializers({sex_state_init, alive_state_init,
+	position_state_init,
+	[](Agent *a, Simulation *s) {
+	  a->states[DOB_STATE] = {s->parameters[START_DATE_PARM][0] -
+				  a->id() % 100};
+	}});
+  if (pipeline)
+    s.set_events({make_event_pipeline(UpdatePositionEvent(), DeathEvent())});
+  else
+    s.set_events({UpdatePositionEvent(), DeathEvent()});
+  rng.seed(11);
+  clock_t t = clock();
+  s.simulate(20 * 365, false);
+  return (double) (clock() - t) / CLOCKS_PER_SEC;
+}
+
+void test_event_pipeline(tst::TestSeries &tst, unsigned num_agents,
+			 bool verbose)
+{
+  Simulation s, p;
+  double s_time = pipeline_simulation(s, num_agents, false);
+  double p_time = pipeline_simulation(p, num_agents, true);
+
+  TESTEQ(tst, p.agents.size(), s.agents.size(), "pipeline alive");
+  TESTEQ(tst, p.dead_agents.size(), s.dead_agents.size(), "pipeline dead");
+  unsigned same = 0;
+  for (size_t i = 0; i < s.agents.size() && i < p.agents.size(); ++i)
+    if (p.agents[i]->id() == s.agents[i]->id() &&
+	p.agents[i]->states[POSITION_STATE][1] ==
+	s.agents[i]->states[POSITION_STATE][1])
+      ++same;
+  TESTEQ(tst, same, s.agents.size(), "pipeline same as separate events");
+  if (verbose)
+    std::clog << "Time for agent events: " << s_time
+	      << " separately, " << p_time << " as a pipeline" << std::endl;
+}
+
+void scheduled_simulation(Simulation &s, unsigned num_agents,
+			  unsigned num_steps, real rate, int stop_iteration)
+{
+  s.set_parameters({
+      {TIME_STEP_SIZE_PARM, {1.0}},
+      {POSITION_UPDATE_PARM, {rate}}
+    });
+  s.set_number_agents(num_agents);
+  s.set_agent_initializers({
+      [](Agent *a, Simulation *s) {
+	a->states[POSITION_STATE] = {-1.0};
+      }});
+  s.set_global_events({
+      [stop_iteration](Simulation *s) {
+	if ((int) s->iteration() == stop_iteration)
+	  s->parameters[POSITION_UPDATE_PARM][0] = 0.0;
+      }});
+  s.add_scheduled_event(POSITION_UPDATE_PARM, [](Simulation *s, Agent *a) {
+      a->states[POSITION_STATE][0] = s->iteration();
+      s->kill_agent();
+    });
+  s.simulate(num_steps, false);
+}
+
+void test_scheduled_events(tst::TestSeries &tst, unsigned num_agents)
+{
+  // Deaths match the expected number of daily Bernoulli trials
+  Simulation s;
+  scheduled_simulation(s, num_agents, 10, 0.1, -1);
+  real expected = num_agents * (1.0 - std::pow(0.9, 10));
+  TESTLT(tst, std::fabs(s.dead_agents.size() - expected), 0.03 * expected,
+	 "scheduled deaths near expected number");
+  TESTEQ(tst, s.agents.size() + s.dead_agents.size(), num_agents,
+	 "scheduled deaths conserve agents");
+  bool recorded = true;
+  for (auto & a : s.dead_agents)
+    if (a->states[POSITION_STATE][0] < 0 ||
+	a->states[POSITION_STATE][0] >= 10)
+      recorded = false;
+  TEST(tst, recorded, "scheduled deaths happen in their iteration");
+
+  // Setting the rate to zero cancels the deaths after that iteration
+  Simulation z;
+  scheduled_simulation(z, num_agents, 10, 0.1, 5);
+  bool stopped = true;
+  for (auto & a : z.dead_agents)
+    if (a->states[POSITION_STATE][0] >= 5)
+      stopped = false;
+  TEST(tst, stopped, "scheduled deaths resampled after parameter change");
+  expected = num_agents * (1.0 - std::pow(0.9, 5));
+  TESTLT(tst, std::fabs(z.dead_agents.size() - expected), 0.03 * expected,
+	 "scheduled deaths near expected number before change");
+
+  // A hazard of a state changed by an agent event is resampled by
+  // reschedule(agent)
+  Simulation r;
+  r.set_parameters({{TIME_STEP_SIZE_PARM, {1.0}}});
+  r.set_number_agents(100);
+  r.set_agent_initializers({
+      [](Agent *a, Simulation *s) {
+	a->states[POSITION_STATE] = {0.0, -1.0};
+      }});
+  r.set_events({
+      [](Simulation *s, Agent *a) {
+	if (s->iteration() == 3 && a->id() % 2) {
+	  a->states[POSITION_STATE][0] = 1.0;
+	  s->reschedule(a);
+	}
+      }});
+  r.add_scheduled_event([](const Simulation *, const Agent *a) {
+      return a->states[POSITION_STATE][0] * 1.0e6;
+    }, [](Simulation *s, Agent *a) {
+      a->states[POSITION_STATE][1] = s->iteration();
+      s->kill_agent();
+    });
+  r.simulate(6, false);
+  TESTEQ(tst, r.dead_agents.size(), 50U, "rescheduled agents died");
+  bool on_time = true;
+  for (auto & a : r.dead_agents)
+    if (a->states[POSITION_STATE][1] != 3 || a->id() % 2 == 0)
+      on_time = false;
+  TEST(tst, on_time, "rescheduled agents died in the iteration of change");
+
+  // A recurring event that does not kill is resampled after it runs from a
+  // stream of its own, so firing does not make it fire again
+  Simulation c;
+  c.set_parameters({{TIME_STEP_SIZE_PARM, {1.0}}});
+  c.set_number_agents(20000);
+  c.set_agent_initializers({
+      [](Agent *a, Simulation *s) {
+	a->states[POSITION_STATE] = {0.0, 0.0};
+      }});
+  c.add_scheduled_event([](const Simulation *, const Agent *) {
+      return 0.1;
+    }, [](Simulation *s, Agent *a) {
+      if (s->iteration() < 2)
+	a->states[POSITION_STATE][s->iteration()] = 1.0;
+    });
+  c.set_counter_rng();
+  c.simulate(2, false);
+  size_t first = 0, second = 0, both = 0;
+  for (auto & a : c.agents) {
+    first += a->states[POSITION_STATE][0];
+    second += a->states[POSITION_STATE][1];
+    both += a->states[POSITION_STATE][0] * a->states[POSITION_STATE][1];
+  }
+  TESTLT(tst, std::fabs(second - 2000.0), 200.0,
+	 "recurring scheduled event fires at its rate");
+  TESTLT(tst, std::fabs((double) both / first - 0.1), 0.03,
+	 "recurring scheduled event independent of its last firing");
+}
+
+double cohort_simulation(Simulation &s, const char *filename,
+			 bool cohorts, unsigned merge_frequency)
+{
+  s.set_parameters({
+      {TIME_STEP_SIZE_PARM, {1.0}},
+      {POSITION_INIT_PARM, {0.1}},
+      {POSITION_UPDATE_PARM, {0.2}}
+    });
+  s.set_state_names({ {SEX_STATE, "sex"}, {DOB_STATE, "dob"} });
+  s.set_agent_csv_initializer(filename);
+  if (cohorts)
+    s.set_cohort_state(WEIGHT_STATE, merge_frequency);
+  s.set_agent_initializers({
+      [](Agent *a, Simulation *s) {
+	a->states[POSITION_STATE] = {0.0};
+      }});
+  s.set_events({
+      [](Simulation *s, Agent *a) {
+	if (a->states[POSITION_STATE][0] == 0 &&
+	    s->is_event(POSITION_INIT_PARM))
+	  a->states[POSITION_STATE][0] = 1;
+      },
+	// Infected agents have a second chance of dying
+	[](Simulation *s, Agent *a) {
+	  if (s->is_event(POSITION_UPDATE_PARM) ||
+	      (a->states[POSITION_STATE][0] == 1 &&
+	       s->is_event(POSITION_UPDATE_PARM)))
+	    s->kill_agent();
+	}});
+  s.add_death_counter("infected", [](const Agent *a) {
+      return a->states.at(POSITION_STATE)[0] == 1;
+    });
+  s.add_aggregate("infected", [](const Agent *a) {
+      return a->states.at(POSITION_STATE)[0] == 1;
+    });
+  auto start = std::chrono::steady_clock::now();
+  s.simulate(3, false);
+  return std::chrono::duration<double>
+    (std::chrono::steady_clock::now() - start).count();
+}
+
+void test_cohorts(tst::TestSeries &tst, const char *filename, bool verbose)
+{
+  // Expected numbers alive uninfected and infected
+  real uninfected = 86880, infected = 0;
+  for (int i = 0; i < 3; ++i) {
+    infected = (infected + 0.1 * uninfected) * 0.64;
+    uninfected *= 0.9 * 0.8;
+  }
+  auto infected_weight = [](const Simulation &s) {
+    real total = 0.0;
+    for (auto & a : s.agents)
+      if (a->states[POSITION_STATE][0] == 1)
+	total += s.weight(a);
+    return total;
+  };
+
+  Simulation i, c, m;
+  double i_time = cohort_simulation(i, filename, false, 0);
+  double c_time = cohort_simulation(c, filename, true, 0);
+  cohort_simulation(m, filename, true, 1);
+
+  TESTEQ(tst, i.population(), i.agents.size(), "population of individuals");
+  for (auto s : {&i, &c, &m}) {
+    TESTLT(tst, std::fabs(s->population() - uninfected - infected),
+	   0.02 * (uninfected + infected), "cohort survivors near expected");
+    TESTLT(tst, std::fabs(infected_weight(*s) - infected), 0.05 * infected,
+	   "infected cohorts near expected");
+    TESTEQ(tst, s->population() + s->num_dead(), 86880,
+	   "cohorts conserve individuals");
+    TESTEQ(tst, s->aggregate("infected"), infected_weight(*s),
+	   "cohort aggregate");
+  }
+  TEST(tst, c.num_dead("infected") > 0 &&
+       c.num_dead("infected") < c.num_dead(),
+       "cohort death counter counts individuals");
+  TESTLT(tst, c.agents.size() + c.dead_agents.size(), 1000,
+	 "cohorts far fewer than individuals");
+  TESTLT(tst, m.agents.size(), 2 * 22 + 1, "merged cohorts");
+  real merged_weight = 0.0;
+  std::set< std::pair<real, real> > keys;
+  for (auto & a : m.agents) {
+    keys.insert({a->states[DOB_STATE][0] * 10 + a->states[SEX_STATE][0],
+	  a->states[POSITION_STATE][0]});
+    merged_weight += m.weight(a);
+  }
+  TESTEQ(tst, keys.size(), m.agents.size(), "merged cohorts are distinct");
+  TESTEQ(tst, merged_weight, m.population(), "merged cohort weights");
+  if (verbose)
+    std::clog << "Time for 3 steps: " << i_time << " individuals, "
+	      << c_time << " cohorts" << std::endl;
+}
+
+void test_aggregates(tst::TestSeries &tst, unsigned num_agents)
+{
+  for (unsigned threads : {1, 4}) {
+    Simulation s;
+    s.set_parameters({
+	{TIME_STEP_SIZE_PARM, {1.0}},
+	{POSITION_INIT_PARM, {0.05}},
+	{POSITION_UPDATE_PARM, {0.02}}
+      });
+    s.set_number_agents(num_agents);
+    s.set_agent_initializers({
+	[](Agent *a, Simulation *s) {
+	  a->states[POSITION_STATE] = {0.0, 0.0};
+	}});
+    // Appended agents are counted too
+    s.set_global_events({
+	[](Simulation *s) {
+	  for (int i = 0; i < 10; ++i)
+	    s->append_agent()->states[POSITION_STATE] = {0.0, 1.0};
+	}});
+    s.set_events({
+	[](Simulation *s, Agent *a) {
+	  if (a->states[POSITION_STATE][0] == 0 &&
+	      s->is_event(POSITION_INIT_PARM))
+	    s->set_state(a, POSITION_STATE, 0, 1.0);
+	},
+	  [](Simulation *s, Agent *a) {
+	    a->states[POSITION_STATE][1] += 1.0;
+	    if (s->is_event(POSITION_UPDATE_PARM))
+	      s->kill_agent();
+	  }});
+    s.add_scheduled_event(POSITION_UPDATE_PARM, [](Simulation *s, Agent *a) {
+	a->states[POSITION_STATE][1] = 0.0;
+	s->kill_agent();
+      });
+    s.add_aggregate("infected", [](const Agent *a) {
+	return a->states.at(POSITION_STATE)[0] == 1;
+      }, {POSITION_STATE});
+    s.add_aggregate("alive", [](const Agent *) { return true; });
+    s.add_aggregate("total", [](const Agent *) { return true; }, {},
+      [](const Agent *a) { return a->states.at(POSITION_STATE)[1]; });
+    bool same = true;
+    s.set_reports({
+	{[&same](const Simulation *s) {
+	    real infected = 0.0, total = 0.0;
+	    for (auto & a : s->agents) {
+	      infected += a->states.at(POSITION_STATE)[0];
+	      total += a->states.at(POSITION_STATE)[1];
+	    }
+	    if (s->aggregate("infected") != infected ||
+		s->aggregate("alive") != s->agents.size() ||
+		s->aggregate(2) != total)
+	      same = false;
+	  }, 1, true, true}});
+    s.set_agent_threads(threads);
+    s.simulate(20, true);
+    TEST(tst, same, "aggregates equal scans");
+    TESTLT(tst, 0, s.aggregate("infected"), "aggregate infected counted");
+    TESTLT(tst, 0, s.num_dead(), "aggregates kills");
+  }
+}
+
+void test_guarded_events(tst::TestSeries &tst, unsigned num_agents)
+{
+  // POSITION_STATE is a stage from 0 to 3, then the number of calls of the
+  // guarded event for stages 1 and 2, and of those for other stages.
+  Simulation s;
+  s.set_parameters({
+      {TIME_STEP_SIZE_PARM, {1.0}},
+      {POSITION_UPDATE_PARM, {0.2}}
+    });
+  s.set_number_agents(num_agents);
+  s.set_agent_initializers({
+      [](Agent *a, Simulation *s) {
+	a->states[POSITION_STATE] = {(real) (a->id() % 2), 0.0, 0.0};
+      }});
+  s.set_events({
+      [](Simulation *s, Agent *a) {
+	if (a->states[POSITION_STATE][0] == 0 &&
+	    s->is_event(POSITION_UPDATE_PARM))
+	  s->set_state(a, POSITION_STATE, 0, 1.0);
+      }});
+  s.add_guarded_event(POSITION_STATE, {1, 2}, [](Simulation *s, Agent *a) {
+      real stage = a->states[POSITION_STATE][0];
+      if (stage == 1 || stage == 2)
+	a->states[POSITION_STATE][1] += 1.0;
+      else
+	a->states[POSITION_STATE][2] += 1.0;
+      if (s->is_event(POSITION_UPDATE_PARM))
+	s->set_state(a, POSITION_STATE, 0, stage + 1);
+      else if (stage == 2 && s->is_event(POSITION_UPDATE_PARM))
+	s->kill_agent();
+    });
+  s.simulate(20, false);
+
+  bool eligible = true;
+  size_t counts[4] = {0, 0, 0, 0};
+  for (auto & a : s.agents) {
+    if (a->states[POSITION_STATE][2] != 0)
+      eligible = false;
+    ++counts[(size_t) a->states[POSITION_STATE][0]];
+  }
+  TEST(tst, eligible, "guarded event only called for its stages");
+  bool indexed = true;
+  for (int stage = 0; stage < 4; ++stage)
+    if (s.indexed_agents(POSITION_STATE, stage).size() != counts[stage])
+      indexed = false;
+  TEST(tst, indexed, "state index buckets match the states");
+  TESTLT(tst, 0, counts[3], "guarded events moved agents through stages");
+  TESTLT(tst, 0, s.dead_agents.size(), "guarded events killed agents");
+  bool alive = true;
+  for (auto & a : s.dead_agents)
+    if (a->states[POSITION_STATE][0] != 2)
+      alive = false;
+  TEST(tst, alive, "guarded events killed only their agents");
+  bool thrown = false;
+  try {
+    s.indexed_agents(DOB_STATE, 0);
+  } catch (SimulationException &e) {
+    thrown = true;
+  }
+  TEST(tst, thrown, "unindexed state throws");
+}
+
+/* The ids of the agents in the order the agent events visit them, for
+   each of num_steps iterations. */
+std::vector< std::vector<unsigned long> >
+agent_order_simulation(Simulation &s, unsigned num_agents, unsigned num_steps)
+{
+  std::vector< std::vector<unsigned long> > orders(num_steps);
+  s.set_parameters({{TIME_STEP_SIZE_PARM, {1.0}}});
+  s.set_number_agents(num_agents);
+  s.set_events({
+      [&orders](Simulation *s, Agent *a) {
+	std::unique_lock<std::mutex> lock = s->lock_globals();
+	orders[s->iteration()].push_back(a->id());
+      }});
+  s.simulate(num_steps, false);
+  return orders;
+}
+
+void test_agent_order(tst::TestSeries &tst, unsigned num_agents)
+{
+  auto permutation = [num_agents](std::vector<unsigned long> order) {
+    std::sort(order.begin(), order.end());
+    for (size_t i = 0; i < order.size(); ++i)
+      if (order[i] != i)
+	return false;
+    return order.size() == num_agents;
+  };
+
+  for (AgentOrder policy : {FULL_SHUFFLE, BLOCK_SHUFFLE, ROTATE_SHUFFLE,
+	NO_SHUFFLE}) {
+    Simulation s;
+    s.set_agent_order(policy, 100);
+    auto orders = agent_order_simulation(s, num_agents, 3);
+    bool all = true;
+    for (auto & order : orders)
+      all = all && permutation(order);
+    TEST(tst, all, "agent order visits every agent once");
+    TEST(tst, policy == NO_SHUFFLE ? orders[0] == orders[2] :
+	 orders[0] != orders[1], "agent order changes unless not shuffled");
+  }
+
+  // The first iteration orders the agents as they were appended
+  Simulation b;
+  b.set_agent_order(BLOCK_SHUFFLE, 100);
+  auto order = agent_order_simulation(b, num_agents, 1)[0];
+  bool blocks = true;
+  for (size_t i = 0; i < order.size(); ++i)
+    if (order[i] / 100 != order[i - i % 100] / 100)
+      blocks = false;
+  TEST(tst, blocks, "block shuffle keeps agents in their blocks");
+
+  Simulation r;
+  r.set_agent_order(ROTATE_SHUFFLE);
+  order = agent_order_simulation(r, num_agents, 1)[0];
+  bool strided = true;
+  for (size_t i = 2; i < order.size(); ++i)
+    if ((order[i] + num_agents - order[i - 1]) % num_agents !=
+	(order[1] + num_agents - order[0]) % num_agents)
+      strided = false;
+  TEST(tst, strided, "rotate shuffle visits agents by a stride");
+
+  Simulation p, q;
+  p.set_agent_order(PARALLEL_SHUFFLE);
+  p.set_agent_threads(4);
+  q.set_agent_order(PARALLEL_SHUFFLE);
+  q.set_agent_threads(4);
+  auto p_orders = agent_order_simulation(p, num_agents, 3);
+  auto q_orders = agent_order_simulation(q, num_agents, 3);
+  bool all = true;
+  for (auto & order : p_orders)
+    all = all && permutation(order);
+  TEST(tst, all, "parallel shuffle visits every agent once");
+  // The agents of a chunk are visited in order of the shuffle on one
+  // thread, so compare the orders the shuffle produced.
+  TEST(tst, p.agents.size() == q.agents.size() &&
+       std::equal(p.agents.begin(), p.agents.end(), q.agents.begin(),
+		  [](const Agent *a, const Agent *b) {
+		    return a->id() == b->id();
+		  }), "parallel shuffle independent of scheduling");
+}
+
+void test_profiler(tst::TestSeries &tst, unsigned num_agents)
+{
+  Profiler p;
+  p.set_threads(2);
+  p.set_names(Profiler::AGENT_EVENT, {"infection"});
+  p.record(Profiler::AGENT_EVENT, 0, std::chrono::microseconds(3));
+  p.record(Profiler::AGENT_EVENT, 0, std::chrono::microseconds(5), 1);
+  p.end_iteration();
+  p.record(Profiler::AGENT_EVENT, 1, std::chrono::milliseconds(1));
+  p.end_iteration();
+  const std::vector<Profiler::Entry> &entries =
+    p.entries(Profiler::AGENT_EVENT);
+  TESTEQ(tst, p.iterations(), 2, "profiler counts iterations");
+  TESTEQ(tst, entries[0].calls, 2, "profiler adds up the threads' calls");
+  TEST(tst, entries[0].time == std::chrono::microseconds(8),
+       "profiler adds up the threads' times");
+  TESTEQ(tst, entries[0].histogram[4], 1,
+	 "profiler histogram of time per iteration");
+  TEST(tst, p.name(Profiler::AGENT_EVENT, 0) == "infection" &&
+       p.name(Profiler::AGENT_EVENT, 1) == "agent event 1" &&
+       p.name(Profiler::PHASE, Profiler::SHUFFLE) == "shuffle",
+       "profiler names");
+  Profiler q;
+  q.merge(p);
+  q.merge(p);
+  TEST(tst, q.iterations() == 4 &&
+       q.entries(Profiler::AGENT_EVENT)[1].calls == 2,
+       "profiler merge");
+  std::ostringstream table, json;
+  p.print(table);
+  p.print_json(json);
+  TEST(tst, table.str().find("infection") != std::string::npos &&
+       json.str().find("\"name\": \"infection\"") != std::string::npos,
+       "profiler prints table and JSON");
+
+  auto configure = [num_agents](Simulation &s) {
+    s.set_parameters({{TIME_STEP_SIZE_PARM, {1.0 / 365}}});
+    s.set_agent_initializers({[](Agent *a, Simulation *s) {}});
+    s.set_global_events({[](Simulation *s) {}});
+    s.set_events({
+	[](Simulation *s, Agent *a) {},
+	  [](Simulation *s, Agent *a) {
+	    if (a->id() % 10 == 0)
+	      s->kill_agent();
+	  }});
+    s.set_number_agents(num_agents);
+  };
+  Simulation s;
+  std::ostringstream out;
+  configure(s);
+  s.set_profile_output(&out, true);
+  s.set_profile_names(Profiler::GLOBAL_EVENT, {"time"});
+  s.simulate(10, false);
+#ifdef SIM_PROFILE
+  const Profiler &profile = s.profile();
+  TESTEQ(tst, profile.iterations(), 10, "profile of simulation iterations");
+  TESTEQ(tst, profile.entries(Profiler::GLOBAL_EVENT)[0].calls, 10,
+	 "profile of global event calls");
+  TESTEQ(tst, profile.entries(Profiler::AGENT_EVENT)[0].calls,
+	 10 * num_agents - num_agents / 10 * 9,
+	 "profile of agent event calls");
+  TESTEQ(tst, profile.entries(Profiler::PHASE)[Profiler::SHUFFLE].calls, 10,
+	 "profile of shuffle");
+  TEST(tst, out.str().find("\"name\": \"time\"") != std::string::npos,
+       "profile printed at end of simulation");
+
+  Simulation m;
+  std::ostringstream mc_out;
+  configure(m);
+  m.set_profile_output(&mc_out);
+  m.montecarlo(5, false, {}, [](const Simulation *s, unsigned i) {
+      return i < 3;
+    });
+  size_t printed = 0;
+  for (size_t i = mc_out.str().find("Profile of"); i != std::string::npos;
+       i = mc_out.str().find("Profile of", i + 1))
+    ++printed;
+  TEST(tst, m.profile().iterations() == 15 && printed == 1,
+       "profile of all Monte Carlo replicates printed once");
+#else
+  TEST(tst, s.profile().iterations() == 0 && out.str().empty(),
+       "no profile without SIM_PROFILE");
+#endif
+}
+
+void test_async_reports(tst::TestSeries &tst, unsigned num_agents)
+{
+  struct Counts {
+    unsigned iteration;
+    size_t alive;
+  };
+  std::vector<Counts> sync_counts, async_counts;
+  auto configure = [num_agents](Simulation &s) {
+    s.set_parameters({{TIME_STEP_SIZE_PARM, {1.0 / 365}}});
+    s.set_agent_initializers({[](Agent *a, Simulation *s) {}});
+    s.set_events({
+	[](Simulation *s, Agent *a) {
+	  if (uniform_real(rng) < 0.01)
+	    s->kill_agent();
+	}});
+    s.set_number_agents(num_agents);
+  };
+  auto capture = [](const Simulation *s) {
+    return Counts({s->iteration(), s->agents.size()});
+  };
+
+  Simulation s;
+  configure(s);
+  s.set_reports({{[&](const Simulation *s) {
+	  sync_counts.push_back(capture(s));
+	}, 5, true, true}});
+  // A slow writer, so that snapshots wait for it
+  s.add_async_report(capture, [&async_counts](const Counts &counts) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      async_counts.push_back(counts);
+    }, 5);
+  s.simulate(50, true);
+  TEST(tst, async_counts.size() == 12 &&
+       async_counts.size() == sync_counts.size() &&
+       std::equal(async_counts.begin(), async_counts.end(),
+		  sync_counts.begin(),
+		  [](const Counts &a, const Counts &b) {
+		    return a.iteration == b.iteration && a.alive == b.alive;
+		  }), "asynchronous reports see the report points' states");
+
+  Simulation one;
+  configure(one);
+  std::vector<unsigned> iterations;
+  one.set_report_buffers(1);
+  one.add_async_report([](const Simulation *s) { return s->iteration(); },
+		       [&iterations](const unsigned &i) {
+			 iterations.push_back(i);
+		       }, 1, false, false);
+  one.simulate(20, true);
+  bool ordered = iterations.size() == 20;
+  for (size_t i = 0; i < iterations.size(); ++i)
+    ordered = ordered && iterations[i] == i;
+  TEST(tst, ordered, "asynchronous reports written in order");
+
+  Simulation bad;
+  configure(bad);
+  bad.add_async_report([](const Simulation *s) { return s->iteration(); },
+		       [](const unsigned &i) {
+			 if (i == 3)
+			   throw SimulationException("write failed");
+		       }, 1);
+  bool thrown = false;
+  try {
+    bad.simulate(10, true);
+  } catch (SimulationException &e) {
+    thrown = strcmp(e.what(), "write failed") == 0;
+  }
+  TEST(tst, thrown, "asynchronous report exception rethrown");
+}
+
+void test_time_series(tst::TestSeries &tst, unsigned num_agents)
+{
+  char filename[] = "/tmp/testsimseriesXXXXXX";
+  int fd = mkstemp(filename);
+  if (fd == -1)
+    throw SimulationException("Can't create temporary file.");
+  close(fd);
+  std::vector< std::vector<real> > expected;
+  {
+    // Small blocks, so that the rows span several of them
+    TimeSeriesWriter writer(filename, {"alive", "dead"}, 7);
+    Simulation s;
+    s.set_number_agents(num_agents);
+    s.set_agent_initializers({[](Agent *a, Simulation *s) {}});
+    s.set_events({
+	[](Simulation *s, Agent *a) {
+	  if (a->id() % 10 == s->iteration())
+	    s->kill_agent();
+	}});
+    s.set_reports({
+	{writer.report({
+	      [](const Simulation *s) { return (real) s->agents.size(); },
+	      [](const Simulation *s) { return (real) s->num_dead(); }}),
+	    1, true, false},
+	{[&expected](const Simulation *s) {
+	    expected.push_back({(real) s->replicate(),
+		  (real) s->completed_iterations(),
+		  (real) s->agents.size(), (real) s->num_dead()});
+	  }, 1, true, false}});
+    s.set_replicate(3);
+    s.simulate(5, true);
+    writer.flush();
+  }
+  std::vector<std::string> names;
+  std::vector< std::vector<real> > rows;
+  TimeSeriesWriter::read(filename,
+			 [&rows](unsigned replicate, unsigned long iteration,
+				 const std::vector<real> &values) {
+			   rows.push_back({(real) replicate, (real) iteration,
+				 values[0], values[1]});
+			 }, &names);
+  TEST(tst, names.size() == 2 && names[0] == "alive" && names[1] == "dead",
+       "time series names");
+  TESTEQ(tst, rows.size(), 6, "time series rows");
+  TEST(tst, rows == expected, "time series values");
+  bool keyed = true;
+  for (size_t i = 0; i < rows.size(); ++i)
+    if (rows[i][1] != i)
+      keyed = false;
+  TEST(tst, keyed, "time series rows keyed by completed iterations");
+
+  // Cut the last block short: the whole blocks before it are still read
+  {
+    TimeSeriesWriter writer(filename, {"value"}, 2);
+    for (unsigned i = 0; i < 5; ++i)
+      writer.append(0, i, {1.0 * i});
+    writer.flush();
+  }
+  size_t num_read = 0;
+  auto count_row = [&num_read](unsigned, unsigned long,
+			       const std::vector<real> &) {
+    ++num_read;
+  };
+  bool complete = TimeSeriesWriter::read(filename, count_row);
+  TEST(tst, complete && num_read == 5, "time series read whole");
+  struct stat st;
+  if (stat(filename, &st) != 0 || truncate(filename, st.st_size - 3) != 0)
+    throw SimulationException("Can't truncate temporary file.");
+  num_read = 0;
+  complete = TimeSeriesWriter::read(filename, count_row);
+  TEST(tst, complete == false && num_read == 4,
+       "time series cut short read up to its last whole block");
+  bool thrown = false;
+  try {
+    TimeSeriesWriter(filename, {"alive"}).append(0, 0, {1.0, 2.0});
+  } catch (SimulationException &e) {
+    thrown = true;
+  }
+  TEST(tst, thrown, "time series rejects rows of the wrong size");
+  unlink(filename);
+}
+
+void counter_rng_simulation(Simulation &s, unsigned num_agents,
+			    unsigned num_threads)
+{
+  s.set_parameters({
+      {TIME_STEP_SIZE_PARM, {1.0 / 365}},
+      {PROB_MALE_PARM, {0.5}},
+      {POSITION_UPDATE_PARM, {0.9}}
+    });
+  s.set_number_agents(num_agents);
+  s.set_agent_initializers({
+      [](Agent *a, Simulation *s) {
+	a->states[SEX_STATE] = {(real) (uniform_real(agent_rng) < 0.5)};
+	a->states[POSITION_STATE] = {0.0};
+      }});
+  s.set_events({
+      [](Simulation *s, Agent *a) {
+	if (s->iteration() == 5)
+	  a->states[POSITION_STATE][0] = uniform_real(agent_rng);
+      },
+	[](Simulation *s, Agent *a) {
+	  if (s->is_event(POSITION_UPDATE_PARM))
+	    s->kill_agent();
+	}});
+  s.set_counter_rng();
+  // Without threads the agents are stepped by the plain serial loop
+  if (num_threads)
+    s.set_agent_threads(num_threads, 8);
+  s.simulate(10, false);
+}
+
+void test_counter_rng(tst::TestSeries &tst, unsigned num_agents)
+{
+  // Known answer from the Random123 test vectors
+  const uint32_t key[2] = {0, 0};
+  const uint32_t counter[4] = {0, 0, 0, 0};
+  uint32_t out[4];
+  CounterRng::philox(key, counter, out);
+  TEST(tst, out[0] == 0x6627e8d5 && out[1] == 0xe169c58d &&
+       out[2] == 0xbc57ac4c && out[3] == 0x9b00dbd8,
+       "Philox4x32-10 known answer");
+
+  Simulation serial, two_threads, parallel;
+  counter_rng_simulation(serial, num_agents, 0);
+  counter_rng_simulation(two_threads, num_agents, 2);
+  counter_rng_simulation(parallel, num_agents, 4);
+
+  auto outcomes = [](const Simulation &s) {
+    std::vector<real> result(3 * s.agent_store.size());
+    for (auto & a : s.agents) {
+      result[3 * a->id()] = 1.0;
+      result[3 * a->id() + 1] = a->states.at(SEX_STATE)[0];
+      result[3 * a->id() + 2] = a->states.at(POSITION_STATE)[0];
+    }
+    for (auto & a : s.dead_agents) {
+      result[3 * a->id() + 1] = a->states.at(SEX_STATE)[0];
+      result[3 * a->id() + 2] = a->states.at(POSITION_STATE)[0];
+    }
+    return result;
+  };
+  TEST(tst, outcomes(serial) == outcomes(two_threads),
+       "counter rng results same serially and with two threads");
+  TEST(tst, outcomes(serial) == outcomes(parallel),
+       "counter rng results independent of threads");
+  TESTLT(tst, 0, serial.dead_agents.size(), "counter rng killed agents");
+
+  bool replayed = true;
+  for (auto & a : serial.agents) {
+    CounterRng stream = serial.agent_stream(a->id(), 5, 0);
+    if (a->states[POSITION_STATE][0] != uniform_real(stream))
+      replayed = false;
+  }
+  TEST(tst, replayed, "counter rng agent stream replayed");
+}
+
 /* Convert string argument to unsigned. */
 unsigned strtou(char *str)
 {
@@ -627,9 +2086,33 @@ int main(int argc, char *argv[])
       test_parameter_csv_simulation(t, parameter_csv_filename.c_str(), verbose);
 
     test_norm_functions(t);
+    test_csv_file(t);
+    test_probability_cache(t);
+    test_batch_events(t);
+    test_agent_store(t);
+    test_parallel_agent_events(t, 1000);
+    test_counter_rng(t, 1000);
+    test_agent_pool(t);
+    test_deferred_kills(t, 1000);
+    test_dead_agent_archive(t, 1000);
+    test_population_snapshot(t, 1000);
+    test_checkpoint(t, 1000);
+    test_typed_simulation(t, 1000);
+    test_event_pipeline(t, num_agents, verbose);
+    test_scheduled_events(t, 10000);
+    test_aggregates(t, 2000);
+    test_guarded_events(t, 2000);
+    test_agent_order(t, 20000);
+    test_profiler(t, 1000);
+    test_async_reports(t, 1000);
+    test_time_series(t, 1000);
+    if (agent_csv_filename != "" && agent_csv_filename != "_")
+      test_cohorts(t, agent_csv_filename.c_str(), verbose);
     // Run the Monte Carlo simulation if number of simulations to run > 0
     if (num_mc_simulations > 0)
       test_monte_carlo(t, num_agents, num_mc_simulations, verbose);
+    if (num_mc_simulations > 0)
+      test_parallel_monte_carlo(t, num_agents, num_mc_simulations, verbose);
 
     t.summary();
   } catch(std::exception &e) {
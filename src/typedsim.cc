@@ -0,0 +1,220 @@
+/*
+  The simplesim model of HIV infection, stage transition and mortality
+  written against TypedSimulation, with its agent states declared at
+  compile time.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+#include "sim/sim.hh"
+
+using namespace sim;
+
+/* STATES */
+
+struct Dob : TypedState<double> {
+  static const char *name() { return "dob"; }
+};
+struct Alive : TypedState<bool> {
+  static const char *name() { return "alive"; }
+};
+struct DeathAge : TypedState<double> {
+  static const char *name() { return "death age"; }
+};
+struct Sex : TypedState<uint8_t> {
+  static const char *name() { return "sex"; }
+};
+// 0 is HIV negative, 1 to 4 the stage of infection.
+struct Hiv : TypedState<uint8_t> {
+  static const char *name() { return "hiv"; }
+};
+struct HivInfectionDate : TypedState<double> {
+  static const char *name() { return "hiv infection date"; }
+};
+
+// Global states and parameters. The rates are per year and the
+// probabilities per time step.
+struct Globals {
+  double start_date = 2010.0;
+  double time_step = 1.0 / 365;
+  double current_date = 2010.0;
+  double prob_male = 0.5;
+  double initial_hiv_infection_rate = 0.1;
+  double hiv_infection_prob = 0.0;
+  double hiv_transition_prob = 0.0;
+  double background_mortality_prob = 0.0;
+};
+
+typedef TypedSimulation<Globals, Dob, Alive, DeathAge, Sex, Hiv,
+			HivInfectionDate> HivSimulation;
+typedef HivSimulation::AgentRef AgentRef;
+
+/* STATE INITIATION */
+
+void dob_state_init(HivSimulation &s, AgentRef a)
+{
+  std::normal_distribution<double> dis (25.0, 10.0);
+  a.get<Dob>() = s.globals.start_date - std::max(dis(rng), 15.0);
+}
+
+void alive_state_init(HivSimulation &s, AgentRef a)
+{
+  a.get<Alive>() = true;
+  a.get<DeathAge>() = 0.0;
+}
+
+void sex_state_init(HivSimulation &s, AgentRef a)
+{
+  a.get<Sex>() = uniform_real(rng) < s.globals.prob_male ? MALE : FEMALE;
+}
+
+void hiv_state_init(HivSimulation &s, AgentRef a)
+{
+  if (uniform_real(rng) < s.globals.initial_hiv_infection_rate) {
+    a.get<Hiv>() = 1;
+    a.get<HivInfectionDate>() = s.globals.start_date;
+  } else {
+    a.get<Hiv>() = 0;
+    a.get<HivInfectionDate>() = 0.0;
+  }
+}
+
+/* EVENTS */
+
+void increment_time_event(HivSimulation &s)
+{
+  s.globals.current_date += s.globals.time_step;
+}
+
+void hiv_infection_event(HivSimulation &s, AgentRef a)
+{
+  if (a.get<Hiv>() == 0 && s.is_event(s.globals.hiv_infection_prob)) {
+    a.get<Hiv>() = 1;
+    a.get<HivInfectionDate>() = s.globals.current_date;
+  }
+}
+
+void hiv_transition_event(HivSimulation &s, AgentRef a)
+{
+  uint8_t &stage = a.get<Hiv>();
+  if (stage > 0 && stage < 4 && s.is_event(s.globals.hiv_transition_prob))
+    ++stage;
+}
+
+void death_event(HivSimulation &s, AgentRef a)
+{
+  bool must_die = s.is_event(s.globals.background_mortality_prob);
+  if (must_die == false && a.get<Hiv>() == 4)
+    must_die = s.is_event(s.globals.background_mortality_prob);
+  if (must_die) {
+    a.get<Alive>() = false;
+    a.get<DeathAge>() = s.globals.current_date;
+    s.kill_agent(a);
+  }
+}
+
+/* REPORTS */
+
+void mortality_report(const HivSimulation &s)
+{
+  const HivSimulation::Column<Hiv> &hiv = s.column<Hiv>();
+  size_t num_alive_hiv = std::count_if(s.agents().begin(), s.agents().end(),
+				       [&hiv](const size_t slot) {
+					 return hiv[slot] > 0;
+				       });
+  size_t num_dead_hiv = std::count_if(s.dead_agents().begin(),
+				      s.dead_agents().end(),
+				      [&hiv](const size_t slot) {
+					return hiv[slot] > 0;
+				      });
+  std::cout << "Alive\tHIV+\tDead\tHIV+" << std::endl;
+  std::cout << s.agents().size() << "\t" << num_alive_hiv << "\t"
+	    << s.dead_agents().size() << "\t" << num_dead_hiv << std::endl;
+}
+
+/* SIMULATION */
+
+void typed_simulation(unsigned num_agents, bool verbose)
+{
+  HivSimulation s;
+
+  s.globals.hiv_infection_prob = s.prob_event(0.02, 1.0,
+					      s.globals.time_step);
+  s.globals.hiv_transition_prob = s.prob_event(0.3, 1.0,
+					       s.globals.time_step);
+  s.globals.background_mortality_prob = s.prob_event(0.01, 1.0,
+						     s.globals.time_step);
+  s.globals.current_date = s.globals.start_date;
+  s.set_number_agents(num_agents);
+  s.set_agent_initializers({dob_state_init, alive_state_init,
+	sex_state_init, hiv_state_init});
+  s.set_global_events({increment_time_event});
+  s.set_events({hiv_infection_event, hiv_transition_event, death_event});
+  s.set_reports({{mortality_report, 0, true, true}});
+
+  auto start = std::chrono::steady_clock::now();
+  s.simulate(20.0 / s.globals.time_step, false);
+  if (verbose)
+    std::clog << "Time taken: "
+	      << std::chrono::duration<double>
+      (std::chrono::steady_clock::now() - start).count()
+	      << "s" << std::endl;
+}
+
+void display_help(const char *prog_name, const char *msg)
+{
+  if (strcmp(msg, "") != 0)
+    std::cerr << msg << std::endl;
+
+  std::cerr << "Typed microsimulation test program\n\n"
+	    << "Usage: "
+	    << prog_name
+	    << " [-a num_agents] [-v] [-h]\n\n"
+	    << "\t-a\tsets the number of agents\n"
+	    << "\t-v\tprints out the time taken\n"
+	    << "\t-h\tprints out this help text"
+	    << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned num_agents = 12;
+  bool verbose = false;
+  int opt;
+
+  try {
+    while ((opt = getopt(argc, argv, "a:vh")) != -1) {
+      switch (opt) {
+      case 'a':
+	num_agents = strtou(optarg);
+	break;
+      case 'v':
+	verbose = true;
+	break;
+      case 'h':
+	display_help(argv[0], "");
+	return EXIT_SUCCESS;
+      default:
+	throw ArgException();
+      }
+    }
+  } catch (std::exception &e) {
+    display_help(argv[0], e.what());
+    return EXIT_FAILURE;
+  }
+
+  try {
+    typed_simulation(num_agents, verbose);
+  } catch(std::exception &e) {
+    std::cerr << "An Exception occurred: " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}